@@ -0,0 +1,449 @@
+/*
+ * Determinants and solves of lots of small matrices at once
+ * Evan Perry Grove, 2017
+ *
+ * small.h makes one small matrix fast, but one 4x4 elimination is only a few
+ * dozen flops, and most of those depend on the one before, so one at a time
+ * never fills up a SIMD register. When there are thousands of same-size
+ * matrices to get through, it's better to turn the problem sideways: put
+ * element (i, j) of every matrix next to each other in memory (structure of
+ * arrays), and run the elimination on BATCH_LANES matrices at once, one per
+ * SIMD lane. Every lane does the exact same instructions, so pivoting can't
+ * branch: each lane picks its own pivot row with compares and selects, and a
+ * zero pivot gets divided by 1 instead and remembered.
+ *
+ * SmallBatch holds the block. batchDeterminants() and batchSolve() split it
+ * into groups of BATCH_LANES matrices and spread the groups across the shared
+ * pool once there are enough of them to be worth it. The kernels are written
+ * with GCC vector extensions and built once per instruction set, and the one
+ * that runs is whichever rowops.h picked (so GJ_SIMD works here too).
+ */
+
+#ifndef BATCHED_H
+#define BATCHED_H
+
+#include <cmath>
+#include <cstddef>
+#include <cstring>
+#include <string>
+#include <vector>
+
+#include "matrix.h"
+#include "rowops.h"
+#include "small.h"
+#include "threadpool.h"
+#include "metrics.h"
+
+const int BATCH_LANES = 8;                                  // matrices per group: one AVX-512 register of doubles
+const int BATCH_PARALLEL_MIN = 4096;                        // fewer matrices than this and it all runs on this thread
+const int BATCH_GRAIN = 64;                                 // groups of BATCH_LANES per parallelFor chunk
+const int BATCH_STREAM_COUNT = 16384;                       // matrices the tools collect before running a batch
+
+// the helpers below return vectors, which gcc warns changes the ABI when AVX isn't on. They're always inlined into
+// kernels that have it on, so there's never a call for the ABI to matter to. (gcc only gets around to warning at the
+// end of the file, so this can't be popped again afterwards.)
+#pragma GCC diagnostic ignored "-Wpsabi"
+
+// one register of doubles for SSE2 (and anything else with 16 byte vectors), AVX2 and AVX-512. Comparing two of
+// them gives a mask of the same width, all ones in the lanes where it's true.
+typedef double Lanes2 __attribute__((vector_size(16)));
+typedef double Lanes4 __attribute__((vector_size(32)));
+typedef double Lanes8 __attribute__((vector_size(64)));
+
+template <class V>
+using LaneMask = decltype(V() < V());
+
+// count same-size matrices, stored as a structure of arrays: row i * cols() + j of elements() holds element (i, j)
+// of every matrix in the batch, matrix m in column m. The capacity is rounded up to whole groups of BATCH_LANES, so
+// the kernels can always work on full groups; whatever is in the lanes past size() gets computed and ignored.
+class SmallBatch
+{
+public:
+    SmallBatch() : nRows(0), nCols(0), count(0) {}
+
+    SmallBatch(int rows, int cols, int capacity)
+        : nRows(rows), nCols(cols), count(0),
+          data(rows * cols, (capacity + BATCH_LANES - 1) / BATCH_LANES * BATCH_LANES)
+    {
+    }
+
+    int rows() const { return nRows; }
+    int cols() const { return nCols; }
+    int size() const { return count; }
+    int capacity() const { return data.cols(); }
+    bool full() const { return count == capacity(); }
+    void clear() { count = 0; }
+    void resize(int matrices) { count = matrices; }
+
+    // add the leading rows() x cols() block of m to the end.
+    void push(const Matrix& m)
+    {
+        for (int i = 0; i < nRows; i++)
+        {
+            for (int j = 0; j < nCols; j++)
+            {
+                data[i * nCols + j][count] = m[i][j];
+            }
+        }
+        count++;
+    }
+
+    // matrix index back out as a Matrix.
+    Matrix get(int index) const
+    {
+        Matrix m(nRows, nCols);
+        for (int i = 0; i < nRows; i++)
+        {
+            for (int j = 0; j < nCols; j++)
+            {
+                m[i][j] = data[i * nCols + j][index];
+            }
+        }
+        return m;
+    }
+
+    const Matrix& elements() const { return data; }
+    Matrix& elements() { return data; }
+
+private:
+    int nRows;
+    int nCols;
+    int count;
+    Matrix data;
+};
+
+// mask ? a : b, lane by lane. Written out as bit operations because gcc turns ?: on vectors into a branch per lane.
+template <class V>
+__attribute__((always_inline)) inline V lanesSelect(const LaneMask<V>& mask, const V& a, const V& b)
+{
+    return (V)(((LaneMask<V>)a & mask) | ((LaneMask<V>)b & ~mask));
+}
+
+template <class V>
+__attribute__((always_inline)) inline V lanesAbs(const V& v)
+{
+    return (V)((LaneMask<V>)v & ~(LaneMask<V>)(-V()));              // -V() is -0.0, just the sign bit
+}
+
+// one register's worth of lanes, from the row of SmallBatch::elements() for one element.
+template <class V>
+__attribute__((always_inline)) inline V loadLanes(const double* src)
+{
+    V v;
+    memcpy(&v, src, sizeof(v));
+    return v;
+}
+
+template <class V>
+__attribute__((always_inline)) inline void storeLanes(double* dst, const V& v)
+{
+    memcpy(dst, &v, sizeof(v));
+}
+
+// PA = LU on every lane at once, with partial pivoting the same way determinantFixed does it: the first row with
+// the biggest |a[i][c]| wins. The multipliers are left in L's spot, pivotRow[c] is the row each lane swapped with
+// row c, det picks up the sign of the swaps and the pivots, and zero is set in any lane that hit a zero pivot.
+template <class V, int N>
+__attribute__((always_inline)) inline void factorLanes(V (&a)[N][N], V (&pivotRow)[N], V& det,
+                                                       LaneMask<V>& zero)
+{
+    det = V() + 1;
+    zero = LaneMask<V>();
+    #pragma GCC unroll 8
+    for (int c = 0; c < N; c++)
+    {
+        V best = lanesAbs(a[c][c]);
+        V pivot[N];
+        pivotRow[c] = V() + c;
+        #pragma GCC unroll 8
+        for (int j = c; j < N; j++)
+        {
+            pivot[j] = a[c][j];
+        }
+        #pragma GCC unroll 8
+        for (int i = c + 1; i < N; i++)
+        {
+            LaneMask<V> bigger = lanesAbs(a[i][c]) > best;
+            best = lanesSelect(bigger, lanesAbs(a[i][c]), best);
+            pivotRow[c] = lanesSelect(bigger, V() + i, pivotRow[c]);
+            #pragma GCC unroll 8
+            for (int j = c; j < N; j++)
+            {
+                pivot[j] = lanesSelect(bigger, a[i][j], pivot[j]);
+            }
+        }
+        #pragma GCC unroll 8
+        for (int i = c + 1; i < N; i++)
+        {
+            LaneMask<V> swapped = pivotRow[c] == i;
+            #pragma GCC unroll 8
+            for (int j = c; j < N; j++)
+            {
+                a[i][j] = lanesSelect(swapped, a[c][j], a[i][j]);
+            }
+        }
+        #pragma GCC unroll 8
+        for (int j = c; j < N; j++)
+        {
+            a[c][j] = pivot[j];
+        }
+        det = lanesSelect(pivotRow[c] != c, -det, det);
+        LaneMask<V> zeroPivot = a[c][c] == 0;
+        zero |= zeroPivot;
+        det *= a[c][c];
+        V divisor = lanesSelect(zeroPivot, V() + 1, a[c][c]);
+        #pragma GCC unroll 8
+        for (int i = c + 1; i < N; i++)
+        {
+            V multiplier = a[i][c] / divisor;
+            a[i][c] = multiplier;
+            #pragma GCC unroll 8
+            for (int j = c + 1; j < N; j++)
+            {
+                a[i][j] = a[i][j] - multiplier * a[c][j];
+            }
+        }
+    }
+}
+
+template <class V, int N>
+__attribute__((always_inline)) inline void loadMatrixLanes(V (&a)[N][N], const double* src, size_t stride,
+                                                           int cols)
+{
+    #pragma GCC unroll 8
+    for (int i = 0; i < N; i++)
+    {
+        #pragma GCC unroll 8
+        for (int j = 0; j < N; j++)
+        {
+            a[i][j] = loadLanes<V>(src + (size_t)(i * cols + j) * stride);
+        }
+    }
+}
+
+// the determinants of one register's worth of matrices. src points at their lanes in element (0, 0)'s row, and
+// the rows for the other elements are stride doubles apart.
+template <class V, int N>
+__attribute__((always_inline)) inline void determinantLanes(const double* src, size_t stride, double* det)
+{
+    V a[N][N];
+    loadMatrixLanes<V, N>(a, src, stride, N);
+    if (N == 2)
+    {
+        storeLanes(det, a[0][0] * a[1][1] - a[0][1] * a[1][0]);
+        return;
+    }
+    V pivotRow[N];
+    V d;
+    LaneMask<V> zero;
+    factorLanes<V, N>(a, pivotRow, d, zero);
+    storeLanes(det, lanesSelect(zero, V(), d));
+}
+
+// X = A^-1 B for one register's worth of N x (N+k) augmented systems: factor, then run each right hand side
+// through the same swaps, the forward substitution and the back substitution. dst is the solutions' SmallBatch
+// (N x k), starting at the same lanes, with dstStride between elements. A singular lane gets NaN all the way down.
+template <class V, int N>
+__attribute__((always_inline)) inline void solveLanes(const double* src, size_t stride, int k, double* dst,
+                                                      size_t dstStride)
+{
+    int cols = N + k;
+    V a[N][N];
+    loadMatrixLanes<V, N>(a, src, stride, cols);
+    V pivotRow[N];
+    V d;
+    LaneMask<V> zero;
+    factorLanes<V, N>(a, pivotRow, d, zero);
+    V inverse[N];
+    #pragma GCC unroll 8
+    for (int i = 0; i < N; i++)
+    {
+        inverse[i] = 1 / lanesSelect(a[i][i] == 0, V() + 1, a[i][i]);
+    }
+    for (int r = 0; r < k; r++)
+    {
+        V b[N];
+        #pragma GCC unroll 8
+        for (int i = 0; i < N; i++)
+        {
+            b[i] = loadLanes<V>(src + (size_t)(i * cols + N + r) * stride);
+        }
+        // L y = P b, swapping as we go in the order the factorization did
+        #pragma GCC unroll 8
+        for (int c = 0; c < N; c++)
+        {
+            V pivot = b[c];
+            #pragma GCC unroll 8
+            for (int i = c + 1; i < N; i++)
+            {
+                LaneMask<V> swapped = pivotRow[c] == i;
+                pivot = lanesSelect(swapped, b[i], pivot);
+                b[i] = lanesSelect(swapped, b[c], b[i]);
+            }
+            b[c] = pivot;
+            #pragma GCC unroll 8
+            for (int i = c + 1; i < N; i++)
+            {
+                b[i] = b[i] - a[i][c] * b[c];
+            }
+        }
+        // U x = y
+        #pragma GCC unroll 8
+        for (int i = N - 1; i >= 0; i--)
+        {
+            #pragma GCC unroll 8
+            for (int j = i + 1; j < N; j++)
+            {
+                b[i] = b[i] - a[i][j] * b[j];
+            }
+            b[i] = b[i] * inverse[i];
+        }
+        #pragma GCC unroll 8
+        for (int i = 0; i < N; i++)
+        {
+            storeLanes(dst + (size_t)(i * k + r) * dstStride, lanesSelect(zero, V() + NAN, b[i]));
+        }
+    }
+}
+
+typedef void (*BatchDeterminantFn)(const double* src, size_t stride, double* det, int groups);
+typedef void (*BatchSolveFn)(const double* src, size_t stride, int k, double* dst, size_t dstStride, int groups);
+
+// the same kernels built for each instruction set, on that instruction set's own register width: a group of
+// BATCH_LANES matrices is 4 SSE2 registers, 2 AVX2 ones (with FMA) or 1 AVX-512 one.
+#define BATCH_KERNELS(suffix, attributes, V)                                                                        \
+    template <int N>                                                                                                \
+    attributes inline void batchDeterminant##suffix(const double* src, size_t stride, double* det, int groups)      \
+    {                                                                                                               \
+        for (int lane = 0; lane < groups * BATCH_LANES; lane += sizeof(V) / sizeof(double))                         \
+        {                                                                                                           \
+            determinantLanes<V, N>(src + lane, stride, det + lane);                                                 \
+        }                                                                                                           \
+    }                                                                                                               \
+    template <int N>                                                                                                \
+    attributes inline void batchSolve##suffix(const double* src, size_t stride, int k, double* dst,                 \
+                                              size_t dstStride, int groups)                                         \
+    {                                                                                                               \
+        for (int lane = 0; lane < groups * BATCH_LANES; lane += sizeof(V) / sizeof(double))                         \
+        {                                                                                                           \
+            solveLanes<V, N>(src + lane, stride, k, dst + lane, dstStride);                                         \
+        }                                                                                                           \
+    }
+
+BATCH_KERNELS(Generic, , Lanes2)
+#ifdef ROWOPS_X86
+BATCH_KERNELS(AVX2, __attribute__((target("avx2,fma"))), Lanes4)
+BATCH_KERNELS(AVX512, __attribute__((target("avx512f"))), Lanes8)
+#endif
+
+#undef BATCH_KERNELS
+
+struct BatchKernels
+{
+    BatchDeterminantFn determinant[SMALL_MAX_ORDER + 1];    // indexed by n, 2 and up
+    BatchSolveFn solve[SMALL_MAX_ORDER + 1];
+    const char* name;
+};
+
+// go with whatever rowops.h went with: the same CPU checks, and GJ_SIMD forces both.
+inline BatchKernels pickBatchKernels()
+{
+    BatchKernels generic = {
+        { NULL, NULL, batchDeterminantGeneric<2>, batchDeterminantGeneric<3>, batchDeterminantGeneric<4>,
+          batchDeterminantGeneric<5>, batchDeterminantGeneric<6>, batchDeterminantGeneric<7>,
+          batchDeterminantGeneric<8> },
+        { NULL, NULL, batchSolveGeneric<2>, batchSolveGeneric<3>, batchSolveGeneric<4>, batchSolveGeneric<5>,
+          batchSolveGeneric<6>, batchSolveGeneric<7>, batchSolveGeneric<8> },
+        "generic"
+    };
+#ifdef ROWOPS_X86
+    BatchKernels avx2 = {
+        { NULL, NULL, batchDeterminantAVX2<2>, batchDeterminantAVX2<3>, batchDeterminantAVX2<4>,
+          batchDeterminantAVX2<5>, batchDeterminantAVX2<6>, batchDeterminantAVX2<7>, batchDeterminantAVX2<8> },
+        { NULL, NULL, batchSolveAVX2<2>, batchSolveAVX2<3>, batchSolveAVX2<4>, batchSolveAVX2<5>,
+          batchSolveAVX2<6>, batchSolveAVX2<7>, batchSolveAVX2<8> },
+        "avx2"
+    };
+    BatchKernels avx512 = {
+        { NULL, NULL, batchDeterminantAVX512<2>, batchDeterminantAVX512<3>, batchDeterminantAVX512<4>,
+          batchDeterminantAVX512<5>, batchDeterminantAVX512<6>, batchDeterminantAVX512<7>,
+          batchDeterminantAVX512<8> },
+        { NULL, NULL, batchSolveAVX512<2>, batchSolveAVX512<3>, batchSolveAVX512<4>, batchSolveAVX512<5>,
+          batchSolveAVX512<6>, batchSolveAVX512<7>, batchSolveAVX512<8> },
+        "avx512"
+    };
+    std::string picked = rowKernels().name;
+    if (picked == "avx512")
+    {
+        return avx512;
+    }
+    if (picked == "avx2")
+    {
+        return avx2;
+    }
+#endif
+    return generic;
+}
+
+inline const BatchKernels& batchKernels()
+{
+    static const BatchKernels kernels = pickBatchKernels();
+    return kernels;
+}
+
+// run body(firstGroup, groups) over every group of BATCH_LANES matrices in a batch of count, on the shared pool if
+// there are enough of them.
+template <class Body>
+inline void forEachGroup(int count, const Body& body)
+{
+    int groups = (count + BATCH_LANES - 1) / BATCH_LANES;
+    if (count < BATCH_PARALLEL_MIN)
+    {
+        body(0, groups);
+        return;
+    }
+    sharedPool().parallelFor(0, groups, BATCH_GRAIN, [&](int g0, int g1)
+    {
+        body(g0, g1 - g0);
+    });
+}
+
+// det[m] = the determinant of matrix m, for every matrix in a batch of n x n matrices, 2 <= n <= SMALL_MAX_ORDER.
+inline void batchDeterminants(const SmallBatch& batch, std::vector<double>& det)
+{
+    GJ_PHASE(PHASE_DETERMINANT);
+    int n = batch.rows();
+    const Matrix& elements = batch.elements();
+    BatchDeterminantFn kernel = batchKernels().determinant[n];
+    det.resize(batch.capacity());
+    forEachGroup(batch.size(), [&](int firstGroup, int groups)
+    {
+        int offset = firstGroup * BATCH_LANES;
+        kernel(elements[0] + offset, elements.stride(), det.data() + offset, groups);
+    });
+    det.resize(batch.size());
+    GJ_COUNT(flops, (smallEliminationFlops(n, n) + n) * batch.size());
+}
+
+// the solution X (n x k) of every n x (n+k) augmented system in the batch, as a batch of its own. Singular systems
+// come out as all NaN.
+inline SmallBatch batchSolve(const SmallBatch& systems)
+{
+    GJ_PHASE(PHASE_SOLVE);
+    int n = systems.rows();
+    int k = systems.cols() - n;
+    SmallBatch x(n, k, systems.capacity());
+    x.resize(systems.size());
+    const Matrix& elements = systems.elements();
+    Matrix& solutions = x.elements();
+    BatchSolveFn kernel = batchKernels().solve[n];
+    forEachGroup(systems.size(), [&](int firstGroup, int groups)
+    {
+        int offset = firstGroup * BATCH_LANES;
+        kernel(elements[0] + offset, elements.stride(), k, solutions[0] + offset, solutions.stride(), groups);
+    });
+    GJ_COUNT(flops, (smallEliminationFlops(n, n) + 2L * n * n * k) * systems.size());
+    return x;
+}
+
+#endif
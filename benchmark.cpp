@@ -0,0 +1,501 @@
+/*
+ * Benchmarks for the determinant and Gauss-Jordan routines
+ * Evan Perry Grove, 2017
+ *
+ *     g++ -O2 -pthread benchmark.cpp -o benchmark
+ *     ./benchmark [--sizes 4,8,16] [--classes dense,dominant] [--routines lu,rref]
+ *                 [--min-time seconds] [--threads n] [--seed n]
+ *                 [--pivot partial|threshold|rook|complete]
+ *
+ * Runs every routine on every class of matrix at every size, and writes one
+ * JSON object per line for each combination, so two builds can be compared
+ * with a script (or just diff). Each one gets run over and over until it's
+ * taken at least --min-time seconds, and we report the average and the best
+ * time for one call, GFLOP/s for the O(n^3) routines, heap allocations and
+ * row and column swaps per call, and the Laplace node counters (detCt and
+ * minCt).
+ *
+ * Routines: lu, laplace, memo, parallel (the determinant modes 0 to 3), rref
+ * (REF and RREF the way batch mode does them, pivoting the way --pivot says;
+ * partial by default), steps (the row-by-row elimination the verbose modes
+ * log) and batch (batchDeterminants on BATCH_STREAM_COUNT matrices at once,
+ * 2x2 to 8x8 only). The Laplace ones only run for sizes where they finish in
+ * a reasonable amount of time. Every line also says how many matrices one
+ * call does and how many of them get done per second, which is the number
+ * that matters for batch.
+ *
+ * Classes: dense (uniform in [-1, 1]), dominant (diagonally dominant), zerodiag
+ * (zeros all down the diagonal, so every column needs a swap), nearsingular
+ * (the last row is almost the sum of the first two), sparse (a few nonzeros
+ * per row, plus a dominant diagonal) and ties (shuffled 8x8 Hadamard blocks, so
+ * every step has pivots of exactly the same size to pick between).
+ *
+ * rref also checks its answer against the steps one (as long as steps would
+ * run at that size, and except for nearsingular) and says whether they
+ * matched in matchesSteps. Picking a different pivot the fast way than the
+ * row-by-row way shows up there, and as a warning on stderr.
+ */
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <iostream>
+#include <new>
+#include <random>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include "matrix.h"
+#include "determinant.h"
+#include "rref.h"
+#include "small.h"
+#include "batched.h"
+
+using namespace std;
+
+// every heap allocation goes through one of these. Matrix uses aligned_alloc and everything else uses new, so
+// counting both catches all of it. (new and delete are malloc and free underneath, which gcc can't see.)
+#pragma GCC diagnostic ignored "-Wmismatched-new-delete"
+
+atomic<long> allocations(0);
+
+volatile double resultSink;
+
+Pivoting pivoting;                                          // how rref and steps pick their pivots
+
+extern "C" void* __libc_memalign(size_t alignment, size_t size);
+
+extern "C" void* aligned_alloc(size_t alignment, size_t size) noexcept
+{
+    allocations.fetch_add(1, memory_order_relaxed);
+    return __libc_memalign(alignment, size);
+}
+
+void* operator new(size_t size)
+{
+    allocations.fetch_add(1, memory_order_relaxed);
+    void* p = malloc(size == 0 ? 1 : size);
+    if (p == NULL)
+    {
+        throw bad_alloc();
+    }
+    return p;
+}
+
+void operator delete(void* p) noexcept
+{
+    free(p);
+}
+
+void operator delete(void* p, size_t) noexcept
+{
+    free(p);
+}
+
+// the biggest size each routine is allowed to run at.
+int maxOrder(const string& routine)
+{
+    if (routine == "laplace")
+    {
+        return 10;
+    }
+    if (routine == "parallel")
+    {
+        return 11;
+    }
+    if (routine == "memo")
+    {
+        return 20;
+    }
+    if (routine == "steps")
+    {
+        return 512;
+    }
+    if (routine == "batch")
+    {
+        return SMALL_MAX_ORDER;
+    }
+    return 1 << 20;
+}
+
+// an n x cols matrix of the given class. Only the square part gets the structure; any extra columns are just random.
+Matrix makeMatrix(const string& kind, int n, int cols, mt19937_64& rng)
+{
+    uniform_real_distribution<double> uniform(-1, 1);
+    Matrix m(n, cols);
+    if (kind == "sparse")
+    {
+        int perRow = min(n, 4);
+        for (int i = 0; i < n; i++)
+        {
+            for (int k = 0; k < perRow; k++)
+            {
+                m[i][rng() % n] = uniform(rng);
+            }
+            for (int j = n; j < cols; j++)
+            {
+                m[i][j] = uniform(rng);
+            }
+            m[i][i] = perRow + 1;
+        }
+        return m;
+    }
+    for (int i = 0; i < n; i++)
+    {
+        for (int j = 0; j < cols; j++)
+        {
+            m[i][j] = uniform(rng);
+        }
+    }
+    if (kind == "dominant")
+    {
+        for (int i = 0; i < n; i++)
+        {
+            m[i][i] = n;
+        }
+    }
+    else if (kind == "zerodiag")
+    {
+        for (int i = 0; i < n; i++)
+        {
+            m[i][i] = 0;
+        }
+    }
+    else if (kind == "ties")
+    {
+        // Hadamard blocks (1, 2, 4 or 8 on a side, +-1 everywhere) down the diagonal, rows shuffled and scaled by
+        // +-1, 2 or 4. There are entries the same size as the pivot to pick between at nearly every step, and
+        // everything stays a power of two times a small integer (up to 8x8 a Hadamard matrix only ever gets pivots
+        // like that; bigger ones get ones like 10/3), so no rounding can break a tie instead.
+        vector<int> order(n);
+        for (int i = 0; i < n; i++)
+        {
+            order[i] = i;
+            for (int j = 0; j < cols; j++)
+            {
+                m[i][j] = j < n ? 0 : (double)(int)(rng() % 9) - 4;
+            }
+        }
+        shuffle(order.begin(), order.end(), rng);
+        for (int start = 0; start < n;)
+        {
+            int size = 1;
+            while (size < 8 && start + 2 * size <= n)
+            {
+                size *= 2;
+            }
+            for (int i = 0; i < size; i++)
+            {
+                for (int j = 0; j < size; j++)
+                {
+                    m[order[start + i]][start + j] = __builtin_popcount(i & j) % 2 ? -1 : 1;
+                }
+            }
+            start += size;
+        }
+        for (int i = 0; i < n; i++)
+        {
+            double scale = (rng() % 2 ? -1 : 1) * (1 << rng() % 3);
+            for (int j = 0; j < n; j++)
+            {
+                m[i][j] *= scale;
+            }
+        }
+    }
+    else if (kind == "nearsingular" && n >= 3)
+    {
+        for (int j = 0; j < n; j++)
+        {
+            m[n - 1][j] = m[0][j] + m[1][j] + 1e-10 * uniform(rng);
+        }
+    }
+    return m;
+}
+
+int matricesPerCall(const string& routine)
+{
+    return routine == "batch" ? BATCH_STREAM_COUNT : 1;
+}
+
+// floating point operations for one call, or 0 if that doesn't mean much for this routine (Laplace).
+double flopCount(const string& routine, int n)
+{
+    double size = n;
+    if (routine == "lu")
+    {
+        return 2 * size * size * size / 3;
+    }
+    if (routine == "rref" || routine == "steps")
+    {
+        // REF of the square part carried along one augmented column, then the back substitution.
+        return 2 * size * size * size / 3 + 3 * size * size;
+    }
+    if (routine == "batch")
+    {
+        return matricesPerCall(routine) * 2 * size * size * size / 3;
+    }
+    return 0;
+}
+
+// one call of the routine. Anything that works in place gets handed a fresh copy, which is made before the clock
+// starts. batch works on its own block of matrices instead of original.
+void runOnce(const string& routine, const Matrix& original, Matrix& scratch, OperationLog& steps,
+             const SmallBatch& batch, vector<double>& dets, double& sink)
+{
+    int n = original.rows();
+    if (routine == "lu")
+    {
+        sink += findDeterminant(original, 0);
+    }
+    else if (routine == "laplace")
+    {
+        sink += findDeterminant(original, 1);
+    }
+    else if (routine == "memo")
+    {
+        sink += findDeterminant(original, 2);
+    }
+    else if (routine == "parallel")
+    {
+        sink += findDeterminant(original, 3);
+    }
+    else if (routine == "rref")
+    {
+        PivotResult pivots = reduceToREF(scratch, NULL, pivoting);
+        reduceToRREF(scratch, NULL, pivots);
+        sink += scratch[0][n];
+    }
+    else if (routine == "steps")
+    {
+        steps.clear();
+        PivotResult pivots = reduceToREF(scratch, &steps, pivoting);
+        reduceToRREF(scratch, &steps, pivots);
+        sink += scratch[0][n];
+    }
+    else if (routine == "batch")
+    {
+        batchDeterminants(batch, dets);
+        sink += dets[0];
+    }
+}
+
+bool worksInPlace(const string& routine)
+{
+    return routine == "rref" || routine == "steps";
+}
+
+// whether REF and RREF come out the same the fast way (rref) and the row-by-row way (steps), to within rounding.
+// Which path a system takes shouldn't change the answer, including which row wins when two pivots are the same size.
+bool sameMatrix(const Matrix& a, const Matrix& b)
+{
+    for (int i = 0; i < a.rows(); i++)
+    {
+        for (int j = 0; j < a.cols(); j++)
+        {
+            if (abs(a[i][j] - b[i][j]) > 1e-9 * max(1.0, abs(b[i][j])))
+            {
+                return false;
+            }
+        }
+    }
+    return true;
+}
+
+bool matchesSteps(const Matrix& original)
+{
+    Matrix fast = original;
+    Matrix logged = original;
+    OperationLog steps;
+    PivotResult fastPivots = reduceToREF(fast, NULL, pivoting);
+    PivotResult loggedPivots = reduceToREF(logged, &steps, pivoting);
+    if (!sameMatrix(fast, logged))
+    {
+        return false;
+    }
+    reduceToRREF(fast, NULL, fastPivots);
+    reduceToRREF(logged, &steps, loggedPivots);
+    return sameMatrix(fast, logged);
+}
+
+void benchmark(const string& routine, const string& kind, int n, double minTime, mt19937_64& rng)
+{
+    int cols = worksInPlace(routine) ? n + 1 : n;
+    Matrix original = makeMatrix(kind, n, cols, rng);
+    Matrix scratch;
+    OperationLog steps;
+    SmallBatch batch;
+    vector<double> dets;
+    double sink = 0;
+    if (routine == "batch")
+    {
+        batch = SmallBatch(n, n, matricesPerCall(routine));
+        batch.push(original);
+        while (!batch.full())
+        {
+            batch.push(makeMatrix(kind, n, n, rng));
+        }
+    }
+
+    // one untimed call to warm things up (and let the shared pool start its threads).
+    if (worksInPlace(routine))
+    {
+        scratch = original;
+    }
+    runOnce(routine, original, scratch, steps, batch, dets, sink);
+
+    long reps = 0;
+    long allocs = 0;
+    long swaps = 0;
+    double total = 0;
+    double best = 1e300;
+    int lastDetCt = 0;
+    int lastMinCt = 0;
+    while (total < minTime || reps < 3)
+    {
+        if (worksInPlace(routine))
+        {
+            scratch = original;
+        }
+        minCt = 0;
+        detCt = 0;
+        long allocsBefore = allocations.load();
+        MetricsCounters countersBefore = metricsTotal();
+        chrono::steady_clock::time_point start = chrono::steady_clock::now();
+        runOnce(routine, original, scratch, steps, batch, dets, sink);
+        double seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+        allocs += allocations.load() - allocsBefore;
+        MetricsCounters countersAfter = metricsTotal();
+        swaps += countersAfter.swaps + countersAfter.columnSwaps - countersBefore.swaps - countersBefore.columnSwaps;
+        lastDetCt = detCt;
+        lastMinCt = minCt;
+        total += seconds;
+        best = min(best, seconds);
+        reps++;
+    }
+
+    // the rref answer gets checked against the steps one, as long as steps would run at this size. nearsingular
+    // doesn't get checked, since rounding differences there get blown up by the 1e-10 pivot no matter what.
+    string matches = "null";
+    if (routine == "rref" && n <= maxOrder("steps") && kind != "nearsingular")
+    {
+        matches = matchesSteps(original) ? "true" : "false";
+        if (matches == "false")
+        {
+            cerr << "benchmark: rref and steps disagree on a " << kind << " " << n << "x" << n + 1 << " matrix" << endl;
+        }
+    }
+
+    double average = total / reps;
+    double flops = flopCount(routine, n);
+    ostringstream line;
+    line << "{\"routine\": \"" << routine << "\", \"class\": \"" << kind << "\", \"n\": " << n
+         << ", \"reps\": " << reps << ", \"seconds\": " << average << ", \"best\": " << best
+         << ", \"gflops\": ";
+    if (flops > 0)
+    {
+        line << flops / best / 1e9;
+    }
+    else
+    {
+        line << "null";
+    }
+    line << ", \"matrices\": " << matricesPerCall(routine) << ", \"matricesPerSecond\": " << matricesPerCall(routine) / best
+         << ", \"allocs\": " << (double)allocs / reps << ", \"swaps\": " << (double)swaps / reps
+         << ", \"pivot\": \"" << pivotStrategyName(pivoting.strategy) << "\""
+         << ", \"matchesSteps\": " << matches
+         << ", \"detCt\": " << lastDetCt << ", \"minCt\": " << lastMinCt
+         << ", \"threads\": " << sharedPool().size() << ", \"simd\": \"" << rowKernels().name << "\"}";
+    cout << line.str() << endl;
+    resultSink = sink;                                      // so none of the calls can be optimized away
+}
+
+vector<string> splitList(const string& list)
+{
+    vector<string> items;
+    stringstream in(list);
+    string item;
+    while (getline(in, item, ','))
+    {
+        if (!item.empty())
+        {
+            items.push_back(item);
+        }
+    }
+    return items;
+}
+
+int main(int argc, char* argv[])
+{
+    string sizes = "3,4,6,8,10,16,32,64,128,256,512,1024";
+    string classes = "dense,dominant,zerodiag,nearsingular,sparse,ties";
+    string routines = "lu,laplace,memo,parallel,rref,steps,batch";
+    double minTime = 0.1;
+    unsigned long seed = 2017;
+    for (int arg = 1; arg < argc; arg++)
+    {
+        string flag = argv[arg];
+        if (flag == "--sizes" && arg + 1 < argc)
+        {
+            sizes = argv[++arg];
+        }
+        else if (flag == "--classes" && arg + 1 < argc)
+        {
+            classes = argv[++arg];
+        }
+        else if (flag == "--routines" && arg + 1 < argc)
+        {
+            routines = argv[++arg];
+        }
+        else if (flag == "--min-time" && arg + 1 < argc)
+        {
+            minTime = atof(argv[++arg]);
+        }
+        else if ((flag == "--threads" || flag == "-t") && arg + 1 < argc)
+        {
+            sharedPoolThreads() = atoi(argv[++arg]);
+        }
+        else if (flag == "--pivot" && arg + 1 < argc && parsePivotStrategy(argv[arg + 1], pivoting.strategy))
+        {
+            arg++;
+        }
+        else if (flag == "--seed" && arg + 1 < argc)
+        {
+            seed = strtoul(argv[++arg], NULL, 10);
+        }
+        else
+        {
+            cerr << "usage: " << argv[0] << " [--sizes 4,8,16]"
+                 << " [--classes dense,dominant,zerodiag,nearsingular,sparse,ties]"
+                 << endl << "       [--routines lu,laplace,memo,parallel,rref,steps,batch] [--min-time seconds]"
+                 << " [--threads n] [--seed n]" << endl
+                 << "       [--pivot partial|threshold|rook|complete]" << endl;
+            return 1;
+        }
+    }
+
+    vector<string> routineList = splitList(routines);
+    vector<string> classList = splitList(classes);
+    vector<string> sizeList = splitList(sizes);
+    for (size_t r = 0; r < routineList.size(); r++)
+    {
+        for (size_t c = 0; c < classList.size(); c++)
+        {
+            for (size_t s = 0; s < sizeList.size(); s++)
+            {
+                int n = atoi(sizeList[s].c_str());
+                if (n < 1 || n > maxOrder(routineList[r]) || (routineList[r] == "batch" && n < 2))
+                {
+                    continue;
+                }
+                // every combination gets its own generator, so adding a size or a class doesn't change the others.
+                mt19937_64 rng(seed + 1000003 * n + 7919 * c);
+                benchmark(routineList[r], classList[c], n, minTime, rng);
+            }
+        }
+    }
+    return 0;
+}
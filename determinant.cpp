@@ -2,7 +2,10 @@
  * Method for finding the determinant of a matrix
  * Evan Perry Grove, 2017
  * 
- * uses recursive form of Laplace.
+ * uses LU factorization with partial pivoting by default. The original
+ * recursive form of Laplace is still available as a reference mode, which is
+ * handy for double-checking the LU result on small matrices. Integer matrices
+ * can also get an exact determinant, with as many digits as it takes.
  */
 
 #include <iostream>
@@ -10,68 +13,181 @@
 #include <vector>
 #include <cmath>
 
+#include "matrix.h"
+#include "matrix_io.h"
+#include "determinant.h"
+#include "batched.h"
+#include "update.h"
+#include "metrics.h"
+
 //it's fine to use std because we aren't using any funky non-std libraries
 using namespace std;
 
-int minCt = 0;
-int detCt = 0;
-
-vector< vector<double> > getMinimo(vector< vector<double> > src, int ia, int ja, int ord)
+// batch mode: no prompts, no escape codes. Read every matrix in the input and write out one determinant per line,
+// in the same order. scalar picks the precision standard mode works in: float, double or long (long double).
+// In standard double mode, runs of same-size small matrices get collected and done together by batchDeterminants.
+int runBatch(const string& path, int mode, bool binaryOut, const string& scalar)
 {
-    minCt++;
-    vector< vector<double> > minimo(ord-1, vector<double> (ord-1,0));
-    int row = 0;
-    for (int i = 0; i < ord; i++)
+    MatrixReader reader;
+    if (!reader.open(path))
+    {
+        cerr << "determinant: " << reader.error() << endl;
+        return 1;
+    }
+    MatrixWriter writer(stdout, binaryOut);
+    Matrix matrix;
+    SmallBatch pending;
+    vector<double> dets;
+    int count = 0;
+    
+    // write out the determinants of whatever's been collected so far, before anything that comes after it.
+    auto flushPending = [&]()
+    {
+        if (pending.size() == 0)
+        {
+            return;
+        }
+        batchDeterminants(pending, dets);
+        for (size_t d = 0; d < dets.size(); d++)
+        {
+            writer.writeScalar(dets[d]);
+        }
+        pending.clear();
+    };
+    
+    while (reader.next(matrix))
     {
-        int col = 0;
-        if (i != ia)
+        count++;
+        int n = matrix.rows();
+        if (mode == 0 && scalar == "double" && n == matrix.cols() && n >= 2 && n <= SMALL_MAX_ORDER)
+        {
+            if (pending.rows() != n)
+            {
+                flushPending();
+                pending = SmallBatch(n, n, BATCH_STREAM_COUNT);
+            }
+            pending.push(matrix);
+            if (pending.full())
+            {
+                flushPending();
+            }
+            continue;
+        }
+        flushPending();
+        if (matrix.rows() != matrix.cols())
+        {
+            writer.flush();
+            cerr << "determinant: matrix " << count << " is " << matrix.rows() << "x" << matrix.cols()
+                 << ", it has to be square" << endl;
+            return 1;
+        }
+        if (mode == 2 && n > MEMO_MAX_ORDER)
+        {
+            writer.flush();
+            cerr << "determinant: matrix " << count << " is " << n << "x" << n
+                 << ", memoized Laplace mode only goes up to n=" << MEMO_MAX_ORDER
+                 << ", using standard mode (0) instead" << endl;
+        }
+        if (mode == 4 && !isIntegerMatrix(matrix))
+        {
+            writer.flush();
+            cerr << "determinant: matrix " << count << " has non-integer values, exact mode needs integers" << endl;
+            return 1;
+        }
+        if (mode == 4 && !binaryOut)
         {
-            for (int j = 0; j < ord; j++)
+            // exact answers can be longer than a double, so they go out as decimal text. Binary output gets the exact
+            // answer rounded to the nearest double, from findDeterminant below.
+            ExactStats stats;
+            string det;
             {
-                if (j != ja)
-                {
-                    minimo[row][col] = src[i][j];
-                    col++;
-                }
-                
+                GJ_PHASE(PHASE_DETERMINANT);
+                det = determinantExact(matrix, sharedPool(), stats).toString();
             }
-            row++;
+            writer.writeLine(det);
+            continue;
         }
+        if (mode == 0 && scalar == "float")
+        {
+            writer.writeScalar(determinantAs<float>(matrix));
+            continue;
+        }
+        if (mode == 0 && scalar == "long")
+        {
+            writer.writeScalar(determinantAs<long double>(matrix));
+            continue;
+        }
+        writer.writeScalar(findDeterminant(matrix, mode));
+    }
+    flushPending();
+    if (reader.failed())
+    {
+        writer.flush();
+        cerr << "determinant: matrix " << count + 1 << ": " << reader.error() << endl;
+        return 1;
     }
-    return minimo;
+    return 0;
 }
 
-double determinant(vector< vector<double> > src, int order)
+// edit mode: the determinant of the first square matrix in the input, then again after each block of edits from
+// editsPath (k x 3 matrices of row, column and new value). Each edit updates the LU factors with the matrix
+// determinant lemma instead of factoring from scratch.
+int runEdits(const string& path, const string& editsPath, bool binaryOut)
 {
-    detCt++;
-    if (order == 2)
+    MatrixReader reader;
+    MatrixReader editReader;
+    Matrix matrix;
+    if (!reader.open(path) || !editReader.open(editsPath))
     {
-        double addPart = src[0][0] * src[1][1];
-        double subPart = src[1][0] * src[0][1];
-        return addPart - subPart;
+        cerr << "determinant: " << (reader.failed() ? reader.error() : editReader.error()) << endl;
+        return 1;
     }
-    else
+    if (!reader.next(matrix))
     {
-        double det = 0;
-        for (int j = 0; j < order; j++)
+        cerr << "determinant: " << (reader.failed() ? reader.error() : "no matrix to edit") << endl;
+        return 1;
+    }
+    int n = matrix.rows();
+    if (matrix.cols() != n)
+    {
+        cerr << "determinant: matrix is " << n << "x" << matrix.cols() << ", it has to be square" << endl;
+        return 1;
+    }
+    MatrixWriter writer(stdout, binaryOut);
+    UpdatedLU lu;
+    lu.factor(matrix);
+    writer.writeScalar(lu.determinant());
+    Matrix edits;
+    int blocks = 0;
+    while (editReader.next(edits))
+    {
+        blocks++;
+        string err;
+        if (!checkEdits(edits, n, n, err))
         {
-            vector< vector<double> > min = getMinimo(src, 0, j, order);
-            if ((j % 2) == 0) 
-            {
-                det += src[0][j] * determinant(min, order-1);
-            }
-            else 
-            { 
-                det -= src[0][j] * determinant(min, order-1); 
-            }
+            writer.flush();
+            cerr << "determinant: edit block " << blocks << ": " << err << endl;
+            return 1;
+        }
+        for (int e = 0; e < edits.rows(); e++)
+        {
+            lu.set((int)edits[e][0] - 1, (int)edits[e][1] - 1, edits[e][2]);
         }
-        return det;
+        writer.writeScalar(lu.determinant());
     }
+    writer.flush();
+    if (editReader.failed())
+    {
+        cerr << "determinant: edit block " << blocks + 1 << ": " << editReader.error() << endl;
+        return 1;
+    }
+    cerr << "edits: " << lu.editCount() << "  refactorizations: " << lu.refactorCount() << endl;
+    return 0;
 }
 
-void printMatrix ( vector< vector<double> > M) {
+void printMatrix (const Matrix& M) {
   //just does what it means
-  int size = M.size();
+  int size = M.rows();
   for( int i = 0; i < size; i++ ) {
     cout << "\t";
     for( int j = 0; j < size; j++ ) {
@@ -91,13 +207,97 @@ void introduction()
     cout << "\033[1;34m****************************************\033[0m\n" << endl;
 }
 
-int main() {
+int main(int argc, char* argv[]) {
+    int mode = 0;
+    bool batch = false;
+    bool binaryOut = false;
+    string batchPath;
+    string scalar = "double";
+    string editsPath;
+    MetricsReport metrics;
+    metrics.watch("detCt", detCt);
+    metrics.watch("minCt", minCt);
+    for (int arg = 1; arg < argc; arg++)
+    {
+        string flag = argv[arg];
+        if (flag == "--batch" || flag == "-b")
+        {
+            batch = true;
+            if (arg + 1 < argc && argv[arg + 1][0] != '-')
+            {
+                batchPath = argv[++arg];
+            }
+        }
+        else if ((flag == "--mode" || flag == "-m") && arg + 1 < argc)
+        {
+            mode = atoi(argv[++arg]);
+        }
+        else if ((flag == "--threads" || flag == "-t") && arg + 1 < argc)
+        {
+            sharedPoolThreads() = atoi(argv[++arg]);
+        }
+        else if (flag == "--binary")
+        {
+            binaryOut = true;
+        }
+        else if (flag == "--scalar" && arg + 1 < argc)
+        {
+            scalar = argv[++arg];
+        }
+        else if (flag == "--edits" && arg + 1 < argc)
+        {
+            editsPath = argv[++arg];
+        }
+        else if (flag == "--metrics")
+        {
+            string metricsPath;
+            if (arg + 1 < argc && argv[arg + 1][0] != '-')
+            {
+                metricsPath = argv[++arg];
+            }
+            metrics.request(metricsPath);
+        }
+        else
+        {
+            cerr << "usage: " << argv[0] << " [--batch [file]] [--mode 0|1|2|3|4] [--scalar float|double|long] [--binary]"
+                 << " [--threads n] [--metrics [file]]" << endl << "       " << argv[0]
+                 << " [--batch [file]] --edits file [--binary]" << endl;
+            return 1;
+        }
+    }
+    if (!editsPath.empty())
+    {
+        return runEdits(batchPath, editsPath, binaryOut);
+    }
+    if (batch)
+    {
+        if (mode > 4 || mode < 0)
+        {
+            mode = 0;
+        }
+        return runBatch(batchPath, mode, binaryOut, scalar);
+    }
+    
     introduction();
+    cout << "\033[1;37mPlease select an option from below." << endl;
+    cout << "0) Standard Mode: Find the determinant using LU factorization." << endl;
+    cout << "1) Laplace Mode: Use recursive Laplace expansion. (reference only, very slow past n=10)" << endl;
+    cout << "2) Memoized Laplace Mode: Exact cofactor expansion with cached minors. (up to n=" << MEMO_MAX_ORDER << ")" << endl;
+    cout << "3) Parallel Laplace Mode: Recursive Laplace expansion spread across every core. (still O(n!))" << endl;
+    cout << "4) Exact Mode: Exact determinant of an integer matrix, every digit of it." << endl;
+    cin >> mode;
+    
+    if(mode > 4 || mode < 0)
+    {
+        cout << "Invalid mode specified. Default is Standard Mode (0)." << endl;
+        mode = 0;
+    }
+    
     cout << "\033[1;37mHow many variables are we solving for? ";
     int n;
     cin >> n;                                               // initialize and set n
     
-    vector <vector<double> > matrix( n, vector<double> (n, 0));
+    Matrix matrix(n, n);
     
     // prompt the user for each element. This can be simplified massively, at the expense of having a not-so-pretty interface.
     for (int i = 0; i < n; i++)
@@ -140,7 +340,45 @@ int main() {
         cin >> correct;
     }
 
-    cout << "\nCalculating the determinant... this may take some time for larger matrices.\n";
-    double det = determinant(matrix, n);
+    if (mode == 2 && n > MEMO_MAX_ORDER)
+    {
+        cout << "Memoized Laplace Mode only goes up to n=" << MEMO_MAX_ORDER << ". Using Standard Mode (0) instead." << endl;
+        mode = 0;
+    }
+    
+    if (mode == 4 && !isIntegerMatrix(matrix))
+    {
+        cout << "Exact Mode only works on integer matrices. Using Standard Mode (0) instead." << endl;
+        mode = 0;
+    }
+    if (mode == 4)
+    {
+        ExactStats stats;
+        BigInt det;
+        {
+            GJ_PHASE(PHASE_DETERMINANT);
+            det = determinantExact(matrix, sharedPool(), stats);
+        }
+        if (stats.primes > 0)
+        {
+            cout << "Hadamard bound: 2^" << ceil(stats.boundBits) << "    Primes used: " << stats.primes << endl;
+        }
+        cout << "The determinant is:  " << det.toString() << endl;
+        return 0;
+    }
+    
+    if (mode == 1 || mode == 3)
+    {
+        cout << "\nCalculating the determinant... this may take some time for larger matrices.\n";
+    }
+    double det = findDeterminant(matrix, mode);
+    if (mode == 2)
+    {
+        cout << "Minors expanded (cache misses): " << detCt << "    Cache hits: " << minCt << endl;
+    }
+    else if (mode == 1 || mode == 3)
+    {
+        cout << "Determinants expanded: " << detCt << "    Minors taken: " << minCt << endl;
+    }
     cout << "The determinant is:  " << det << endl;
 }
\ No newline at end of file
@@ -0,0 +1,398 @@
+/*
+ * Determinant routines: LU, plain/parallel/memoized Laplace, and exact
+ * Evan Perry Grove, 2017
+ *
+ * Everything determinant.cpp can do, minus the prompts and the batch I/O, so
+ * other programs (like the benchmark) can call the same code. findDeterminant()
+ * takes the same mode numbers the menu does.
+ */
+
+#ifndef DETERMINANT_H
+#define DETERMINANT_H
+
+#include <cmath>
+#include <vector>
+
+#include "matrix.h"
+#include "rowops.h"
+#include "threadpool.h"
+#include "exact.h"
+#include "small.h"
+#include "metrics.h"
+
+// node counters. They're per thread so that the parallel Laplace mode doesn't have every thread fighting over the
+// same two ints; it adds up everybody's counts at the end.
+inline thread_local int minCt = 0;
+inline thread_local int detCt = 0;
+
+// a minor never gets copied out of the original matrix. Instead it's a view: it points back at the matrix it came
+// from, and keeps the list of rows and columns of the original that it still uses. Those lists live in one arena
+// that's allocated once per top-level call, with one slot per depth. Since Laplace is depth-first, there's only ever
+// one live minor at each depth, so the slot just gets overwritten by the next sibling.
+struct Minimo
+{
+    const Matrix* src;                      // the original, full matrix
+    const Minimo* parent;                   // the minor this one was cut out of (null for the whole matrix)
+    int* rows;                              // rows of src this minor keeps, ord of them
+    int* cols;                              // columns of src this minor keeps, ord of them
+    int ord;
+    
+    double at(int i, int j) const
+    {
+        return (*src)[rows[i]][cols[j]];
+    }
+};
+
+inline thread_local std::vector<int> minimoArena;         // every thread recurses on its own
+
+inline Minimo getMinimo(const Minimo& parent, int ia, int ja)
+{
+    minCt++;
+    int ord = parent.ord;
+    Minimo minimo;
+    minimo.src = parent.src;
+    minimo.parent = &parent;
+    minimo.ord = ord - 1;
+    // the arena is laid out as [rows, cols] for order n, then for order n-1, and so on down.
+    minimo.rows = parent.cols + ord;
+    minimo.cols = minimo.rows + (ord - 1);
+    int row = 0;
+    int col = 0;
+    for (int i = 0; i < ord; i++)
+    {
+        if (i != ia)
+        {
+            minimo.rows[row] = parent.rows[i];
+            row++;
+        }
+        if (i != ja)
+        {
+            minimo.cols[col] = parent.cols[i];
+            col++;
+        }
+    }
+    return minimo;
+}
+
+inline double determinant(const Minimo& src)
+{
+    detCt++;
+    int order = src.ord;
+    if (order == 2)
+    {
+        double addPart = src.at(0, 0) * src.at(1, 1);
+        double subPart = src.at(1, 0) * src.at(0, 1);
+        return addPart - subPart;
+    }
+    else
+    {
+        double det = 0;
+        for (int j = 0; j < order; j++)
+        {
+            Minimo min = getMinimo(src, 0, j);
+            if ((j % 2) == 0) 
+            {
+                det += src.at(0, j) * determinant(min);
+            }
+            else 
+            { 
+                det -= src.at(0, j) * determinant(min); 
+            }
+        }
+        return det;
+    }
+}
+
+// Laplace expansion of the minor of src made from the given rows and columns. This sets up the arena and the view
+// of the minor, then hands it off.
+inline double determinantOfMinor(const Matrix& src, const int* rows, const int* cols, int order)
+{
+    // order n needs 2n slots, order n-1 needs 2(n-1), etc. all the way down.
+    minimoArena.assign(order * (order + 1), 0);
+    Minimo whole;
+    whole.src = &src;
+    whole.parent = NULL;
+    whole.ord = order;
+    whole.rows = minimoArena.data();
+    whole.cols = whole.rows + order;
+    for (int i = 0; i < order; i++)
+    {
+        whole.rows[i] = rows[i];
+        whole.cols[i] = cols[i];
+    }
+    return determinant(whole);
+}
+
+// recursive Laplace expansion of the whole matrix.
+inline double determinant(const Matrix& src, int order)
+{
+    std::vector<int> everything(order);
+    for (int i = 0; i < order; i++)
+    {
+        everything[i] = i;
+    }
+    return determinantOfMinor(src, everything.data(), everything.data(), order);
+}
+
+// parallel Laplace. The top few levels of the recursion get turned into tasks for a work-stealing scheduler, since
+// the subtrees can be very different sizes (a zero in the first row prunes nothing, but whole columns of small
+// minors finish way before big ones). Once a minor is down to LAPLACE_SERIAL_ORDER it's not worth splitting any more,
+// and the worker that has it just recurses on it normally.
+//
+// Each task carries the product of the signed cofactors on the way down to it, so it can add its share straight
+// into its worker's running total; nobody has to wait on their children. The node counts come out the same as the
+// serial version, since every node still gets counted exactly once.
+const int LAPLACE_SERIAL_ORDER = 8;
+
+struct LaplaceTask
+{
+    std::vector<int> rows;                                       // rows of the original matrix this minor keeps
+    std::vector<int> cols;                                       // columns of the original matrix this minor keeps
+    double multiplier;
+};
+
+inline double determinantParallel(const Matrix& src, int order)
+{
+    if (order <= LAPLACE_SERIAL_ORDER)
+    {
+        return determinant(src, order);
+    }
+    ThreadPool& pool = sharedPool();
+    
+    struct alignas(64) WorkerTotals                         // one cache line per worker, so they don't share
+    {
+        double det;
+        int minCt;
+        int detCt;
+    };
+    std::vector<WorkerTotals> totals(pool.size());
+    
+    LaplaceTask whole;
+    whole.rows.resize(order);
+    whole.cols.resize(order);
+    for (int i = 0; i < order; i++)
+    {
+        whole.rows[i] = i;
+        whole.cols[i] = i;
+    }
+    whole.multiplier = 1;
+    std::vector<LaplaceTask> roots(1, whole);
+    
+    // the pool's threads keep their counters between runs, so start everybody from zero.
+    pool.run([&](int worker)
+    {
+        minCt = 0;
+        detCt = 0;
+        totals[worker].det = 0;
+    });
+    runWorkStealing(pool, roots, [&](const LaplaceTask& task, int worker, TaskQueues<LaplaceTask>& queues)
+    {
+        int ord = (int)task.rows.size();
+        if (ord <= LAPLACE_SERIAL_ORDER)
+        {
+            totals[worker].det += task.multiplier * determinantOfMinor(src, task.rows.data(), task.cols.data(), ord);
+            return;
+        }
+        detCt++;
+        const double* firstRow = src[task.rows[0]];
+        for (int j = 0; j < ord; j++)
+        {
+            minCt++;
+            LaplaceTask child;
+            child.rows.assign(task.rows.begin() + 1, task.rows.end());
+            child.cols.reserve(ord - 1);
+            for (int k = 0; k < ord; k++)
+            {
+                if (k != j)
+                {
+                    child.cols.push_back(task.cols[k]);
+                }
+            }
+            child.multiplier = task.multiplier * firstRow[task.cols[j]];
+            if ((j % 2) != 0)
+            {
+                child.multiplier = -child.multiplier;
+            }
+            queues.push(worker, child);
+        }
+    });
+    pool.run([&](int worker)
+    {
+        totals[worker].minCt = minCt;
+        totals[worker].detCt = detCt;
+    });
+    
+    double det = 0;
+    minCt = 0;
+    detCt = 0;
+    for (size_t worker = 0; worker < totals.size(); worker++)
+    {
+        det += totals[worker].det;
+        minCt += totals[worker].minCt;
+        detCt += totals[worker].detCt;
+    }
+    return det;
+}
+
+// memoized Laplace. Expanding along the first row every time means a minor of order k always uses the last k rows
+// of the original matrix, so the only thing that tells two minors apart is which columns they kept. That means we can
+// key every minor by a bitmask of its columns, and compute each one only once: O(n * 2^n) instead of O(n!). There's
+// no division or pivoting anywhere, so integer matrices stay exact as long as everything fits in a double's mantissa.
+// In this mode detCt counts cache misses (minors we actually had to expand) and minCt counts cache hits.
+const int MEMO_MAX_ORDER = 25;
+
+inline std::vector<double> memoDet;
+inline std::vector<char> memoKnown;
+
+inline double determinantMemo(const Matrix& src, int depth, unsigned int colMask)
+{
+    int n = src.rows();
+    if (depth == n - 1)
+    {
+        // only one column left in the mask, and one row left. that's the whole determinant.
+        int j = 0;
+        while (!(colMask & (1u << j)))
+        {
+            j++;
+        }
+        return src[depth][j];
+    }
+    if (memoKnown[colMask])
+    {
+        minCt++;
+        return memoDet[colMask];
+    }
+    detCt++;
+    
+    double det = 0;
+    int position = 0;                                       // where column j sits inside this minor, for the sign
+    for (int j = 0; j < n; j++)
+    {
+        if (colMask & (1u << j))
+        {
+            double cofactor = src[depth][j] * determinantMemo(src, depth + 1, colMask & ~(1u << j));
+            if ((position % 2) == 0)
+            {
+                det += cofactor;
+            }
+            else
+            {
+                det -= cofactor;
+            }
+            position++;
+        }
+    }
+    memoKnown[colMask] = 1;
+    memoDet[colMask] = det;
+    return det;
+}
+
+inline double determinantMemo(const Matrix& src, int order)
+{
+    memoDet.assign(1u << order, 0);
+    memoKnown.assign(1u << order, 0);
+    double det = determinantMemo(src, 0, (1u << order) - 1);
+    // these tables get big quickly (2^n entries), so don't hang on to them after we're done.
+    std::vector<double>().swap(memoDet);
+    std::vector<char>().swap(memoKnown);
+    return det;
+}
+
+// LU factorization with partial pivoting. We do Gaussian elimination in place on our own copy of src, and every
+// time we swap two rows the sign of the determinant flips. Once the matrix is upper triangular, the determinant is
+// just the product of the diagonal. This is O(n^3) instead of the O(n!) Laplace recursion above.
+inline double determinantLU(Matrix src, int order)
+{
+    double sign = 1;
+    for (int c = 0; c < order; c++)
+    {
+        // find the row at or below c with the biggest element in column c, and use that as the pivot.
+        int pivotRow = c;
+        for (int i = c + 1; i < order; i++)
+        {
+            if (std::fabs(src[i][c]) > std::fabs(src[pivotRow][c]))
+            {
+                pivotRow = i;
+            }
+        }
+        if (src[pivotRow][c] == 0)
+        {
+            return 0;                                       // whole column is zero below the diagonal, so it's singular
+        }
+        if (pivotRow != c)
+        {
+            src.swapRows(pivotRow, c);
+            sign = -sign;
+        }
+        
+        // eliminate everything below the pivot. we don't need to keep L around, only U's diagonal matters.
+        const double* rowC = src[c];
+        for (int i = c + 1; i < order; i++)
+        {
+            double* rowI = src[i];
+            double multiplier = rowI[c] / rowC[c];
+            rowAxpy(rowI + c + 1, rowC + c + 1, multiplier, order - c - 1);
+        }
+    }
+    
+    double det = sign;
+    for (int i = 0; i < order; i++)
+    {
+        det *= src[i][i];
+    }
+    return det;
+}
+
+// run whichever method the mode asks for. 0 is LU, 1 is plain Laplace, 2 is memoized Laplace, 3 is parallel Laplace,
+// 4 is exact (rounded to the nearest double here; use determinantExact directly to get every digit).
+inline double findDeterminant(const Matrix& matrix, int mode)
+{
+    GJ_PHASE(PHASE_DETERMINANT);
+    int n = matrix.rows();
+    if (n == 1)
+    {
+        return matrix[0][0];                                // the Laplace recursion bottoms out at 2x2, so catch this here
+    }
+    if (mode == 4 && isIntegerMatrix(matrix))
+    {
+        ExactStats stats;
+        return determinantExact(matrix, sharedPool(), stats).toDouble();
+    }
+    if (mode == 2 && n <= MEMO_MAX_ORDER)
+    {
+        return determinantMemo(matrix, n);
+    }
+    else if (mode == 1)
+    {
+        return determinant(matrix, n);
+    }
+    else if (mode == 3)
+    {
+        return determinantParallel(matrix, n);
+    }
+    if (n <= SMALL_MAX_ORDER)
+    {
+        return determinantOf(matrix.data(), n, matrix.stride());
+    }
+    return determinantLU(matrix, n);
+}
+
+// LU in some other precision. The matrix gets copied over into that type first, so this is slower than plain double
+// and only worth it when the extra (or lower) precision is the point.
+template <class T>
+inline double determinantAs(const Matrix& matrix)
+{
+    GJ_PHASE(PHASE_DETERMINANT);
+    int n = matrix.rows();
+    std::vector<T> copy((size_t)n * n);
+    for (int i = 0; i < n; i++)
+    {
+        for (int j = 0; j < n; j++)
+        {
+            copy[(size_t)i * n + j] = matrix[i][j];
+        }
+    }
+    return (double)determinantOf(copy.data(), n, n);
+}
+
+#endif
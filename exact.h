@@ -0,0 +1,431 @@
+/*
+ * Exact determinants of integer matrices
+ * Evan Perry Grove, 2017
+ *
+ * LU in doubles rounds at every step, and even the Laplace modes only stay
+ * exact while every partial sum fits in 53 bits. For integer matrices we can
+ * get the exact answer without going anywhere near fractions.
+ *
+ * First we bound how big the answer can get. Hadamard's inequality says
+ * |det A| is at most the product of the lengths of the rows of A, and every
+ * minor of A obeys the same bound. When that fits in 62 bits we run Bareiss'
+ * fraction-free elimination on 64 bit integers:
+ *
+ *     a[i][j] = (a[i][j] * a[k][k] - a[i][k] * a[k][j]) / (previous pivot)
+ *
+ * The division is always exact and every entry along the way is a minor of A,
+ * so nothing overflows (the products get done in 128 bits).
+ *
+ * Past that we go multi-modular: find det A mod p for as many word-sized
+ * primes p as it takes for their product to beat twice the Hadamard bound,
+ * then glue the residues back together with the Chinese remainder theorem.
+ * Each prime is a plain O(n^3) elimination on 32 bit numbers and the primes
+ * don't depend on each other, so they all go through the thread pool at once.
+ * BigInt is just enough of a big integer to hold the result.
+ */
+
+#ifndef EXACT_H
+#define EXACT_H
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <mutex>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "matrix.h"
+#include "threadpool.h"
+
+// sign and magnitude, with the magnitude in base 2^32, least significant limb first. No leading zero limbs, and
+// zero is always non-negative.
+class BigInt
+{
+public:
+    BigInt() : negative(false) {}
+
+    explicit BigInt(int64_t value) : negative(value < 0)
+    {
+        uint64_t magnitude = value < 0 ? 0 - (uint64_t)value : (uint64_t)value;
+        while (magnitude != 0)
+        {
+            limbs.push_back((uint32_t)magnitude);
+            magnitude >>= 32;
+        }
+    }
+
+    bool isZero() const { return limbs.empty(); }
+
+    // this = this * m + a, ignoring the sign (CRT only ever builds up non-negative numbers).
+    void multiplyAdd(uint32_t m, uint32_t a)
+    {
+        uint64_t carry = a;
+        for (size_t i = 0; i < limbs.size(); i++)
+        {
+            uint64_t t = (uint64_t)limbs[i] * m + carry;
+            limbs[i] = (uint32_t)t;
+            carry = t >> 32;
+        }
+        if (carry != 0)
+        {
+            limbs.push_back((uint32_t)carry);
+        }
+        trim();
+    }
+
+    // -1, 0 or 1 as |this| is less than, equal to or greater than |other|.
+    int compareMagnitude(const BigInt& other) const
+    {
+        if (limbs.size() != other.limbs.size())
+        {
+            return limbs.size() < other.limbs.size() ? -1 : 1;
+        }
+        for (size_t i = limbs.size(); i-- > 0;)
+        {
+            if (limbs[i] != other.limbs[i])
+            {
+                return limbs[i] < other.limbs[i] ? -1 : 1;
+            }
+        }
+        return 0;
+    }
+
+    // this = other - this on the magnitudes, which has to come out non-negative. Keeps this's sign.
+    void subtractFrom(const BigInt& other)
+    {
+        std::vector<uint32_t> result(other.limbs.size());
+        int64_t borrow = 0;
+        for (size_t i = 0; i < other.limbs.size(); i++)
+        {
+            int64_t t = (int64_t)other.limbs[i] - (i < limbs.size() ? limbs[i] : 0) - borrow;
+            borrow = t < 0;
+            result[i] = (uint32_t)(t + (borrow << 32));
+        }
+        limbs.swap(result);
+        trim();
+    }
+
+    void negate()
+    {
+        negative = !negative && !isZero();
+    }
+
+    double toDouble() const
+    {
+        double value = 0;
+        for (size_t i = limbs.size(); i-- > 0;)
+        {
+            value = value * 4294967296.0 + limbs[i];
+        }
+        return negative ? -value : value;
+    }
+
+    // decimal, nine digits at a time.
+    std::string toString() const
+    {
+        if (isZero())
+        {
+            return "0";
+        }
+        std::vector<uint32_t> left(limbs);
+        std::vector<uint32_t> chunks;
+        while (!left.empty())
+        {
+            uint64_t remainder = 0;
+            for (size_t i = left.size(); i-- > 0;)
+            {
+                uint64_t t = (remainder << 32) | left[i];
+                left[i] = (uint32_t)(t / 1000000000);
+                remainder = t % 1000000000;
+            }
+            chunks.push_back((uint32_t)remainder);
+            while (!left.empty() && left.back() == 0)
+            {
+                left.pop_back();
+            }
+        }
+        std::string text = negative ? "-" : "";
+        text += std::to_string(chunks.back());
+        for (size_t i = chunks.size() - 1; i-- > 0;)
+        {
+            std::string digits = std::to_string(chunks[i]);
+            text += std::string(9 - digits.size(), '0') + digits;
+        }
+        return text;
+    }
+
+private:
+    bool negative;
+    std::vector<uint32_t> limbs;
+
+    void trim()
+    {
+        while (!limbs.empty() && limbs.back() == 0)
+        {
+            limbs.pop_back();
+        }
+        if (limbs.empty())
+        {
+            negative = false;
+        }
+    }
+};
+
+// every element has to be a whole number small enough that a double holds it exactly.
+inline bool isIntegerMatrix(const Matrix& a)
+{
+    for (int i = 0; i < a.rows(); i++)
+    {
+        for (int j = 0; j < a.cols(); j++)
+        {
+            double value = a[i][j];
+            if (!(fabs(value) <= 9007199254740992.0) || value != floor(value))
+            {
+                return false;
+            }
+        }
+    }
+    return true;
+}
+
+// log2 of Hadamard's bound on |det| (and on every minor). Rows shorter than 1 count as 1, so that taking a subset
+// of the rows can never make the bound bigger; an all-zero row doesn't matter since then the determinant is just 0.
+inline double hadamardBoundLog2(const Matrix& a)
+{
+    int n = a.rows();
+    double bits = 0;
+    for (int i = 0; i < n; i++)
+    {
+        double sumSquares = 0;
+        for (int j = 0; j < n; j++)
+        {
+            sumSquares += a[i][j] * a[i][j];
+        }
+        if (sumSquares > 1)
+        {
+            bits += 0.5 * log2(sumSquares);
+        }
+    }
+    return bits;
+}
+
+// Bareiss on 64 bit integers. Only safe when hadamardBoundLog2(a) < 62.
+inline int64_t determinantBareiss(const Matrix& a)
+{
+    int n = a.rows();
+    std::vector<int64_t> m((size_t)n * n);
+    for (int i = 0; i < n; i++)
+    {
+        for (int j = 0; j < n; j++)
+        {
+            m[(size_t)i * n + j] = (int64_t)a[i][j];
+        }
+    }
+    int64_t sign = 1;
+    int64_t previous = 1;
+    for (int k = 0; k < n - 1; k++)
+    {
+        int64_t* rowK = &m[(size_t)k * n];
+        if (rowK[k] == 0)
+        {
+            // any nonzero pivot will do, the arithmetic is exact.
+            int swapRow = k + 1;
+            while (swapRow < n && m[(size_t)swapRow * n + k] == 0)
+            {
+                swapRow++;
+            }
+            if (swapRow == n)
+            {
+                return 0;
+            }
+            std::swap_ranges(rowK, rowK + n, &m[(size_t)swapRow * n]);
+            sign = -sign;
+        }
+        for (int i = k + 1; i < n; i++)
+        {
+            int64_t* rowI = &m[(size_t)i * n];
+            for (int j = k + 1; j < n; j++)
+            {
+                __int128 t = (__int128)rowI[j] * rowK[k] - (__int128)rowI[k] * rowK[j];
+                rowI[j] = (int64_t)(t / previous);
+            }
+            rowI[k] = 0;
+        }
+        previous = rowK[k];
+    }
+    return sign * m[(size_t)n * n - 1];
+}
+
+// the biggest count primes under 2^31, biggest first. Products of two residues fit in 64 bits with room to add a
+// third. The list is shared (and only ever grows), so it's behind a lock for when several threads want primes.
+inline std::vector<uint32_t> modularPrimes(size_t count)
+{
+    static std::mutex lock;
+    static std::vector<uint32_t> primes;
+    std::lock_guard<std::mutex> guard(lock);
+    uint32_t candidate = primes.empty() ? (1u << 31) - 1 : primes.back() - 2;
+    while (primes.size() < count)
+    {
+        bool prime = true;
+        for (uint32_t d = 3; d * d <= candidate; d += 2)
+        {
+            if (candidate % d == 0)
+            {
+                prime = false;
+                break;
+            }
+        }
+        if (prime)
+        {
+            primes.push_back(candidate);
+        }
+        candidate -= 2;
+    }
+    return std::vector<uint32_t>(primes.begin(), primes.begin() + count);
+}
+
+inline uint32_t powMod(uint64_t base, uint32_t exponent, uint32_t p)
+{
+    uint64_t result = 1;
+    base %= p;
+    while (exponent != 0)
+    {
+        if (exponent & 1)
+        {
+            result = result * base % p;
+        }
+        base = base * base % p;
+        exponent >>= 1;
+    }
+    return (uint32_t)result;
+}
+
+// p is prime, so x^(p-2) is x^-1.
+inline uint32_t inverseMod(uint32_t x, uint32_t p)
+{
+    return powMod(x, p - 2, p);
+}
+
+// det A mod p by Gaussian elimination over the integers mod p.
+inline uint32_t determinantModP(const Matrix& a, uint32_t p)
+{
+    int n = a.rows();
+    std::vector<uint32_t> m((size_t)n * n);
+    for (int i = 0; i < n; i++)
+    {
+        for (int j = 0; j < n; j++)
+        {
+            int64_t r = (int64_t)a[i][j] % (int64_t)p;
+            m[(size_t)i * n + j] = (uint32_t)(r < 0 ? r + p : r);
+        }
+    }
+    uint64_t det = 1;
+    for (int k = 0; k < n; k++)
+    {
+        uint32_t* rowK = &m[(size_t)k * n];
+        if (rowK[k] == 0)
+        {
+            int swapRow = k + 1;
+            while (swapRow < n && m[(size_t)swapRow * n + k] == 0)
+            {
+                swapRow++;
+            }
+            if (swapRow == n)
+            {
+                return 0;
+            }
+            std::swap_ranges(rowK, rowK + n, &m[(size_t)swapRow * n]);
+            det = p - det;
+        }
+        det = det * rowK[k] % p;
+        uint64_t inverse = inverseMod(rowK[k], p);
+        for (int i = k + 1; i < n; i++)
+        {
+            uint32_t* rowI = &m[(size_t)i * n];
+            if (rowI[k] == 0)
+            {
+                continue;
+            }
+            uint64_t multiplier = p - rowI[k] * inverse % p;            // -(a[i][k] / a[k][k])
+            for (int j = k + 1; j < n; j++)
+            {
+                rowI[j] = (uint32_t)((rowI[j] + multiplier * rowK[j]) % p);
+            }
+        }
+    }
+    return (uint32_t)(det % p);
+}
+
+// put the residues back together (Garner's algorithm), then shift into (-M/2, M/2] so negatives come out right.
+inline BigInt chineseRemainder(const std::vector<uint32_t>& residues, const std::vector<uint32_t>& primes)
+{
+    size_t k = residues.size();
+    // mixed radix digits: x = v0 + v1 p0 + v2 p0 p1 + ...
+    std::vector<uint32_t> digits(k);
+    for (size_t i = 0; i < k; i++)
+    {
+        uint32_t p = primes[i];
+        uint64_t x = 0;
+        uint64_t radix = 1;
+        for (size_t j = 0; j < i; j++)
+        {
+            x = (x + digits[j] * radix) % p;
+            radix = radix * (primes[j] % p) % p;
+        }
+        uint64_t difference = (residues[i] + p - x) % p;
+        digits[i] = (uint32_t)(difference * inverseMod((uint32_t)radix, p) % p);
+    }
+    BigInt value;
+    BigInt modulus(1);
+    for (size_t i = k; i-- > 0;)
+    {
+        value.multiplyAdd(primes[i], digits[i]);
+    }
+    for (size_t i = 0; i < k; i++)
+    {
+        modulus.multiplyAdd(primes[i], 0);
+    }
+    BigInt twice = value;
+    twice.multiplyAdd(2, 0);
+    if (twice.compareMagnitude(modulus) > 0)
+    {
+        value.subtractFrom(modulus);
+        value.negate();
+    }
+    return value;
+}
+
+struct ExactStats
+{
+    double boundBits;                                       // log2 of the Hadamard bound
+    int primes;                                             // 0 if Bareiss did it
+};
+
+// the exact determinant of an integer matrix (check isIntegerMatrix first).
+inline BigInt determinantExact(const Matrix& a, ThreadPool& pool, ExactStats& stats)
+{
+    int n = a.rows();
+    stats.boundBits = hadamardBoundLog2(a);
+    stats.primes = 0;
+    if (stats.boundBits < 62)
+    {
+        return BigInt(determinantBareiss(a));
+    }
+    // every prime is over 2^30.99, and we need the product to be over 2 * bound.
+    size_t count = (size_t)ceil((stats.boundBits + 2) / 30.99);
+    std::vector<uint32_t> primes = modularPrimes(count);
+    std::vector<uint32_t> residues(count);
+    ThreadPool& useful = (long)n * n * n * (long)count >= (1L << 22) ? pool : serialPool();
+    useful.parallelFor(0, (int)count, 1, [&](int p0, int p1)
+    {
+        for (int p = p0; p < p1; p++)
+        {
+            residues[p] = determinantModP(a, primes[p]);
+        }
+    });
+    stats.primes = (int)count;
+    return chineseRemainder(residues, primes);
+}
+
+#endif
@@ -0,0 +1,277 @@
+/*
+ * Factor once, solve many: LU factorization with partial pivoting
+ * Evan Perry Grove, 2017
+ *
+ * Gauss-Jordan on [A|b] redoes all of the O(n^3) work on A for every b. If A
+ * stays the same, it's much cheaper to factor it once into PA = LU and then
+ * solve each b with two O(n^2) triangular solves. Solving against the identity
+ * gives the inverse, which is the same thing as running [A|I] through RREF.
+ *
+ * FactorizationCache remembers the factors of recently seen matrices, keyed by
+ * a hash of A, so submitting the same A again skips straight to the solves.
+ */
+
+#ifndef LU_H
+#define LU_H
+
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+#include <list>
+#include <utility>
+#include <vector>
+
+#include "matrix.h"
+#include "rowops.h"
+#include "threadpool.h"
+#include "metrics.h"
+
+struct LUFactors
+{
+    Matrix lu;                                              // U on and above the diagonal, L (without its 1s) below
+    std::vector<int> perm;                                  // row i of PA is row perm[i] of A
+    int swaps;
+    bool singular;
+};
+
+// factor the leading n x n block of a (a can have extra columns, they're ignored).
+inline LUFactors factorLU(const Matrix& a)
+{
+    GJ_PHASE(PHASE_FACTOR);
+    int n = a.rows();
+    LUFactors f;
+    f.lu = Matrix(n, n);
+    f.perm.resize(n);
+    f.swaps = 0;
+    f.singular = false;
+    for (int i = 0; i < n; i++)
+    {
+        memcpy(f.lu[i], a[i], n * sizeof(double));
+        f.perm[i] = i;
+    }
+    Matrix& lu = f.lu;
+    ThreadPool& pool = eliminationPool(n);
+    for (int c = 0; c < n; c++)
+    {
+        int pivotRow = c;
+        for (int i = c + 1; i < n; i++)
+        {
+            if (fabs(lu[i][c]) > fabs(lu[pivotRow][c]))
+            {
+                pivotRow = i;
+            }
+        }
+        if (lu[pivotRow][c] == 0)
+        {
+            f.singular = true;
+            continue;
+        }
+        if (pivotRow != c)
+        {
+            lu.swapRows(pivotRow, c);
+            std::swap(f.perm[pivotRow], f.perm[c]);
+            f.swaps++;
+        }
+        const double* rowC = lu[c];
+        pool.parallelFor(c + 1, n, 64, [&](int i0, int i1)
+        {
+            for (int i = i0; i < i1; i++)
+            {
+                double* rowI = lu[i];
+                double multiplier = rowI[c] / rowC[c];
+                rowI[c] = multiplier;
+                rowAxpy(rowI + c + 1, rowC + c + 1, multiplier, n - c - 1);
+            }
+        });
+    }
+    return f;
+}
+
+// one right hand side: the triangular solves are dot products of a row of L or U with x, which is a lot better
+// than a row operation on a one-element row for every single entry.
+inline void solveLUColumn(const LUFactors& f, double* x)
+{
+    int n = f.lu.rows();
+    for (int i = 1; i < n; i++)
+    {
+        const double* rowL = f.lu[i];
+        double sum = 0;
+        for (int j = 0; j < i; j++)
+        {
+            sum += rowL[j] * x[j];
+        }
+        x[i] -= sum;
+    }
+    for (int i = n - 1; i >= 0; i--)
+    {
+        const double* rowU = f.lu[i];
+        double sum = 0;
+        for (int j = i + 1; j < n; j++)
+        {
+            sum += rowU[j] * x[j];
+        }
+        x[i] = (x[i] - sum) / rowU[i];
+    }
+}
+
+// solve A X = B for every column of b at once (b is n x k). With several right hand sides they ride along in each
+// row, so the triangular solves are row operations on k-long rows, same as the elimination.
+inline Matrix solveLU(const LUFactors& f, const Matrix& b)
+{
+    GJ_PHASE(PHASE_SOLVE);
+    int n = f.lu.rows();
+    int k = b.cols();
+    Matrix x(n, k);
+    if (k == 1)
+    {
+        std::vector<double> column(n);
+        for (int i = 0; i < n; i++)
+        {
+            column[i] = b[f.perm[i]][0];
+        }
+        solveLUColumn(f, column.data());
+        for (int i = 0; i < n; i++)
+        {
+            x[i][0] = column[i];
+        }
+        return x;
+    }
+    for (int i = 0; i < n; i++)
+    {
+        memcpy(x[i], b[f.perm[i]], k * sizeof(double));
+    }
+    // L y = P b, L has 1s on the diagonal
+    for (int i = 1; i < n; i++)
+    {
+        const double* rowL = f.lu[i];
+        for (int j = 0; j < i; j++)
+        {
+            if (rowL[j] != 0)
+            {
+                rowAxpy(x[i], x[j], rowL[j], k);
+            }
+        }
+    }
+    // U x = y
+    for (int i = n - 1; i >= 0; i--)
+    {
+        const double* rowU = f.lu[i];
+        for (int j = i + 1; j < n; j++)
+        {
+            if (rowU[j] != 0)
+            {
+                rowAxpy(x[i], x[j], rowU[j], k);
+            }
+        }
+        rowScale(x[i], 1 / rowU[i], k);
+    }
+    return x;
+}
+
+// A^-1, by solving against the identity.
+inline Matrix inverseLU(const LUFactors& f)
+{
+    return solveLU(f, identityMatrix(f.lu.rows()));
+}
+
+inline double determinantFromLU(const LUFactors& f)
+{
+    if (f.singular)
+    {
+        return 0;
+    }
+    double det = (f.swaps % 2) == 0 ? 1 : -1;
+    for (int i = 0; i < f.lu.rows(); i++)
+    {
+        det *= f.lu[i][i];
+    }
+    return det;
+}
+
+// FNV-1a over the bytes of the leading n x n block.
+inline uint64_t hashMatrix(const Matrix& a)
+{
+    int n = a.rows();
+    uint64_t hash = 14695981039346656037ull ^ (uint64_t)n;
+    for (int i = 0; i < n; i++)
+    {
+        const unsigned char* bytes = reinterpret_cast<const unsigned char*>(a[i]);
+        for (size_t b = 0; b < n * sizeof(double); b++)
+        {
+            hash = (hash ^ bytes[b]) * 1099511628211ull;
+        }
+    }
+    return hash;
+}
+
+// the last few factorizations we did, most recently used first. A hash match gets double-checked against the stored
+// copy of A before we trust it, since comparing is O(n^2) and factoring is O(n^3).
+class FactorizationCache
+{
+public:
+    explicit FactorizationCache(size_t capacity = 8) : capacity(capacity), hits(0), misses(0) {}
+
+    const LUFactors& factor(const Matrix& a)
+    {
+        uint64_t hash = hashMatrix(a);
+        for (std::list<Entry>::iterator it = entries.begin(); it != entries.end(); ++it)
+        {
+            if (it->hash == hash && sameBlock(it->a, a))
+            {
+                hits++;
+                entries.splice(entries.begin(), entries, it);
+                return entries.front().factors;
+            }
+        }
+        misses++;
+        Entry entry;
+        entry.hash = hash;
+        entry.a = Matrix(a.rows(), a.rows());
+        for (int i = 0; i < a.rows(); i++)
+        {
+            memcpy(entry.a[i], a[i], a.rows() * sizeof(double));
+        }
+        entry.factors = factorLU(a);
+        entries.push_front(std::move(entry));
+        if (entries.size() > capacity)
+        {
+            entries.pop_back();
+        }
+        return entries.front().factors;
+    }
+
+    long cacheHits() const { return hits; }
+    long cacheMisses() const { return misses; }
+
+private:
+    struct Entry
+    {
+        uint64_t hash;
+        Matrix a;
+        LUFactors factors;
+    };
+
+    std::list<Entry> entries;
+    size_t capacity;
+    long hits;
+    long misses;
+
+    static bool sameBlock(const Matrix& stored, const Matrix& a)
+    {
+        int n = a.rows();
+        if (stored.rows() != n)
+        {
+            return false;
+        }
+        for (int i = 0; i < n; i++)
+        {
+            if (memcmp(stored[i], a[i], n * sizeof(double)) != 0)
+            {
+                return false;
+            }
+        }
+        return true;
+    }
+};
+
+#endif
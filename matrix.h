@@ -0,0 +1,212 @@
+/*
+ * Dense matrix storage shared by determinant.cpp and rref_approx.cpp
+ * Evan Perry Grove, 2017
+ *
+ * Every element lives in one row-major buffer that starts on a 64-byte (cache
+ * line) boundary. Each row is padded out to a whole number of cache lines, so
+ * every row starts on its own line too. The old per-row vectors and stack
+ * arrays are gone: big systems just need enough heap, not enough stack.
+ *
+ * A Matrix can also be a view of memory it doesn't own (like a memory-mapped
+ * file, see matrix_io.h). Copying a view gives you a normal, owning Matrix.
+ */
+
+#ifndef MATRIX_H
+#define MATRIX_H
+
+#include <cstdlib>
+#include <cstring>
+#include <new>
+#include <algorithm>
+
+#include "metrics.h"
+
+// a row of a Matrix. elements are next to each other in memory.
+struct RowSpan
+{
+    double* data;
+    int size;
+
+    double& operator[](int j) const { return data[j]; }
+    double* begin() const { return data; }
+    double* end() const { return data + size; }
+};
+
+// a column of a Matrix. elements are one row stride apart in memory.
+struct ColSpan
+{
+    double* data;
+    int size;
+    int stride;
+
+    double& operator[](int i) const { return data[(long)i * stride]; }
+};
+
+class Matrix
+{
+public:
+    static const int ALIGNMENT = 64;                        // bytes. one cache line on pretty much anything x86
+    static const int ROW_ALIGN = ALIGNMENT / sizeof(double);
+
+    Matrix() : nRows(0), nCols(0), rowStride(0), buffer(NULL), owner(true) {}
+
+    Matrix(int rows, int cols) : nRows(0), nCols(0), rowStride(0), buffer(NULL), owner(true)
+    {
+        allocate(rows, cols);
+    }
+
+    Matrix(const Matrix& other) : nRows(0), nCols(0), rowStride(0), buffer(NULL), owner(true)
+    {
+        allocate(other.nRows, other.nCols);
+        for (int i = 0; i < nRows; i++)
+        {
+            memcpy((*this)[i], other[i], nCols * sizeof(double));
+        }
+    }
+
+    Matrix(Matrix&& other)
+        : nRows(other.nRows), nCols(other.nCols), rowStride(other.rowStride), buffer(other.buffer), owner(other.owner)
+    {
+        other.nRows = other.nCols = other.rowStride = 0;
+        other.buffer = NULL;
+        other.owner = true;
+    }
+
+    // wrap somebody else's memory. Nothing gets copied, and nothing gets freed when the view goes away, so the
+    // memory has to outlive it.
+    static Matrix view(double* data, int rows, int cols, int stride)
+    {
+        Matrix m;
+        m.nRows = rows;
+        m.nCols = cols;
+        m.rowStride = stride;
+        m.buffer = data;
+        m.owner = false;
+        return m;
+    }
+
+    Matrix& operator=(Matrix other)
+    {
+        swap(other);
+        return *this;
+    }
+
+    ~Matrix()
+    {
+        if (owner)
+        {
+            free(buffer);
+        }
+    }
+
+    void swap(Matrix& other)
+    {
+        std::swap(nRows, other.nRows);
+        std::swap(nCols, other.nCols);
+        std::swap(rowStride, other.rowStride);
+        std::swap(buffer, other.buffer);
+        std::swap(owner, other.owner);
+    }
+
+    int rows() const { return nRows; }
+    int cols() const { return nCols; }
+    int stride() const { return rowStride; }                // in elements, not bytes
+
+    double* data() { return buffer; }
+    const double* data() const { return buffer; }
+
+    // matrix[i][j] works just like it did with the old 2D arrays.
+    double* operator[](int i) { return buffer + (long)i * rowStride; }
+    const double* operator[](int i) const { return buffer + (long)i * rowStride; }
+
+    RowSpan row(int i)
+    {
+        RowSpan r = { (*this)[i], nCols };
+        return r;
+    }
+
+    ColSpan col(int j)
+    {
+        ColSpan c = { buffer + j, nRows, rowStride };
+        return c;
+    }
+
+    void swapRows(int a, int b)
+    {
+        if (a == b)
+        {
+            return;
+        }
+        double* rowA = (*this)[a];
+        double* rowB = (*this)[b];
+        for (int j = 0; j < nCols; j++)
+        {
+            std::swap(rowA[j], rowB[j]);
+        }
+        GJ_COUNT(swaps, 1);
+    }
+
+    void swapColumns(int a, int b)
+    {
+        if (a == b)
+        {
+            return;
+        }
+        for (int i = 0; i < nRows; i++)
+        {
+            double* rowI = (*this)[i];
+            std::swap(rowI[a], rowI[b]);
+        }
+        GJ_COUNT(columnSwaps, 1);
+    }
+
+private:
+    int nRows;
+    int nCols;
+    int rowStride;
+    double* buffer;
+    bool owner;                                             // false for views, which don't free their buffer
+
+    size_t bytes() const
+    {
+        return (size_t)nRows * rowStride * sizeof(double);
+    }
+
+    void allocate(int rows, int cols)
+    {
+        nRows = rows;
+        nCols = cols;
+        // round each row up to a whole number of cache lines. If that lands on a multiple of 4KB, add one more line
+        // so that walking down a column doesn't keep hitting the same cache set.
+        rowStride = ((cols + ROW_ALIGN - 1) / ROW_ALIGN) * ROW_ALIGN;
+        if (rowStride > 0 && (rowStride * sizeof(double)) % 4096 == 0)
+        {
+            rowStride += ROW_ALIGN;
+        }
+        if (bytes() == 0)
+        {
+            return;
+        }
+        buffer = static_cast<double*>(aligned_alloc(ALIGNMENT, bytes()));
+        if (buffer == NULL)
+        {
+            throw std::bad_alloc();
+        }
+        GJ_COUNT(allocations, 1);
+        GJ_COUNT(allocatedBytes, (long)bytes());
+        memset(buffer, 0, bytes());                         // start out with every element 0, padding included
+    }
+};
+
+// n x n, 1s on the diagonal.
+inline Matrix identityMatrix(int n)
+{
+    Matrix identity(n, n);
+    for (int i = 0; i < n; i++)
+    {
+        identity[i][i] = 1;
+    }
+    return identity;
+}
+
+#endif
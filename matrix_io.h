@@ -0,0 +1,418 @@
+/*
+ * Batch input and output for matrices
+ * Evan Perry Grove, 2017
+ *
+ * The batch text format is just the dimensions of each matrix followed by its
+ * values, row by row. Any whitespace separates things, so these are the same:
+ *
+ *     2 3          2 3 1 2 3 4 5 6
+ *     1 2 3
+ *     4 5 6
+ *
+ * A file can hold as many matrices as you want, one after the other. Numbers
+ * are parsed straight out of one big buffer with from_chars, since going
+ * through cin one element at a time ends up costing more than the math does.
+ *
+ * There's also a binary format for big systems, where even a fast text parser
+ * is slower than the elimination. Each matrix is a 64 byte MatrixFileHeader
+ * followed by its raw row-major values, and the next matrix starts on the
+ * next 64 byte boundary. Binary files get memory-mapped and the Matrix you
+ * get back is a view straight into the mapping: no parsing and no copying.
+ * The mapping is private, so working on the matrix in place never changes the
+ * file on disk. The reader figures out which format a file is by itself.
+ */
+
+#ifndef MATRIX_IO_H
+#define MATRIX_IO_H
+
+#include <cstdio>
+#include <cstdint>
+#include <charconv>
+#include <string>
+#include <vector>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "matrix.h"
+#include "metrics.h"
+
+const uint32_t SCALAR_FLOAT32 = 1;
+const uint32_t SCALAR_FLOAT64 = 2;
+
+struct MatrixFileHeader
+{
+    char magic[4];                                          // always "GJMX"
+    uint32_t version;                                       // 1
+    uint32_t scalarType;                                    // SCALAR_FLOAT32 or SCALAR_FLOAT64
+    uint32_t headerBytes;                                   // the values start this far past the start of the header
+    uint64_t rows;
+    uint64_t cols;
+    uint64_t stride;                                        // elements (not bytes) from the start of one row to the next
+    uint8_t reserved[24];
+};
+
+static_assert(sizeof(MatrixFileHeader) == 64, "MatrixFileHeader has to stay 64 bytes");
+
+inline bool isMatrixFileHeader(const char* data, size_t length)
+{
+    return length >= sizeof(MatrixFileHeader) && memcmp(data, "GJMX", 4) == 0;
+}
+
+class MatrixReader
+{
+public:
+    MatrixReader() : base(NULL), length(0), pos(0), mapped(false), binary(false) {}
+
+    ~MatrixReader()
+    {
+        if (mapped)
+        {
+            munmap(base, length);
+        }
+    }
+
+    // open a file (an empty path or "-" means stdin). Binary files get mapped, text gets slurped into memory.
+    bool open(const std::string& path)
+    {
+        int fd = 0;
+        if (!path.empty() && path != "-")
+        {
+            fd = ::open(path.c_str(), O_RDONLY);
+            if (fd < 0)
+            {
+                err = "could not open " + path;
+                return false;
+            }
+            char magic[sizeof(MatrixFileHeader)];
+            struct stat info;
+            if (fstat(fd, &info) == 0 && pread(fd, magic, sizeof(magic), 0) == (ssize_t)sizeof(magic)
+                && isMatrixFileHeader(magic, sizeof(magic)))
+            {
+                void* map = mmap(NULL, info.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+                close(fd);
+                if (map == MAP_FAILED)
+                {
+                    err = "could not map " + path;
+                    return false;
+                }
+                base = static_cast<char*>(map);
+                length = info.st_size;
+                mapped = true;
+                binary = true;
+                pos = 0;
+                return true;
+            }
+        }
+        char chunk[1 << 16];
+        ssize_t got;
+        while ((got = read(fd, chunk, sizeof(chunk))) > 0)
+        {
+            text.insert(text.end(), chunk, chunk + got);
+        }
+        if (fd != 0)
+        {
+            close(fd);
+        }
+        base = text.data();
+        length = text.size();
+        binary = isMatrixFileHeader(base, length);          // stdin can still be binary, it just can't be mapped
+        pos = 0;
+        return true;
+    }
+
+    // read the next matrix. Returns false at the end of the input, or if something was malformed (check failed()).
+    bool next(Matrix& m)
+    {
+        GJ_PHASE(PHASE_INPUT);
+        if (binary)
+        {
+            return nextBinary(m);
+        }
+        skipSpace();
+        if (pos >= length)
+        {
+            return false;
+        }
+        int rows = 0;
+        int cols = 0;
+        if (!readInt(rows) || !readInt(cols) || rows <= 0 || cols <= 0)
+        {
+            err = "bad matrix dimensions";
+            return false;
+        }
+        // every value takes at least two bytes (some space before it and a digit), so don't allocate more than the
+        // rest of the input could possibly fill.
+        if ((size_t)rows * cols > (length - pos) / 2)
+        {
+            err = "expected " + std::to_string((size_t)rows * cols) + " values for a " + std::to_string(rows) + "x"
+                + std::to_string(cols) + " matrix";
+            return false;
+        }
+        Matrix result(rows, cols);
+        for (int i = 0; i < rows; i++)
+        {
+            double* row = result[i];
+            for (int j = 0; j < cols; j++)
+            {
+                if (!readDouble(row[j]))
+                {
+                    err = "expected " + std::to_string((size_t)rows * cols) + " values for a "
+                        + std::to_string(rows) + "x" + std::to_string(cols) + " matrix";
+                    return false;
+                }
+            }
+        }
+        m.swap(result);
+        return true;
+    }
+
+    bool failed() const { return !err.empty(); }
+    const std::string& error() const { return err; }
+
+private:
+    std::vector<char> text;
+    char* base;                                             // either the mapped file or text.data()
+    size_t length;
+    size_t pos;
+    bool mapped;
+    bool binary;
+    std::string err;
+
+    MatrixReader(const MatrixReader&);                      // the mapping can only be unmapped once
+    MatrixReader& operator=(const MatrixReader&);
+
+    bool nextBinary(Matrix& m)
+    {
+        if (pos >= length)
+        {
+            return false;
+        }
+        if (!isMatrixFileHeader(base + pos, length - pos))
+        {
+            err = "bad binary matrix header";
+            return false;
+        }
+        MatrixFileHeader header;
+        memcpy(&header, base + pos, sizeof(header));
+        size_t scalarBytes = header.scalarType == SCALAR_FLOAT32 ? sizeof(float) : sizeof(double);
+        if (header.version != 1 || (header.scalarType != SCALAR_FLOAT32 && header.scalarType != SCALAR_FLOAT64)
+            || header.rows == 0 || header.cols == 0 || header.stride < header.cols
+            || header.rows > 0x7fffffff || header.stride > 0x7fffffff || header.headerBytes < sizeof(header))
+        {
+            err = "unsupported binary matrix header";
+            return false;
+        }
+        // rows * stride * scalarBytes can wrap around for a big enough (or broken) header, so check against what's
+        // left in the file before multiplying anything.
+        size_t rowBytes = header.stride * scalarBytes;
+        if (header.headerBytes > length - pos || header.rows > (length - pos - header.headerBytes) / rowBytes)
+        {
+            err = "binary matrix is cut off";
+            return false;
+        }
+        size_t dataBytes = header.rows * rowBytes;
+        char* values = base + pos + header.headerBytes;
+        int rows = (int)header.rows;
+        int cols = (int)header.cols;
+        int stride = (int)header.stride;
+        bool aligned = ((uintptr_t)values % alignof(double)) == 0;
+        if (header.scalarType == SCALAR_FLOAT64 && mapped && aligned)
+        {
+            Matrix result = Matrix::view(reinterpret_cast<double*>(values), rows, cols, stride);
+            m.swap(result);
+        }
+        else
+        {
+            // floats have to be widened, and anything that came in over stdin has to be copied out anyway.
+            Matrix result(rows, cols);
+            for (int i = 0; i < rows; i++)
+            {
+                const char* row = values + (size_t)i * stride * scalarBytes;
+                for (int j = 0; j < cols; j++)
+                {
+                    if (header.scalarType == SCALAR_FLOAT32)
+                    {
+                        float value;
+                        memcpy(&value, row + j * sizeof(float), sizeof(float));
+                        result[i][j] = value;
+                    }
+                    else
+                    {
+                        memcpy(&result[i][j], row + j * sizeof(double), sizeof(double));
+                    }
+                }
+            }
+            m.swap(result);
+        }
+        pos += header.headerBytes + dataBytes;
+        pos = (pos + 63) & ~(size_t)63;                     // the next header starts on a 64 byte boundary
+        return true;
+    }
+
+    void skipSpace()
+    {
+        while (pos < length && (base[pos] == ' ' || base[pos] == '\n' || base[pos] == '\t' || base[pos] == '\r'))
+        {
+            pos++;
+        }
+    }
+
+    bool readInt(int& value)
+    {
+        skipSpace();
+        const char* first = base + pos;
+        std::from_chars_result r = std::from_chars(first, base + length, value);
+        if (r.ec != std::errc())
+        {
+            return false;
+        }
+        pos += r.ptr - first;
+        return true;
+    }
+
+    bool readDouble(double& value)
+    {
+        skipSpace();
+        if (pos < length && base[pos] == '+')          // from_chars won't take a leading +, but people write them
+        {
+            pos++;
+        }
+        const char* first = base + pos;
+        std::from_chars_result r = std::from_chars(first, base + length, value);
+        if (r.ec != std::errc())
+        {
+            return false;
+        }
+        pos += r.ptr - first;
+        return true;
+    }
+};
+
+// writes results in either format, buffered so we're not making a syscall per number.
+class MatrixWriter
+{
+public:
+    explicit MatrixWriter(FILE* out = stdout, bool binary = false) : out(out), binary(binary) {}
+    ~MatrixWriter() { flush(); }
+
+    void write(const Matrix& m)
+    {
+        GJ_PHASE(PHASE_OUTPUT);
+        if (binary)
+        {
+            writeBinary(m);
+            return;
+        }
+        writeInt(m.rows());
+        buffer += ' ';
+        writeInt(m.cols());
+        buffer += '\n';
+        for (int i = 0; i < m.rows(); i++)
+        {
+            const double* row = m[i];
+            for (int j = 0; j < m.cols(); j++)
+            {
+                if (j > 0)
+                {
+                    buffer += ' ';
+                }
+                writeValue(row[j]);
+            }
+            buffer += '\n';
+        }
+        maybeFlush();
+    }
+
+    // a single number, like a determinant. In binary it goes out as a 1x1 matrix.
+    void writeScalar(double value)
+    {
+        GJ_PHASE(PHASE_OUTPUT);
+        if (binary)
+        {
+            Matrix m(1, 1);
+            m[0][0] = value;
+            writeBinary(m);
+            return;
+        }
+        writeValue(value);
+        endLine();
+    }
+
+    // shortest text that reads back as exactly the same double.
+    void writeValue(double value)
+    {
+        char digits[32];
+        std::to_chars_result r = std::to_chars(digits, digits + sizeof(digits), value);
+        buffer.append(digits, r.ptr);
+    }
+
+    void writeInt(long value)
+    {
+        char digits[24];
+        std::to_chars_result r = std::to_chars(digits, digits + sizeof(digits), value);
+        buffer.append(digits, r.ptr);
+    }
+
+    void writeLine(const std::string& line)
+    {
+        GJ_PHASE(PHASE_OUTPUT);
+        buffer += line;
+        buffer += '\n';
+        maybeFlush();
+    }
+
+    void endLine()
+    {
+        buffer += '\n';
+        maybeFlush();
+    }
+
+    void flush()
+    {
+        GJ_PHASE(PHASE_OUTPUT);
+        fwrite(buffer.data(), 1, buffer.size(), out);
+        fflush(out);
+        buffer.clear();
+    }
+
+private:
+    FILE* out;
+    bool binary;
+    std::string buffer;
+
+    // the rows go straight out of the matrix, padding and all, so this is one big write per row.
+    void writeBinary(const Matrix& m)
+    {
+        MatrixFileHeader header;
+        memset(&header, 0, sizeof(header));
+        memcpy(header.magic, "GJMX", 4);
+        header.version = 1;
+        header.scalarType = SCALAR_FLOAT64;
+        header.headerBytes = sizeof(header);
+        header.rows = m.rows();
+        header.cols = m.cols();
+        header.stride = m.stride();
+        flush();
+        fwrite(&header, sizeof(header), 1, out);
+        size_t dataBytes = (size_t)m.rows() * m.stride() * sizeof(double);
+        for (int i = 0; i < m.rows(); i++)
+        {
+            fwrite(m[i], sizeof(double), m.stride(), out);
+        }
+        static const char zeros[64] = {0};
+        fwrite(zeros, 1, (64 - dataBytes % 64) % 64, out);
+    }
+
+    void maybeFlush()
+    {
+        if (buffer.size() > (1 << 16))
+        {
+            flush();
+        }
+    }
+};
+
+#endif
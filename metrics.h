@@ -0,0 +1,312 @@
+/*
+ * Counters and phase timers for profiling real runs
+ * Evan Perry Grove, 2017
+ *
+ * The row kernels, swapRows and Matrix's allocator bump a few counters as they
+ * go (flops, axpys, scales, swaps, allocations), and the tools time each phase
+ * of a run (reading input, placing pivot rows, REF, RREF, writing output and so
+ * on). Pass --metrics to either tool to get all of it as JSON on stderr (or
+ * --metrics file to put it in a file) when the run is over.
+ *
+ * Counting is always on, since it's one increment of a thread-local per row
+ * operation. Every thread has its own set of counters so the workers never
+ * fight over a cache line, and they get added up when the report is written,
+ * which is always after the pool has finished its work. The timers only read
+ * the clock when --metrics was given.
+ *
+ * Build with -DGJ_NO_METRICS and all of it compiles away to nothing; --metrics
+ * then just reports that metrics were left out of the build.
+ */
+
+#ifndef METRICS_H
+#define METRICS_H
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <mutex>
+#include <string>
+#include <utility>
+#include <vector>
+
+enum MetricsPhase
+{
+    PHASE_INPUT,
+    PHASE_PIVOT,
+    PHASE_REF,
+    PHASE_RREF,
+    PHASE_FACTOR,
+    PHASE_SOLVE,
+    PHASE_DETERMINANT,
+    PHASE_OUTPUT,
+    PHASE_COUNT
+};
+
+inline const char* phaseName(int phase)
+{
+    static const char* const names[PHASE_COUNT] = {
+        "input", "pivot", "ref", "rref", "factor", "solve", "determinant", "output"
+    };
+    return names[phase];
+}
+
+struct MetricsCounters
+{
+    long flops;
+    long axpys;
+    long scales;
+    long swaps;
+    long columnSwaps;
+    long allocations;
+    long allocatedBytes;
+    long phaseCalls[PHASE_COUNT];
+    long phaseNanos[PHASE_COUNT];
+    int activePhases;                                       // bit p is set while phase p is being timed
+    bool registered;
+};
+
+#ifndef GJ_NO_METRICS
+
+// every thread's counters, so the report can add them up. Threads don't all live as long as the program does (like
+// solverd's dispatcher), so when one exits its counts get added into retired and it drops out of the list.
+struct MetricsRegistry
+{
+    std::mutex lock;
+    std::vector<MetricsCounters*> threads;
+    MetricsCounters retired;
+    bool timing;
+};
+
+// never destroyed on purpose: the shared pool's workers only exit while statics are being destroyed, and they still
+// have to retire their counters into it then.
+inline MetricsRegistry& metricsRegistry()
+{
+    static MetricsRegistry* registry = new MetricsRegistry();
+    return *registry;
+}
+
+inline void addMetrics(MetricsCounters& total, const MetricsCounters& counters)
+{
+    total.flops += counters.flops;
+    total.axpys += counters.axpys;
+    total.scales += counters.scales;
+    total.swaps += counters.swaps;
+    total.columnSwaps += counters.columnSwaps;
+    total.allocations += counters.allocations;
+    total.allocatedBytes += counters.allocatedBytes;
+    for (int p = 0; p < PHASE_COUNT; p++)
+    {
+        total.phaseCalls[p] += counters.phaseCalls[p];
+        total.phaseNanos[p] += counters.phaseNanos[p];
+    }
+}
+
+// plain old data, so using it never has to check whether it's been constructed yet.
+inline thread_local MetricsCounters threadMetrics;
+
+// the part that does need a destructor, kept apart from the counters so only registering ever touches it. It gets
+// constructed after threadMetrics is already there, so it's destroyed while threadMetrics is still good.
+struct MetricsRetirer
+{
+    MetricsRetirer() {}
+
+    ~MetricsRetirer()
+    {
+        MetricsRegistry& registry = metricsRegistry();
+        std::lock_guard<std::mutex> guard(registry.lock);
+        addMetrics(registry.retired, threadMetrics);
+        registry.threads.erase(std::find(registry.threads.begin(), registry.threads.end(), &threadMetrics));
+        threadMetrics = MetricsCounters();
+        threadMetrics.registered = true;                    // anything counted after this is too late for the report
+    }
+};
+
+inline thread_local MetricsRetirer threadMetricsRetirer;
+
+inline MetricsCounters& metrics()
+{
+    MetricsCounters& counters = threadMetrics;
+    if (!counters.registered)
+    {
+        MetricsRegistry& registry = metricsRegistry();
+        {
+            std::lock_guard<std::mutex> guard(registry.lock);
+            registry.threads.push_back(&counters);
+            counters.registered = true;
+        }
+        (void)&threadMetricsRetirer;                        // the first use is what constructs it
+    }
+    return counters;
+}
+
+inline void enablePhaseTimers()
+{
+    metricsRegistry().timing = true;
+}
+
+// times one phase from construction to destruction, if anybody asked for timing. A timer inside another one for
+// the same phase (like MatrixWriter::write flushing its buffer) doesn't count, so nothing gets timed twice.
+class PhaseTimer
+{
+public:
+    explicit PhaseTimer(int phase) : phase(phase), timing(metricsRegistry().timing)
+    {
+        if (timing)
+        {
+            MetricsCounters& counters = metrics();
+            timing = (counters.activePhases & (1 << phase)) == 0;
+            counters.activePhases |= 1 << phase;
+            start = std::chrono::steady_clock::now();
+        }
+    }
+
+    ~PhaseTimer()
+    {
+        if (timing)
+        {
+            MetricsCounters& counters = metrics();
+            counters.activePhases &= ~(1 << phase);
+            counters.phaseCalls[phase]++;
+            counters.phaseNanos[phase] += std::chrono::duration_cast<std::chrono::nanoseconds>(
+                std::chrono::steady_clock::now() - start).count();
+        }
+    }
+
+private:
+    int phase;
+    bool timing;
+    std::chrono::steady_clock::time_point start;
+
+    PhaseTimer(const PhaseTimer&);
+    PhaseTimer& operator=(const PhaseTimer&);
+};
+
+#define GJ_COUNT(field, amount) (metrics().field += (amount))
+#define GJ_PHASE_CAT(a, b) a##b
+#define GJ_PHASE_NAME(line) GJ_PHASE_CAT(phaseTimer, line)
+#define GJ_PHASE(phase) PhaseTimer GJ_PHASE_NAME(__LINE__)(phase)
+
+// everybody's counters added together.
+inline MetricsCounters metricsTotal()
+{
+    MetricsCounters total = MetricsCounters();
+    MetricsRegistry& registry = metricsRegistry();
+    std::lock_guard<std::mutex> guard(registry.lock);
+    addMetrics(total, registry.retired);
+    for (size_t t = 0; t < registry.threads.size(); t++)
+    {
+        addMetrics(total, *registry.threads[t]);
+    }
+    return total;
+}
+
+// the report. extra holds whatever else the tool wants to add (like the Laplace node counts).
+inline void writeMetricsJSON(FILE* out, const std::vector<std::pair<std::string, long> >& extra)
+{
+    MetricsCounters total = metricsTotal();
+    fprintf(out, "{\n  \"enabled\": true,\n  \"counters\": {\"flops\": %ld, \"axpys\": %ld, \"scales\": %ld, "
+            "\"swaps\": %ld, \"columnSwaps\": %ld, \"allocations\": %ld, \"allocatedBytes\": %ld",
+            total.flops, total.axpys, total.scales, total.swaps, total.columnSwaps, total.allocations,
+            total.allocatedBytes);
+    for (size_t e = 0; e < extra.size(); e++)
+    {
+        fprintf(out, ", \"%s\": %ld", extra[e].first.c_str(), extra[e].second);
+    }
+    fprintf(out, "},\n  \"phases\": {");
+    bool first = true;
+    for (int p = 0; p < PHASE_COUNT; p++)
+    {
+        if (total.phaseCalls[p] == 0)
+        {
+            continue;
+        }
+        fprintf(out, "%s\n    \"%s\": {\"calls\": %ld, \"seconds\": %.9f}", first ? "" : ",", phaseName(p),
+                total.phaseCalls[p], total.phaseNanos[p] * 1e-9);
+        first = false;
+    }
+    fprintf(out, "%s}\n}\n", first ? "" : "\n  ");
+    fflush(out);
+}
+
+#else
+
+inline void enablePhaseTimers() {}
+
+#define GJ_COUNT(field, amount) ((void)0)
+#define GJ_PHASE(phase) ((void)0)
+
+inline MetricsCounters metricsTotal()
+{
+    return MetricsCounters();
+}
+
+inline void writeMetricsJSON(FILE* out, const std::vector<std::pair<std::string, long> >&)
+{
+    fprintf(out, "{\"enabled\": false}\n");
+    fflush(out);
+}
+
+#endif
+
+// --metrics [file]: where the report goes, if anywhere. An empty path means stderr.
+inline bool writeMetricsReport(const std::string& path, const std::vector<std::pair<std::string, long> >& extra)
+{
+    FILE* out = path.empty() ? stderr : fopen(path.c_str(), "w");
+    if (out == NULL)
+    {
+        return false;
+    }
+    writeMetricsJSON(out, extra);
+    if (out != stderr)
+    {
+        fclose(out);
+    }
+    return true;
+}
+
+// --metrics in the tools: declare one of these at the top of main, and the report gets written on the way out of
+// main, whichever return that turns out to be. watch() adds one of the tool's own counters to it.
+class MetricsReport
+{
+public:
+    MetricsReport() : wanted(false) {}
+
+    ~MetricsReport()
+    {
+        if (!wanted)
+        {
+            return;
+        }
+        std::vector<std::pair<std::string, long> > extra;
+        for (size_t w = 0; w < watched.size(); w++)
+        {
+            extra.push_back(std::make_pair(watched[w].first, (long)*watched[w].second));
+        }
+        if (!writeMetricsReport(path, extra))
+        {
+            fprintf(stderr, "could not write metrics to %s\n", path.c_str());
+        }
+    }
+
+    void request(const std::string& reportPath)
+    {
+        wanted = true;
+        path = reportPath;
+        enablePhaseTimers();
+    }
+
+    void watch(const std::string& name, const int& counter)
+    {
+        watched.push_back(std::make_pair(name, &counter));
+    }
+
+private:
+    bool wanted;
+    std::string path;
+    std::vector<std::pair<std::string, const int*> > watched;
+
+    MetricsReport(const MetricsReport&);
+    MetricsReport& operator=(const MetricsReport&);
+};
+
+#endif
@@ -0,0 +1,352 @@
+/*
+ * Mixed precision solves: factor in float, refine in double
+ * Evan Perry Grove, 2017
+ *
+ * Almost all of the work in solving A X = B is the O(n^3) factorization, and
+ * in float that's twice as many elements per SIMD register and half the bytes
+ * through the cache. The float factors only give about 7 digits, though, so
+ * we get the rest back with iterative refinement:
+ *
+ *     R = B - A X       in double, against the original A
+ *     D = A^-1 R        with the float factors
+ *     X = X + D         in double
+ *
+ * Each round is O(n^2 k) and, as long as A isn't too badly conditioned (about
+ * 1e6 or less), cuts the error by another few digits, so a handful of rounds
+ * gets X as good as a double LU would. When it doesn't work out (the residual
+ * stops going down, A has entries float can't hold, or A is singular in float)
+ * we factor A in double after all and solve with that, the same way lu.h
+ * would have in the first place.
+ */
+
+#ifndef MIXED_H
+#define MIXED_H
+
+#include <algorithm>
+#include <cfloat>
+#include <cmath>
+#include <cstring>
+#include <utility>
+#include <vector>
+
+#include "matrix.h"
+#include "rowops.h"
+#include "threadpool.h"
+#include "lu.h"
+#include "metrics.h"
+
+const int MIXED_MAX_REFINEMENTS = 30;                       // same cap as LAPACK's dsgesv
+
+class MixedLU
+{
+public:
+    MixedLU() : n(0), stride(0), normA(0), hash(0), usingDouble(false), solves(0), refinements(0), fallbacks(0) {}
+
+    // factor the leading n x n block of m in float. Handing it the same A again doesn't redo anything.
+    void factor(const Matrix& m)
+    {
+        uint64_t mHash = hashMatrix(m);
+        if (mHash == hash && m.rows() == n && sameBlock(m))
+        {
+            return;
+        }
+        hash = mHash;
+        n = m.rows();
+        a = Matrix(n, n);
+        normA = 0;
+        for (int i = 0; i < n; i++)
+        {
+            memcpy(a[i], m[i], n * sizeof(double));
+            double rowSum = 0;
+            for (int j = 0; j < n; j++)
+            {
+                rowSum += std::abs(a[i][j]);
+            }
+            normA = std::max(normA, rowSum);
+        }
+        usingDouble = false;
+        full = LUFactors();
+        if (!factorFloat())
+        {
+            fallBack();
+        }
+    }
+
+    // X = A^-1 B, b is n x k.
+    Matrix solve(const Matrix& b)
+    {
+        solves++;
+        if (usingDouble)
+        {
+            return solveLU(full, b);
+        }
+        GJ_PHASE(PHASE_SOLVE);
+        int k = b.cols();
+        Matrix x = solveFloat(b);
+        Matrix r(n, k);
+        double threshold = DBL_EPSILON * std::sqrt((double)n) * normA;
+        double previous = INFINITY;
+        for (int step = 0; ; step++)
+        {
+            // how far the worst column is from done: 1 or less means every column is as good as double gets.
+            double worst = residual(x, b, r, threshold);
+            if (worst <= 1)
+            {
+                return x;
+            }
+            if (!(worst < previous) || step == MIXED_MAX_REFINEMENTS)
+            {
+                break;
+            }
+            previous = worst;
+            refinements++;
+            Matrix d = solveFloat(r);
+            for (int i = 0; i < n; i++)
+            {
+                for (int c = 0; c < k; c++)
+                {
+                    x[i][c] += d[i][c];
+                }
+            }
+        }
+        fallBack();
+        return solveLU(full, b);
+    }
+
+    // only known for sure once we've fallen back to double; the float factors just say A is close to singular.
+    bool singular() const { return usingDouble && full.singular; }
+    bool fellBack() const { return usingDouble; }
+    int solveCount() const { return solves; }
+    int refinementCount() const { return refinements; }     // rounds of refinement, over every solve
+    int fallbackCount() const { return fallbacks; }
+
+private:
+    Matrix a;                                               // A in double, for the residuals
+    std::vector<float> lu;                                  // the float factors, one row every stride floats
+    std::vector<int> perm;                                  // row i of PA is row perm[i] of A
+    int n;
+    int stride;
+    double normA;                                           // ||A||, infinity norm
+    uint64_t hash;
+    bool usingDouble;
+    LUFactors full;                                         // the double factors, once we've had to fall back
+    int solves;
+    int refinements;
+    int fallbacks;
+
+    float* row(int i) { return lu.data() + (size_t)i * stride; }
+    const float* row(int i) const { return lu.data() + (size_t)i * stride; }
+
+    bool sameBlock(const Matrix& m) const
+    {
+        for (int i = 0; i < n; i++)
+        {
+            if (memcmp(a[i], m[i], n * sizeof(double)) != 0)
+            {
+                return false;
+            }
+        }
+        return true;
+    }
+
+    void fallBack()
+    {
+        if (!usingDouble)
+        {
+            usingDouble = true;
+            fallbacks++;
+            full = factorLU(a);
+        }
+    }
+
+    // PA = LU in float, with partial pivoting, the same way factorLU does it. False if A has entries float can't
+    // hold or a pivot comes out 0, since then the factors are no use for refinement.
+    bool factorFloat()
+    {
+        GJ_PHASE(PHASE_FACTOR);
+        stride = (n + 15) & ~15;                            // whole 64 byte lines, like Matrix
+        lu.assign((size_t)n * stride, 0);
+        perm.resize(n);
+        for (int i = 0; i < n; i++)
+        {
+            float* rowI = row(i);
+            for (int j = 0; j < n; j++)
+            {
+                rowI[j] = (float)a[i][j];
+                if (!std::isfinite(rowI[j]))
+                {
+                    return false;
+                }
+            }
+            perm[i] = i;
+        }
+        ThreadPool& pool = eliminationPool(n);
+        for (int c = 0; c < n; c++)
+        {
+            int pivotRow = c;
+            for (int i = c + 1; i < n; i++)
+            {
+                if (std::abs(row(i)[c]) > std::abs(row(pivotRow)[c]))
+                {
+                    pivotRow = i;
+                }
+            }
+            if (row(pivotRow)[c] == 0 || !std::isfinite(row(pivotRow)[c]))
+            {
+                return false;
+            }
+            if (pivotRow != c)
+            {
+                std::swap_ranges(row(pivotRow), row(pivotRow) + n, row(c));
+                std::swap(perm[pivotRow], perm[c]);
+                GJ_COUNT(swaps, 1);
+            }
+            const float* rowC = row(c);
+            pool.parallelFor(c + 1, n, 64, [&](int i0, int i1)
+            {
+                for (int i = i0; i < i1; i++)
+                {
+                    float* rowI = row(i);
+                    float multiplier = rowI[c] / rowC[c];
+                    rowI[c] = multiplier;
+                    rowAxpy(rowI + c + 1, rowC + c + 1, multiplier, n - c - 1);
+                }
+            });
+        }
+        return true;
+    }
+
+    // A^-1 B with the float factors, handed back in double. Same layout as solveLU: dot products for one column,
+    // row operations on k-long rows for more.
+    Matrix solveFloat(const Matrix& b) const
+    {
+        int k = b.cols();
+        Matrix x(n, k);
+        if (k == 1)
+        {
+            std::vector<float> column(n);
+            for (int i = 0; i < n; i++)
+            {
+                column[i] = (float)b[perm[i]][0];
+            }
+            for (int i = 1; i < n; i++)
+            {
+                const float* rowL = row(i);
+                float sum = 0;
+                for (int j = 0; j < i; j++)
+                {
+                    sum += rowL[j] * column[j];
+                }
+                column[i] -= sum;
+            }
+            for (int i = n - 1; i >= 0; i--)
+            {
+                const float* rowU = row(i);
+                float sum = 0;
+                for (int j = i + 1; j < n; j++)
+                {
+                    sum += rowU[j] * column[j];
+                }
+                column[i] = (column[i] - sum) / rowU[i];
+            }
+            for (int i = 0; i < n; i++)
+            {
+                x[i][0] = column[i];
+            }
+            return x;
+        }
+        int kStride = (k + 15) & ~15;
+        std::vector<float> y((size_t)n * kStride);
+        for (int i = 0; i < n; i++)
+        {
+            float* rowY = y.data() + (size_t)i * kStride;
+            const double* rowB = b[perm[i]];
+            for (int c = 0; c < k; c++)
+            {
+                rowY[c] = (float)rowB[c];
+            }
+        }
+        for (int i = 1; i < n; i++)
+        {
+            const float* rowL = row(i);
+            float* rowY = y.data() + (size_t)i * kStride;
+            for (int j = 0; j < i; j++)
+            {
+                if (rowL[j] != 0)
+                {
+                    rowAxpy(rowY, y.data() + (size_t)j * kStride, rowL[j], k);
+                }
+            }
+        }
+        for (int i = n - 1; i >= 0; i--)
+        {
+            const float* rowU = row(i);
+            float* rowY = y.data() + (size_t)i * kStride;
+            for (int j = i + 1; j < n; j++)
+            {
+                if (rowU[j] != 0)
+                {
+                    rowAxpy(rowY, y.data() + (size_t)j * kStride, rowU[j], k);
+                }
+            }
+            float inverse = 1 / rowU[i];
+            for (int c = 0; c < k; c++)
+            {
+                rowY[c] *= inverse;
+                x[i][c] = rowY[c];
+            }
+        }
+        return x;
+    }
+
+    // R = B - A X, all in double. Returns the biggest ||r|| / (threshold ||x||) over the columns, so 1 or less means
+    // they've all converged (the test dsgesv uses). NaN or infinity anywhere comes back as infinity.
+    double residual(const Matrix& x, const Matrix& b, Matrix& r, double threshold) const
+    {
+        int k = b.cols();
+        for (int i = 0; i < n; i++)
+        {
+            memcpy(r[i], b[i], k * sizeof(double));
+            const double* rowA = a[i];
+            if (k == 1)
+            {
+                double sum = 0;
+                for (int j = 0; j < n; j++)
+                {
+                    sum += rowA[j] * x[j][0];
+                }
+                r[i][0] -= sum;
+                continue;
+            }
+            for (int j = 0; j < n; j++)
+            {
+                if (rowA[j] != 0)
+                {
+                    rowAxpy(r[i], x[j], rowA[j], k);
+                }
+            }
+        }
+        double worst = 0;
+        for (int c = 0; c < k; c++)
+        {
+            double normR = 0;
+            double normX = 0;
+            for (int i = 0; i < n; i++)
+            {
+                if (!std::isfinite(r[i][c]) || !std::isfinite(x[i][c]))
+                {
+                    return INFINITY;
+                }
+                normR = std::max(normR, std::abs(r[i][c]));
+                normX = std::max(normX, std::abs(x[i][c]));
+            }
+            if (normR > 0)
+            {
+                worst = std::max(worst, normR / (threshold * normX));
+            }
+        }
+        return worst;
+    }
+};
+
+#endif
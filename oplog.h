@@ -0,0 +1,216 @@
+/*
+ * A log of the row operations an elimination did
+ * Evan Perry Grove, 2017
+ *
+ * The verbose modes used to print every step right from inside the
+ * elimination loops, and extra verbose mode printed the whole matrix after
+ * each one. That's O(n^2) formatted output for every O(n) row operation, so
+ * the printing took way longer than the math. Now the elimination just
+ * appends a small fixed-size record to an OperationLog for each operation,
+ * and all the printing happens afterwards:
+ *
+ *     renderSteps()     the same "R2<- R2 - (R1 * 3)" lines as before, and if
+ *                       you give it a copy of the starting matrix, the matrix
+ *                       after every step (replayed, not stored)
+ *     snapshotAfter()   the matrix as it was after any one step
+ *     writeJSON()       the whole log as a JSON array
+ *
+ * Replaying does exactly what the elimination did (same row kernels, same
+ * order), so snapshots come out bit for bit the same as the real thing.
+ */
+
+#ifndef OPLOG_H
+#define OPLOG_H
+
+#include <charconv>
+#include <cmath>
+#include <cstdint>
+#include <ostream>
+#include <vector>
+
+#include "matrix.h"
+#include "rowops.h"
+
+enum OperationKind
+{
+    OP_SWAP,                                                // swap rows target and source
+    OP_SCALE,                                               // divide row target by factor, pivot column source becomes 1
+    OP_AXPY,                                                // row target = row target - (row source * factor)
+    OP_NOTE,                                                // "row target / factor" was reported but not done
+    OP_SWAP_COLUMNS                                         // swap columns target and source
+};
+
+struct Operation
+{
+    int32_t kind;
+    int32_t target;
+    int32_t source;
+    double factor;
+};
+
+class OperationLog
+{
+public:
+    void swap(int a, int b)
+    {
+        Operation op = { OP_SWAP, a, b, 0 };
+        ops.push_back(op);
+    }
+
+    void swapColumns(int a, int b)
+    {
+        Operation op = { OP_SWAP_COLUMNS, a, b, 0 };
+        ops.push_back(op);
+    }
+
+    void scale(int row, int pivotCol, double divisor)
+    {
+        Operation op = { OP_SCALE, row, pivotCol, divisor };
+        ops.push_back(op);
+    }
+
+    void axpy(int row, int source, double multiplier)
+    {
+        Operation op = { OP_AXPY, row, source, multiplier };
+        ops.push_back(op);
+    }
+
+    void note(int row, double divisor)
+    {
+        Operation op = { OP_NOTE, row, row, divisor };
+        ops.push_back(op);
+    }
+
+    size_t size() const { return ops.size(); }
+    const Operation& operator[](size_t k) const { return ops[k]; }
+    void clear() { ops.clear(); }
+
+private:
+    std::vector<Operation> ops;
+};
+
+// do one logged operation to m, exactly the way the elimination did it.
+inline void replayOperation(Matrix& m, const Operation& op)
+{
+    switch (op.kind)
+    {
+        case OP_SWAP:
+            m.swapRows(op.target, op.source);
+            break;
+        case OP_SWAP_COLUMNS:
+            m.swapColumns(op.target, op.source);
+            break;
+        case OP_SCALE:
+            rowScale(m[op.target], 1 / op.factor, m.cols());
+            m[op.target][op.source] = 1;
+            break;
+        case OP_AXPY:
+            rowAxpy(m[op.target], m[op.source], op.factor, m.cols());
+            break;
+    }
+}
+
+// the matrix after the first count operations, starting from start.
+inline Matrix snapshotAfter(const OperationLog& log, const Matrix& start, size_t count)
+{
+    Matrix m = start;
+    for (size_t k = 0; k < count && k < log.size(); k++)
+    {
+        replayOperation(m, log[k]);
+    }
+    return m;
+}
+
+// one step as text, the way the verbose modes have always shown it. Rows are numbered from 1.
+inline void renderOperation(std::ostream& out, const Operation& op)
+{
+    switch (op.kind)
+    {
+        case OP_SWAP:
+            out << "R" << op.target + 1 << "<- R" << op.source + 1 << std::endl
+                << "R" << op.source + 1 << "<- R" << op.target + 1 << std::endl;
+            break;
+        case OP_SWAP_COLUMNS:
+            out << "C" << op.target + 1 << "<- C" << op.source + 1 << std::endl
+                << "C" << op.source + 1 << "<- C" << op.target + 1 << std::endl;
+            break;
+        case OP_SCALE:
+        case OP_NOTE:
+            out << "R" << op.target + 1 << "<- R" << op.target + 1 << " / " << op.factor << std::endl;
+            break;
+        case OP_AXPY:
+            out << "R" << op.target + 1 << "<- R" << op.target + 1 << " - (R" << op.source + 1 << " * " << op.factor
+                << ")" << std::endl;
+            break;
+    }
+}
+
+// print operations [begin, end). If replay isn't null it has to hold the matrix as it was before operation begin;
+// each operation gets applied to it and snapshot(*replay) gets called after every step.
+template <class Snapshot>
+void renderSteps(const OperationLog& log, size_t begin, size_t end, std::ostream& out, Matrix* replay,
+                 const Snapshot& snapshot)
+{
+    for (size_t k = begin; k < end && k < log.size(); k++)
+    {
+        renderOperation(out, log[k]);
+        if (replay != NULL)
+        {
+            replayOperation(*replay, log[k]);
+            snapshot(*replay);
+        }
+    }
+}
+
+inline void writeJSONNumber(std::ostream& out, double value)
+{
+    if (!std::isfinite(value))
+    {
+        out << "null";
+        return;
+    }
+    char digits[32];
+    std::to_chars_result r = std::to_chars(digits, digits + sizeof(digits), value);
+    out.write(digits, r.ptr - digits);
+}
+
+// the log as a JSON array, one object per operation. Rows are numbered from 1 here too.
+inline void writeJSON(const OperationLog& log, std::ostream& out)
+{
+    out << "[";
+    for (size_t k = 0; k < log.size(); k++)
+    {
+        const Operation& op = log[k];
+        out << (k == 0 ? "\n  " : ",\n  ");
+        switch (op.kind)
+        {
+            case OP_SWAP:
+                out << "{\"op\": \"swap\", \"row\": " << op.target + 1 << ", \"with\": " << op.source + 1 << "}";
+                break;
+            case OP_SWAP_COLUMNS:
+                out << "{\"op\": \"swapColumns\", \"column\": " << op.target + 1 << ", \"with\": " << op.source + 1
+                    << "}";
+                break;
+            case OP_SCALE:
+                out << "{\"op\": \"scale\", \"row\": " << op.target + 1 << ", \"column\": " << op.source + 1
+                    << ", \"divisor\": ";
+                writeJSONNumber(out, op.factor);
+                out << "}";
+                break;
+            case OP_AXPY:
+                out << "{\"op\": \"axpy\", \"row\": " << op.target + 1 << ", \"source\": " << op.source + 1
+                    << ", \"factor\": ";
+                writeJSONNumber(out, op.factor);
+                out << "}";
+                break;
+            case OP_NOTE:
+                out << "{\"op\": \"note\", \"row\": " << op.target + 1 << ", \"divisor\": ";
+                writeJSONNumber(out, op.factor);
+                out << "}";
+                break;
+        }
+    }
+    out << (log.size() == 0 ? "]" : "\n]") << std::endl;
+}
+
+#endif
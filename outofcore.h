@@ -0,0 +1,571 @@
+/*
+ * Out-of-core elimination, for systems too big to fit in memory
+ * Evan Perry Grove, 2017
+ *
+ * The matrix lives in a scratch file on disk, cut into panels of w columns
+ * each (all n rows of them). Only three panels are ever in memory at once,
+ * and w is picked so that those three fit in the memory budget:
+ *
+ *     the target panel p, which is being brought up to date
+ *     the source panel q < p, whose row swaps and L part are being applied to it
+ *     the next panel in line, which a second thread is already reading in
+ *
+ * That's left-looking LU with partial pivoting: panel p gets the swaps and
+ * updates from panels 0 .. p-1 in order, then gets factored itself (pivots
+ * chosen from the whole column, which is all there in the panel) and written
+ * back out. The right hand sides are only n x k, so they stay in memory and
+ * get each panel's swaps and updates as soon as it's factored. A last pass
+ * over the panels from right to left does the back substitution with U, which
+ * leaves X, the same thing Gauss-Jordan's RREF [I | X] would give.
+ *
+ * Every panel gets written twice (once to set up the scratch file, once when
+ * it's factored) and read about P/2 times, so a bigger budget means fewer,
+ * wider panels and a lot less reading. The reads overlap with the
+ * arithmetic: while one source panel gets applied, the next one is on its way.
+ */
+
+#ifndef OUTOFCORE_H
+#define OUTOFCORE_H
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <future>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include <fcntl.h>
+#include <sys/resource.h>
+#include <unistd.h>
+
+#include "matrix.h"
+#include "matrix_io.h"
+#include "rowops.h"
+#include "threadpool.h"
+#include "metrics.h"
+
+const int OUT_OF_CORE_PANEL_BUFFERS = 3;                    // target, source, and the one being read ahead
+
+struct OutOfCoreStats
+{
+    int n;
+    int rhs;                                                // k, the number of right hand sides
+    int panelWidth;
+    int panels;
+    long budgetBytes;
+    long peakBufferBytes;                                   // the most our own buffers ever held at once
+    long peakResidentBytes;                                 // the whole process, as the kernel saw it
+    long bytesRead;
+    long bytesWritten;
+    long swaps;
+    double ioWaitSeconds;                                   // time the arithmetic sat waiting on a read
+    bool singular;
+};
+
+// the scratch file and everything that goes through it. Panel p lives at p * slotBytes, as its n rows one after
+// the other, stride doubles apart, the same layout as a Matrix's buffer, so a panel goes to and from disk in one call.
+class PanelFile
+{
+public:
+    PanelFile() : fd(-1), slotBytes(0), bytesRead(0), bytesWritten(0) {}
+
+    ~PanelFile()
+    {
+        if (fd >= 0)
+        {
+            close(fd);
+        }
+    }
+
+    // a fresh file in dir that's already unlinked, so it goes away by itself however we exit.
+    bool create(const std::string& dir, size_t panelSlotBytes, std::string& err)
+    {
+        std::string path = (dir.empty() ? std::string("/tmp") : dir) + "/gauss-jordan-panels-XXXXXX";
+        std::vector<char> name(path.begin(), path.end());
+        name.push_back('\0');
+        fd = mkstemp(name.data());
+        if (fd < 0)
+        {
+            err = "could not create a scratch file in " + (dir.empty() ? std::string("/tmp") : dir);
+            return false;
+        }
+        unlink(name.data());
+        slotBytes = panelSlotBytes;
+        return true;
+    }
+
+    // bytes bytes at offset within panel p's slot.
+    bool write(int p, size_t offset, const void* data, size_t bytes)
+    {
+        return transfer(p, offset, const_cast<void*>(data), bytes, true);
+    }
+
+    bool read(int p, size_t offset, void* data, size_t bytes)
+    {
+        return transfer(p, offset, data, bytes, false);
+    }
+
+    long readCount() const { return bytesRead; }
+    long writeCount() const { return bytesWritten; }
+
+private:
+    int fd;
+    size_t slotBytes;
+    std::atomic<long> bytesRead;                            // the read-ahead thread adds to this too
+    long bytesWritten;
+
+    bool transfer(int p, size_t offset, void* data, size_t bytes, bool writing)
+    {
+        char* at = static_cast<char*>(data);
+        off_t position = (off_t)((size_t)p * slotBytes + offset);
+        size_t done = 0;
+        while (done < bytes)
+        {
+            ssize_t got = writing ? pwrite(fd, at + done, bytes - done, position + done)
+                                  : pread(fd, at + done, bytes - done, position + done);
+            if (got <= 0)
+            {
+                return false;
+            }
+            done += got;
+        }
+        if (writing)
+        {
+            bytesWritten += bytes;
+        }
+        else
+        {
+            bytesRead += bytes;
+        }
+        return true;
+    }
+
+    PanelFile(const PanelFile&);
+    PanelFile& operator=(const PanelFile&);
+};
+
+// hands out panels in a fixed order, reading the next one on another thread while the caller works on the current
+// one. take() returns the next panel in the order, waiting for it if it isn't in yet; give() hands a buffer back
+// once the caller is done with it. A panel can't be read ahead before it's been written, so the order has to be
+// one where the panel after any take() is already on disk by the time of that take().
+class PanelReader
+{
+public:
+    PanelReader(PanelFile& file, std::vector<Matrix>& buffers, int n, double& waitSeconds)
+        : file(file), n(n), nextIndex(0), waitSeconds(waitSeconds), ok(true)
+    {
+        for (size_t b = 0; b < buffers.size(); b++)
+        {
+            idle.push_back(&buffers[b]);
+        }
+    }
+
+    ~PanelReader()
+    {
+        if (pending.valid())
+        {
+            pending.wait();
+        }
+    }
+
+    void setOrder(const std::vector<int>& panels)
+    {
+        order = panels;
+        nextIndex = 0;
+        startNext();
+    }
+
+    Matrix* take()
+    {
+        std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+        ok = pending.get() && ok;
+        waitSeconds += std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+        Matrix* panel = inFlight;
+        startNext();
+        return panel;
+    }
+
+    void give(Matrix* buffer)
+    {
+        idle.push_back(buffer);
+    }
+
+    bool failed() const { return !ok; }
+
+private:
+    PanelFile& file;
+    int n;
+    std::vector<int> order;
+    size_t nextIndex;
+    std::vector<Matrix*> idle;
+    Matrix* inFlight;
+    std::future<bool> pending;
+    double& waitSeconds;
+    bool ok;
+
+    void startNext()
+    {
+        if (nextIndex >= order.size())
+        {
+            return;
+        }
+        int p = order[nextIndex++];
+        inFlight = idle.back();
+        idle.pop_back();
+        Matrix* into = inFlight;
+        size_t bytes = (size_t)n * into->stride() * sizeof(double);
+        pending = std::async(std::launch::async, [this, p, into, bytes]()
+        {
+            return file.read(p, 0, into->data(), bytes);
+        });
+    }
+};
+
+// panel q (holding columns c0 .. c0+width) applied to target: the row swaps factoring q made, then the unit lower
+// triangular solve with q's diagonal block, then the rank-width update of every row below it. target(i) is row i of
+// whatever is being brought up to date (another panel, or the right hand sides), len elements of it.
+template <class Row>
+inline void applyPanel(const Matrix& q, int c0, int width, const std::vector<int>& pivots, int n, const Row& target,
+                       int len, ThreadPool& pool, long& swaps)
+{
+    for (int c = c0; c < c0 + width; c++)
+    {
+        if (pivots[c] != c)
+        {
+            std::swap_ranges(target(c), target(c) + len, target(pivots[c]));
+            swaps++;
+        }
+    }
+    for (int i = c0 + 1; i < c0 + width; i++)
+    {
+        const double* rowL = q[i];
+        for (int j = c0; j < i; j++)
+        {
+            if (rowL[j - c0] != 0)
+            {
+                rowAxpy(target(i), target(j), rowL[j - c0], len);
+            }
+        }
+    }
+    pool.parallelFor(c0 + width, n, 64, [&](int i0, int i1)
+    {
+        for (int i = i0; i < i1; i++)
+        {
+            const double* rowL = q[i];
+            for (int j = c0; j < c0 + width; j++)
+            {
+                if (rowL[j - c0] != 0)
+                {
+                    rowAxpy(target(i), target(j), rowL[j - c0], len);
+                }
+            }
+        }
+    });
+}
+
+// LU with partial pivoting of panel p (columns c0 .. c0+width) in memory, once every panel to its left has been
+// applied to it. pivots[c] gets the row that was swapped into row c.
+inline bool factorPanel(Matrix& panel, int c0, int width, std::vector<int>& pivots, int n, ThreadPool& pool,
+                        long& swaps)
+{
+    bool singular = false;
+    for (int lc = 0; lc < width; lc++)
+    {
+        int c = c0 + lc;
+        int pivotRow = c;
+        for (int i = c + 1; i < n; i++)
+        {
+            if (fabs(panel[i][lc]) > fabs(panel[pivotRow][lc]))
+            {
+                pivotRow = i;
+            }
+        }
+        pivots[c] = pivotRow;
+        if (panel[pivotRow][lc] == 0)
+        {
+            singular = true;
+            continue;
+        }
+        if (pivotRow != c)
+        {
+            std::swap_ranges(panel[c], panel[c] + width, panel[pivotRow]);
+            swaps++;
+        }
+        const double* rowC = panel[c];
+        pool.parallelFor(c + 1, n, 64, [&](int i0, int i1)
+        {
+            for (int i = i0; i < i1; i++)
+            {
+                double* rowI = panel[i];
+                double multiplier = rowI[lc] / rowC[lc];
+                rowI[lc] = multiplier;
+                rowAxpy(rowI + lc + 1, rowC + lc + 1, multiplier, width - lc - 1);
+            }
+        });
+    }
+    return !singular;
+}
+
+// element j of a row of a binary matrix file, as a double.
+inline double fileScalar(const char* row, size_t j, uint32_t scalarType)
+{
+    if (scalarType == SCALAR_FLOAT32)
+    {
+        float value;
+        memcpy(&value, row + j * sizeof(float), sizeof(float));
+        return value;
+    }
+    double value;
+    memcpy(&value, row + j * sizeof(double), sizeof(double));
+    return value;
+}
+
+// our own buffers, so the report can say how close we came to the budget.
+struct BufferUse
+{
+    long current;
+    long peak;
+
+    void add(long bytes)
+    {
+        current += bytes;
+        peak = std::max(peak, current);
+    }
+};
+
+// solve the n x (n+k) augmented system in the binary matrix file at path (the first matrix in it) without ever
+// holding more than about budgetBytes of it in memory. X comes back in x, or all NaN if A turned out to be singular.
+inline bool solveOutOfCore(const std::string& path, const std::string& scratchDir, long budgetBytes, Matrix& x,
+                           OutOfCoreStats& stats, std::string& err)
+{
+    memset(&stats, 0, sizeof(stats));
+    stats.budgetBytes = budgetBytes;
+    int in = ::open(path.c_str(), O_RDONLY);
+    if (in < 0)
+    {
+        err = "could not open " + path;
+        return false;
+    }
+    MatrixFileHeader header;
+    bool gotHeader = pread(in, &header, sizeof(header), 0) == (ssize_t)sizeof(header)
+        && isMatrixFileHeader(reinterpret_cast<const char*>(&header), sizeof(header));
+    size_t scalarBytes = header.scalarType == SCALAR_FLOAT32 ? sizeof(float) : sizeof(double);
+    if (!gotHeader || (header.scalarType != SCALAR_FLOAT32 && header.scalarType != SCALAR_FLOAT64)
+        || header.rows == 0 || header.cols <= header.rows || header.stride < header.cols
+        || header.rows > 0x7fffffff || header.stride > 0x7fffffff || header.headerBytes < sizeof(header))
+    {
+        close(in);
+        err = "out of core mode needs a binary (GJMX) file holding an n x (n+k) augmented matrix";
+        return false;
+    }
+    int n = (int)header.rows;
+    int k = (int)(header.cols - header.rows);
+    stats.n = n;
+    stats.rhs = k;
+
+    // the right hand sides stay in memory the whole time; what's left goes to the three panels.
+    BufferUse use = BufferUse();
+    x = Matrix(n, k);
+    use.add((long)n * x.stride() * sizeof(double));
+    long perColumn = (long)OUT_OF_CORE_PANEL_BUFFERS * n * sizeof(double);
+    long panelBudget = budgetBytes - use.current;
+    int width = panelBudget >= perColumn * 8 ? (int)std::min<long>(n, panelBudget / perColumn / 8 * 8)
+                                             : (int)std::min<long>(n, std::max<long>(0, panelBudget / perColumn));
+    if (width < 1)
+    {
+        close(in);
+        err = "a " + std::to_string(budgetBytes >> 20) + " MB budget is too small for n = " + std::to_string(n)
+            + ", it takes at least " + std::to_string((use.current + perColumn + (1 << 20) - 1) >> 20) + " MB";
+        return false;
+    }
+    int panels = (n + width - 1) / width;
+    stats.panelWidth = width;
+    stats.panels = panels;
+    std::vector<int> pivots(n);
+
+    // just the one panel buffer while the input gets copied in; the other two aren't needed until after.
+    std::vector<Matrix> buffers;
+    buffers.reserve(OUT_OF_CORE_PANEL_BUFFERS);
+    buffers.push_back(Matrix(n, width));
+    use.add((long)n * buffers[0].stride() * sizeof(double));
+    int stride = buffers[0].stride();
+    size_t slotBytes = (size_t)n * stride * sizeof(double);
+    PanelFile file;
+    if (!file.create(scratchDir, slotBytes, err))
+    {
+        close(in);
+        return false;
+    }
+
+    // copy the input into panels: a block of rows at a time (no more than a panel's worth of bytes), each one cut
+    // up across the panels through the panel buffer.
+    {
+        GJ_PHASE(PHASE_INPUT);
+        size_t rowBytes = header.stride * scalarBytes;
+        int blockRows = (int)std::max<size_t>(1, std::min<size_t>(n, slotBytes / rowBytes));
+        std::vector<char> raw((size_t)blockRows * rowBytes);
+        use.add((long)raw.size());
+        Matrix& block = buffers[0];
+        for (int r0 = 0; r0 < n; r0 += blockRows)
+        {
+            int rows = std::min(blockRows, n - r0);
+            size_t bytes = (size_t)rows * rowBytes;
+            if (pread(in, raw.data(), bytes, header.headerBytes + (off_t)r0 * rowBytes) != (ssize_t)bytes)
+            {
+                close(in);
+                err = "binary matrix is cut off";
+                return false;
+            }
+            stats.bytesRead += bytes;
+            for (int p = 0; p < panels; p++)
+            {
+                int c0 = p * width;
+                int w = std::min(width, n - c0);
+                for (int i = 0; i < rows; i++)
+                {
+                    const char* row = raw.data() + (size_t)i * rowBytes;
+                    for (int j = 0; j < w; j++)
+                    {
+                        block[i][j] = fileScalar(row, c0 + j, header.scalarType);
+                    }
+                }
+                if (!file.write(p, (size_t)r0 * stride * sizeof(double), block.data(),
+                                (size_t)rows * stride * sizeof(double)))
+                {
+                    close(in);
+                    err = "could not write the scratch file (out of disk space?)";
+                    return false;
+                }
+            }
+            for (int i = 0; i < rows; i++)
+            {
+                const char* row = raw.data() + (size_t)i * rowBytes;
+                for (int j = 0; j < k; j++)
+                {
+                    x[r0 + i][j] = fileScalar(row, n + j, header.scalarType);
+                }
+            }
+        }
+        use.current -= (long)raw.size();
+    }
+    close(in);
+    while ((int)buffers.size() < OUT_OF_CORE_PANEL_BUFFERS)
+    {
+        buffers.push_back(Matrix(n, width));
+        use.add((long)n * buffers.back().stride() * sizeof(double));
+    }
+
+    ThreadPool& pool = eliminationPool(n);
+    bool singular = false;
+
+    // forward: panel p, then every panel to its left, for each p in turn. The scratch file holds the factors after.
+    {
+        GJ_PHASE(PHASE_FACTOR);
+        std::vector<int> order;
+        for (int p = 0; p < panels; p++)
+        {
+            order.push_back(p);
+            for (int q = 0; q < p; q++)
+            {
+                order.push_back(q);
+            }
+        }
+        PanelReader reader(file, buffers, n, stats.ioWaitSeconds);
+        reader.setOrder(order);
+        for (int p = 0; p < panels; p++)
+        {
+            int c0 = p * width;
+            int w = std::min(width, n - c0);
+            Matrix* target = reader.take();
+            for (int q = 0; q < p; q++)
+            {
+                Matrix* source = reader.take();
+                applyPanel(*source, q * width, width, pivots, n, [&](int i) { return (*target)[i]; }, w, pool,
+                           stats.swaps);
+                reader.give(source);
+            }
+            if (!factorPanel(*target, c0, w, pivots, n, pool, stats.swaps))
+            {
+                singular = true;
+            }
+            if (!file.write(p, 0, target->data(), slotBytes))
+            {
+                err = "could not write the scratch file (out of disk space?)";
+                return false;
+            }
+            if (k > 0)
+            {
+                applyPanel(*target, c0, w, pivots, n, [&](int i) { return x[i]; }, k, serialPool(), stats.swaps);
+            }
+            reader.give(target);
+        }
+        if (reader.failed())
+        {
+            err = "could not read the scratch file back";
+            return false;
+        }
+    }
+
+    // back substitution, U x = y, one panel at a time from the right.
+    if (!singular && k > 0)
+    {
+        GJ_PHASE(PHASE_SOLVE);
+        std::vector<int> order;
+        for (int p = panels - 1; p >= 0; p--)
+        {
+            order.push_back(p);
+        }
+        PanelReader reader(file, buffers, n, stats.ioWaitSeconds);
+        reader.setOrder(order);
+        for (int p = panels - 1; p >= 0; p--)
+        {
+            int c0 = p * width;
+            int w = std::min(width, n - c0);
+            Matrix* panel = reader.take();
+            for (int lc = w - 1; lc >= 0; lc--)
+            {
+                int c = c0 + lc;
+                rowScale(x[c], 1 / (*panel)[c][lc], k);
+                for (int i = 0; i < c; i++)
+                {
+                    double u = (*panel)[i][lc];
+                    if (u != 0)
+                    {
+                        rowAxpy(x[i], x[c], u, k);
+                    }
+                }
+            }
+            reader.give(panel);
+        }
+        if (reader.failed())
+        {
+            err = "could not read the scratch file back";
+            return false;
+        }
+    }
+    if (singular)
+    {
+        for (int i = 0; i < n; i++)
+        {
+            std::fill(x[i], x[i] + k, NAN);
+        }
+    }
+
+    stats.singular = singular;
+    stats.bytesRead += file.readCount();
+    stats.bytesWritten = file.writeCount();
+    stats.peakBufferBytes = use.peak;
+    struct rusage usage;
+    if (getrusage(RUSAGE_SELF, &usage) == 0)
+    {
+        stats.peakResidentBytes = usage.ru_maxrss * 1024L;  // Linux reports it in kilobytes
+    }
+    return true;
+}
+
+#endif
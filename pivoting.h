@@ -0,0 +1,336 @@
+/*
+ * Pivoting strategies for the elimination
+ * Evan Perry Grove, 2017
+ *
+ * The elimination used to fix zero pivots before it started by swapping
+ * each offending row with the one below it, over and over until nothing
+ * changed. That never looked at how big a pivot was, only whether it was
+ * zero, and a tiny pivot is almost as bad as a zero one. Now a pivot gets
+ * picked for each column as the elimination reaches it, one of four ways:
+ *
+ *     partial     the biggest entry left in the column (the usual choice)
+ *     threshold   the entry already on the diagonal, as long as it's at
+ *                 least threshold times the biggest one in the column;
+ *                 otherwise the biggest. Fewer swaps, a little less stable
+ *     rook        an entry that's the biggest in both its row and its
+ *                 column, found by hopping between the two. Nearly as stable
+ *                 as complete pivoting, and usually only a few hops
+ *     complete    the biggest entry in everything that's left
+ *
+ * Rook and complete pivoting swap columns too, which reorders the unknowns.
+ * The REF comes out with its columns in pivot order; the RREF gets put back
+ * in the original order at the end (see restoreColumns).
+ *
+ * The fast elimination doesn't move rows around when it swaps them. It keeps
+ * a pointer to each row in a permutation vector and swaps those instead, and
+ * puts every row where it belongs once at the very end (see placeRows).
+ */
+
+#ifndef PIVOTING_H
+#define PIVOTING_H
+
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "matrix.h"
+#include "oplog.h"
+#include "metrics.h"
+
+enum PivotStrategy
+{
+    PIVOT_PARTIAL,
+    PIVOT_THRESHOLD,
+    PIVOT_ROOK,
+    PIVOT_COMPLETE
+};
+
+const double PIVOT_DEFAULT_THRESHOLD = 0.1;
+
+struct Pivoting
+{
+    Pivoting() : strategy(PIVOT_PARTIAL), threshold(PIVOT_DEFAULT_THRESHOLD) {}
+
+    PivotStrategy strategy;
+    double threshold;                                       // for PIVOT_THRESHOLD, a fraction from 0 to 1
+};
+
+// what the pivoting did to one matrix.
+struct PivotResult
+{
+    PivotResult() : rowSwaps(0), columnSwaps(0) {}
+
+    int rowSwaps;
+    int columnSwaps;
+    std::vector<int> columns;                               // REF column j is input column columns[j]; empty if the
+                                                            // columns never moved
+};
+
+inline bool parsePivotStrategy(const std::string& name, PivotStrategy& strategy)
+{
+    static const char* const names[] = { "partial", "threshold", "rook", "complete" };
+    for (int s = 0; s < 4; s++)
+    {
+        if (name == names[s])
+        {
+            strategy = (PivotStrategy)s;
+            return true;
+        }
+    }
+    return false;
+}
+
+inline const char* pivotStrategyName(PivotStrategy strategy)
+{
+    static const char* const names[] = { "partial", "threshold", "rook", "complete" };
+    return names[strategy];
+}
+
+// the pivot searches. row[i] is (a pointer to) row i as the elimination sees it right now; rows and columns c to
+// n-1 are what's left. Ties go to the first one found, so the row already in place wins when it can.
+
+inline int partialPivotRow(const double* const* row, int c, int n)
+{
+    int pivotRow = c;
+    double biggest = std::abs(row[c][c]);
+    for (int i = c + 1; i < n; i++)
+    {
+        if (std::abs(row[i][c]) > biggest)
+        {
+            biggest = std::abs(row[i][c]);
+            pivotRow = i;
+        }
+    }
+    return pivotRow;
+}
+
+inline int thresholdPivotRow(const double* const* row, int c, int n, double threshold)
+{
+    int pivotRow = partialPivotRow(row, c, n);
+    if (std::abs(row[c][c]) >= threshold * std::abs(row[pivotRow][c]) && row[c][c] != 0)
+    {
+        return c;
+    }
+    return pivotRow;
+}
+
+// the column of the first biggest entry in columns c0 to c1-1 of one row, if that's bigger than biggest (which then
+// gets updated), otherwise -1. Finding the biggest value first, four running maximums at a time with no branches,
+// and only then going back for where it was is several times quicker than keeping track of the index as it goes.
+inline int biggestInRow(const double* row, int c0, int c1, double& biggest)
+{
+    double m0 = 0;
+    double m1 = 0;
+    double m2 = 0;
+    double m3 = 0;
+    int j = c0;
+    for (; j + 4 <= c1; j += 4)
+    {
+        m0 = std::max(m0, std::abs(row[j]));
+        m1 = std::max(m1, std::abs(row[j + 1]));
+        m2 = std::max(m2, std::abs(row[j + 2]));
+        m3 = std::max(m3, std::abs(row[j + 3]));
+    }
+    for (; j < c1; j++)
+    {
+        m0 = std::max(m0, std::abs(row[j]));
+    }
+    double rowBiggest = std::max(std::max(m0, m1), std::max(m2, m3));
+    if (!(rowBiggest > biggest) || c0 >= c1)
+    {
+        return -1;
+    }
+    biggest = rowBiggest;
+    for (j = c0; std::abs(row[j]) != rowBiggest; j++)
+    {
+    }
+    return j;
+}
+
+inline void completePivot(const double* const* row, int c, int n, int& pivotRow, int& pivotCol)
+{
+    pivotRow = c;
+    pivotCol = c;
+    double biggest = -1;
+    for (int i = c; i < n; i++)
+    {
+        int j = biggestInRow(row[i], c, n, biggest);
+        if (j >= 0)
+        {
+            pivotRow = i;
+            pivotCol = j;
+        }
+    }
+}
+
+// start at the biggest entry in column c, then go to the biggest in that one's row, then the biggest in that one's
+// column and so on, until one is the biggest in both. Every hop finds something strictly bigger, so it always stops.
+// If that ends up on a zero (its row and column are all zero), there may still be something left elsewhere, so it
+// takes a complete search to be sure.
+inline void rookPivot(const double* const* row, int c, int n, int& pivotRow, int& pivotCol)
+{
+    pivotRow = partialPivotRow(row, c, n);
+    pivotCol = c;
+    double biggest = std::abs(row[pivotRow][c]);
+    for (;;)
+    {
+        int nextCol = pivotCol;
+        for (int j = c; j < n; j++)
+        {
+            if (std::abs(row[pivotRow][j]) > biggest)
+            {
+                biggest = std::abs(row[pivotRow][j]);
+                nextCol = j;
+            }
+        }
+        if (nextCol == pivotCol)
+        {
+            break;
+        }
+        pivotCol = nextCol;
+        int nextRow = pivotRow;
+        for (int i = c; i < n; i++)
+        {
+            if (std::abs(row[i][pivotCol]) > biggest)
+            {
+                biggest = std::abs(row[i][pivotCol]);
+                nextRow = i;
+            }
+        }
+        if (nextRow == pivotRow)
+        {
+            break;
+        }
+        pivotRow = nextRow;
+    }
+    if (biggest == 0)
+    {
+        completePivot(row, c, n, pivotRow, pivotCol);
+    }
+}
+
+// the pivot for column c, whichever way we're picking them. pivotCol only moves for rook and complete.
+inline void choosePivot(const double* const* row, int c, int n, const Pivoting& pivoting, int& pivotRow,
+                        int& pivotCol)
+{
+    pivotRow = c;
+    pivotCol = c;
+    switch (pivoting.strategy)
+    {
+        case PIVOT_PARTIAL:
+            pivotRow = partialPivotRow(row, c, n);
+            break;
+        case PIVOT_THRESHOLD:
+            pivotRow = thresholdPivotRow(row, c, n, pivoting.threshold);
+            break;
+        case PIVOT_ROOK:
+            rookPivot(row, c, n, pivotRow, pivotCol);
+            break;
+        case PIVOT_COMPLETE:
+            completePivot(row, c, n, pivotRow, pivotCol);
+            break;
+    }
+}
+
+// the permutation's scratch space, kept between calls so eliminating doesn't have to allocate anything. Every
+// thread eliminates on its own.
+inline thread_local std::vector<double*> pivotRowArena;
+inline thread_local std::vector<int> pivotFromArena;
+inline thread_local std::vector<double> pivotHeldArena;
+
+// row pointers for every row of matrix, in order, to permute.
+inline std::vector<double*>& rowPointers(Matrix& matrix)
+{
+    std::vector<double*>& row = pivotRowArena;
+    row.resize(matrix.rows());
+    for (int i = 0; i < matrix.rows(); i++)
+    {
+        row[i] = matrix[i];
+    }
+    return row;
+}
+
+// move every row of matrix to where the permutation says it goes: row[i] points at the row that belongs in row i.
+// Each row that isn't already in place gets copied exactly once, following the cycles of the permutation around.
+inline void placeRows(Matrix& matrix, std::vector<double*>& row)
+{
+    GJ_PHASE(PHASE_PIVOT);
+    int n = matrix.rows();
+    size_t bytes = matrix.cols() * sizeof(double);
+    std::vector<int>& from = pivotFromArena;
+    from.resize(n);
+    for (int i = 0; i < n; i++)
+    {
+        from[i] = (int)((row[i] - matrix.data()) / matrix.stride());
+    }
+    std::vector<double>& held = pivotHeldArena;
+    held.resize(matrix.cols());
+    for (int start = 0; start < n; start++)
+    {
+        if (from[start] == start)
+        {
+            continue;
+        }
+        memcpy(held.data(), matrix[start], bytes);
+        int to = start;
+        while (from[to] != start)
+        {
+            memcpy(matrix[to], matrix[from[to]], bytes);
+            int next = from[to];
+            from[to] = to;
+            to = next;
+        }
+        memcpy(matrix[to], held.data(), bytes);
+        from[to] = to;
+    }
+    for (int i = 0; i < n; i++)
+    {
+        row[i] = matrix[i];
+    }
+}
+
+// undo rook or complete pivoting's column swaps on an RREF. Row j of it solves for unknown columns[j], so putting
+// the columns back and then moving row j to row columns[j] gives the RREF of the matrix as it was input. That's
+// two sets of swaps, at most n-1 each, and they go in the log too (if there is one) so replaying still works.
+inline void restoreColumns(Matrix& matrix, const PivotResult& pivots, OperationLog* log)
+{
+    if (pivots.columns.empty())
+    {
+        return;
+    }
+    GJ_PHASE(PHASE_PIVOT);
+    int n = (int)pivots.columns.size();
+    std::vector<int> columns = pivots.columns;
+    for (int j = 0; j < n; j++)
+    {
+        while (columns[j] != j)
+        {
+            int k = columns[j];
+            matrix.swapColumns(j, k);
+            std::swap(columns[j], columns[k]);
+            if (log != NULL)
+            {
+                log->swapColumns(j, k);
+            }
+        }
+    }
+    columns = pivots.columns;
+    for (int i = 0; i < n; i++)
+    {
+        while (columns[i] != i)
+        {
+            int k = columns[i];
+            matrix.swapRows(i, k);
+            std::swap(columns[i], columns[k]);
+            if (log != NULL)
+            {
+                log->swap(i, k);
+            }
+        }
+    }
+}
+
+#endif
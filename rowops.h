@@ -0,0 +1,340 @@
+/*
+ * Vectorized row operations for the elimination inner loops
+ * Evan Perry Grove, 2017
+ *
+ * Pretty much all of the time in Gauss-Jordan goes into two row operations:
+ *
+ *     rowAxpy:   y = y - (x * a)       (subtract a multiple of the pivot row)
+ *     rowScale:  y = y * r             (divide a row by its pivot, r = 1/pivot)
+ *
+ * Each one has an SSE2, an AVX2+FMA and an AVX-512 version, plus a plain loop
+ * for everything else. The best one the CPU supports gets picked the first
+ * time either operation is used. Set GJ_SIMD to scalar, sse2, avx2 or avx512
+ * to force a particular one (handy for checking that they all agree). The FMA
+ * versions round a little differently than the plain loop does, but that's it.
+ *
+ * rowAxpy also comes in float, for the mixed precision solver (mixed.h). Same
+ * instructions, twice as many elements per register.
+ */
+
+#ifndef ROWOPS_H
+#define ROWOPS_H
+
+#include <cstdlib>
+#include <cstring>
+
+#include "metrics.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#define ROWOPS_X86 1
+#include <immintrin.h>
+#endif
+
+typedef void (*RowAxpyFn)(double* y, const double* x, double a, int len);
+typedef void (*RowScaleFn)(double* y, double r, int len);
+typedef void (*RowAxpyFloatFn)(float* y, const float* x, float a, int len);
+
+inline void rowAxpyScalar(double* y, const double* x, double a, int len)
+{
+    for (int j = 0; j < len; j++)
+    {
+        y[j] = y[j] - (x[j] * a);
+    }
+}
+
+inline void rowScaleScalar(double* y, double r, int len)
+{
+    for (int j = 0; j < len; j++)
+    {
+        y[j] = y[j] * r;
+    }
+}
+
+inline void rowAxpyFloatScalar(float* y, const float* x, float a, int len)
+{
+    for (int j = 0; j < len; j++)
+    {
+        y[j] = y[j] - (x[j] * a);
+    }
+}
+
+#ifdef ROWOPS_X86
+
+__attribute__((target("sse2")))
+inline void rowAxpySSE2(double* y, const double* x, double a, int len)
+{
+    __m128d va = _mm_set1_pd(a);
+    int j = 0;
+    for (; j + 4 <= len; j += 4)
+    {
+        __m128d y0 = _mm_loadu_pd(y + j);
+        __m128d y1 = _mm_loadu_pd(y + j + 2);
+        y0 = _mm_sub_pd(y0, _mm_mul_pd(_mm_loadu_pd(x + j), va));
+        y1 = _mm_sub_pd(y1, _mm_mul_pd(_mm_loadu_pd(x + j + 2), va));
+        _mm_storeu_pd(y + j, y0);
+        _mm_storeu_pd(y + j + 2, y1);
+    }
+    for (; j < len; j++)
+    {
+        y[j] = y[j] - (x[j] * a);
+    }
+}
+
+__attribute__((target("sse2")))
+inline void rowScaleSSE2(double* y, double r, int len)
+{
+    __m128d vr = _mm_set1_pd(r);
+    int j = 0;
+    for (; j + 2 <= len; j += 2)
+    {
+        _mm_storeu_pd(y + j, _mm_mul_pd(_mm_loadu_pd(y + j), vr));
+    }
+    for (; j < len; j++)
+    {
+        y[j] = y[j] * r;
+    }
+}
+
+__attribute__((target("sse2")))
+inline void rowAxpyFloatSSE2(float* y, const float* x, float a, int len)
+{
+    __m128 va = _mm_set1_ps(a);
+    int j = 0;
+    for (; j + 8 <= len; j += 8)
+    {
+        __m128 y0 = _mm_loadu_ps(y + j);
+        __m128 y1 = _mm_loadu_ps(y + j + 4);
+        y0 = _mm_sub_ps(y0, _mm_mul_ps(_mm_loadu_ps(x + j), va));
+        y1 = _mm_sub_ps(y1, _mm_mul_ps(_mm_loadu_ps(x + j + 4), va));
+        _mm_storeu_ps(y + j, y0);
+        _mm_storeu_ps(y + j + 4, y1);
+    }
+    for (; j < len; j++)
+    {
+        y[j] = y[j] - (x[j] * a);
+    }
+}
+
+__attribute__((target("avx2,fma")))
+inline void rowAxpyAVX2(double* y, const double* x, double a, int len)
+{
+    __m256d va = _mm256_set1_pd(a);
+    int j = 0;
+    for (; j + 8 <= len; j += 8)
+    {
+        __m256d y0 = _mm256_loadu_pd(y + j);
+        __m256d y1 = _mm256_loadu_pd(y + j + 4);
+        y0 = _mm256_fnmadd_pd(_mm256_loadu_pd(x + j), va, y0);
+        y1 = _mm256_fnmadd_pd(_mm256_loadu_pd(x + j + 4), va, y1);
+        _mm256_storeu_pd(y + j, y0);
+        _mm256_storeu_pd(y + j + 4, y1);
+    }
+    for (; j + 4 <= len; j += 4)
+    {
+        _mm256_storeu_pd(y + j, _mm256_fnmadd_pd(_mm256_loadu_pd(x + j), va, _mm256_loadu_pd(y + j)));
+    }
+    for (; j < len; j++)
+    {
+        y[j] = y[j] - (x[j] * a);
+    }
+}
+
+__attribute__((target("avx2")))
+inline void rowScaleAVX2(double* y, double r, int len)
+{
+    __m256d vr = _mm256_set1_pd(r);
+    int j = 0;
+    for (; j + 4 <= len; j += 4)
+    {
+        _mm256_storeu_pd(y + j, _mm256_mul_pd(_mm256_loadu_pd(y + j), vr));
+    }
+    for (; j < len; j++)
+    {
+        y[j] = y[j] * r;
+    }
+}
+
+__attribute__((target("avx2,fma")))
+inline void rowAxpyFloatAVX2(float* y, const float* x, float a, int len)
+{
+    __m256 va = _mm256_set1_ps(a);
+    int j = 0;
+    for (; j + 16 <= len; j += 16)
+    {
+        __m256 y0 = _mm256_loadu_ps(y + j);
+        __m256 y1 = _mm256_loadu_ps(y + j + 8);
+        y0 = _mm256_fnmadd_ps(_mm256_loadu_ps(x + j), va, y0);
+        y1 = _mm256_fnmadd_ps(_mm256_loadu_ps(x + j + 8), va, y1);
+        _mm256_storeu_ps(y + j, y0);
+        _mm256_storeu_ps(y + j + 8, y1);
+    }
+    for (; j + 8 <= len; j += 8)
+    {
+        _mm256_storeu_ps(y + j, _mm256_fnmadd_ps(_mm256_loadu_ps(x + j), va, _mm256_loadu_ps(y + j)));
+    }
+    for (; j < len; j++)
+    {
+        y[j] = y[j] - (x[j] * a);
+    }
+}
+
+// AVX-512 does the leftover elements with a mask instead of a scalar loop.
+__attribute__((target("avx512f")))
+inline void rowAxpyAVX512(double* y, const double* x, double a, int len)
+{
+    __m512d va = _mm512_set1_pd(a);
+    int j = 0;
+    for (; j + 16 <= len; j += 16)
+    {
+        __m512d y0 = _mm512_loadu_pd(y + j);
+        __m512d y1 = _mm512_loadu_pd(y + j + 8);
+        y0 = _mm512_fnmadd_pd(_mm512_loadu_pd(x + j), va, y0);
+        y1 = _mm512_fnmadd_pd(_mm512_loadu_pd(x + j + 8), va, y1);
+        _mm512_storeu_pd(y + j, y0);
+        _mm512_storeu_pd(y + j + 8, y1);
+    }
+    for (; j < len; j += 8)
+    {
+        int left = len - j;
+        __mmask8 mask = left >= 8 ? 0xff : (__mmask8)((1u << left) - 1);
+        __m512d y0 = _mm512_maskz_loadu_pd(mask, y + j);
+        y0 = _mm512_fnmadd_pd(_mm512_maskz_loadu_pd(mask, x + j), va, y0);
+        _mm512_mask_storeu_pd(y + j, mask, y0);
+    }
+}
+
+__attribute__((target("avx512f")))
+inline void rowScaleAVX512(double* y, double r, int len)
+{
+    __m512d vr = _mm512_set1_pd(r);
+    for (int j = 0; j < len; j += 8)
+    {
+        int left = len - j;
+        __mmask8 mask = left >= 8 ? 0xff : (__mmask8)((1u << left) - 1);
+        _mm512_mask_storeu_pd(y + j, mask, _mm512_mul_pd(_mm512_maskz_loadu_pd(mask, y + j), vr));
+    }
+}
+
+__attribute__((target("avx512f")))
+inline void rowAxpyFloatAVX512(float* y, const float* x, float a, int len)
+{
+    __m512 va = _mm512_set1_ps(a);
+    int j = 0;
+    for (; j + 32 <= len; j += 32)
+    {
+        __m512 y0 = _mm512_loadu_ps(y + j);
+        __m512 y1 = _mm512_loadu_ps(y + j + 16);
+        y0 = _mm512_fnmadd_ps(_mm512_loadu_ps(x + j), va, y0);
+        y1 = _mm512_fnmadd_ps(_mm512_loadu_ps(x + j + 16), va, y1);
+        _mm512_storeu_ps(y + j, y0);
+        _mm512_storeu_ps(y + j + 16, y1);
+    }
+    for (; j < len; j += 16)
+    {
+        int left = len - j;
+        __mmask16 mask = left >= 16 ? 0xffff : (__mmask16)((1u << left) - 1);
+        __m512 y0 = _mm512_maskz_loadu_ps(mask, y + j);
+        y0 = _mm512_fnmadd_ps(_mm512_maskz_loadu_ps(mask, x + j), va, y0);
+        _mm512_mask_storeu_ps(y + j, mask, y0);
+    }
+}
+
+#endif
+
+struct RowKernels
+{
+    RowAxpyFn axpy;
+    RowScaleFn scale;
+    RowAxpyFloatFn axpyFloat;
+    const char* name;
+};
+
+// figure out what this CPU can do (or what GJ_SIMD says to use).
+inline RowKernels pickRowKernels()
+{
+    RowKernels scalar = { rowAxpyScalar, rowScaleScalar, rowAxpyFloatScalar, "scalar" };
+#ifdef ROWOPS_X86
+    RowKernels sse2 = { rowAxpySSE2, rowScaleSSE2, rowAxpyFloatSSE2, "sse2" };
+    RowKernels avx2 = { rowAxpyAVX2, rowScaleAVX2, rowAxpyFloatAVX2, "avx2" };
+    RowKernels avx512 = { rowAxpyAVX512, rowScaleAVX512, rowAxpyFloatAVX512, "avx512" };
+    __builtin_cpu_init();
+    bool hasSSE2 = __builtin_cpu_supports("sse2");
+    bool hasAVX2 = __builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma");
+    bool hasAVX512 = __builtin_cpu_supports("avx512f");
+
+    const char* forced = getenv("GJ_SIMD");
+    if (forced != NULL)
+    {
+        if (strcmp(forced, "scalar") == 0)
+        {
+            return scalar;
+        }
+        if (strcmp(forced, "sse2") == 0 && hasSSE2)
+        {
+            return sse2;
+        }
+        if (strcmp(forced, "avx2") == 0 && hasAVX2)
+        {
+            return avx2;
+        }
+        if (strcmp(forced, "avx512") == 0 && hasAVX512)
+        {
+            return avx512;
+        }
+    }
+    if (hasAVX512)
+    {
+        return avx512;
+    }
+    if (hasAVX2)
+    {
+        return avx2;
+    }
+    if (hasSSE2)
+    {
+        return sse2;
+    }
+#endif
+    return scalar;
+}
+
+inline const RowKernels& rowKernels()
+{
+    static const RowKernels kernels = pickRowKernels();
+    return kernels;
+}
+
+// y[0..len) = y[0..len) - (x[0..len) * a)
+inline void rowAxpy(double* y, const double* x, double a, int len)
+{
+    if (len > 0)
+    {
+        rowKernels().axpy(y, x, a, len);
+        GJ_COUNT(axpys, 1);
+        GJ_COUNT(flops, 2 * len);
+    }
+}
+
+// the same thing in float.
+inline void rowAxpy(float* y, const float* x, float a, int len)
+{
+    if (len > 0)
+    {
+        rowKernels().axpyFloat(y, x, a, len);
+        GJ_COUNT(axpys, 1);
+        GJ_COUNT(flops, 2 * len);
+    }
+}
+
+// y[0..len) = y[0..len) * r
+inline void rowScale(double* y, double r, int len)
+{
+    if (len > 0)
+    {
+        rowKernels().scale(y, r, len);
+        GJ_COUNT(scales, 1);
+        GJ_COUNT(flops, len);
+    }
+}
+
+#endif
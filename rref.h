@@ -0,0 +1,644 @@
+/*
+ * Gauss-Jordan elimination: REF and RREF of an augmented matrix
+ * Evan Perry Grove, 2017
+ *
+ * The elimination from rref_approx.cpp without any of the prompts, so other
+ * programs (like the benchmark) can run the same code. There are two versions
+ * of everything: the original row-by-row one, which can log every step it
+ * takes for the verbose modes, and a cache-blocked, multithreaded one for when
+ * nobody is watching. Pass a null log to get the fast one.
+ *
+ * Both of those work on a square system, and pick each column's pivot as
+ * they go, whichever way pivoting.h is asked to (partial pivoting unless
+ * told otherwise). reduceToREFGeneral() and reduceToRREFGeneral() work on
+ * any m x n matrix instead: they pick pivots column by column, find the
+ * rank and the free variables, and notice when a system has no solution.
+ */
+
+#ifndef RREF_H
+#define RREF_H
+
+#include <algorithm>
+#include <cfloat>
+#include <cmath>
+#include <mutex>
+#include <vector>
+
+#include "matrix.h"
+#include "rowops.h"
+#include "threadpool.h"
+#include "oplog.h"
+#include "pivoting.h"
+#include "small.h"
+#include "metrics.h"
+
+// make M(i,i) equal to 1, if it isn't 0.
+inline void normalizePivot(Matrix& matrix, int i, OperationLog* log)
+{
+    //this algorithm works off of the assumption that M(c,c), M(i,i), or whatever else you want to call it,
+    //is always equal to 1 when performing the row operations. Although it increases the number of calculations
+    //we must perform, it means the row operation function can be brutally simple.
+    RowSpan rowI = matrix.row(i);
+    double divisor = rowI[i];
+    if (divisor != 0) {
+        //in MATLAB terms: M(i,:) = M(i,:) / M(i,i)
+        //in English: divide every row i by its element in column i. Multiplying by 1/divisor is a lot cheaper
+        //than dividing every element, but it doesn't always land exactly on 1, so put the 1 there ourselves.
+        rowScale(rowI.data, 1 / divisor, rowI.size);
+        rowI[i] = 1;
+        if (divisor !=  1 && log != NULL) 
+        {
+            log->scale(i, i, divisor);
+        }
+    }
+}
+
+//we're going to use elements M(1,1) M(2,2) etc as pivots. Make them all equal to 1 before moving things around
+inline void normalizePivots(Matrix& matrix, OperationLog* log)
+{
+    for (int i = 0; i < matrix.rows(); i++)
+    {
+        normalizePivot(matrix, i, log);
+    }
+}
+
+// subtract multiples of row c from row i to get M(i,c) to zero
+inline void eliminate(Matrix& matrix, int i, int c, OperationLog* log)
+{
+    //here's how this works: we know from normalizePivots() that any element M(c,c) is going to be 1. So,
+    //we can say that by doing row operation M(i,:) = M(i,:)-M(c,:)*M(i,c), we will always get M(i,c)=0.
+    RowSpan rowI = matrix.row(i);
+    RowSpan rowC = matrix.row(c);
+    double multiplier = rowI[c];
+    rowAxpy(rowI.data, rowC.data, multiplier, rowI.size);
+    if (log != NULL)
+    {
+        log->axpy(i, c, multiplier);
+    }
+}
+
+// cache blocking. Sweeping whole rows once per pivot column streams the entire matrix through the cache n times,
+// which falls off a cliff once the matrix doesn't fit in L2. The blocked versions below do the same elimination, but
+// they work PANEL columns at a time and apply the update to everything else in TILE_ROWS x TILE_COLS tiles. The
+// PANEL x TILE_COLS block of pivot rows (64KB) stays in cache while a whole tile of rows is run past it.
+//
+// Within a panel every row below the pivot rows can be updated on its own, so the tiles of rows get spread across
+// the thread pool. Each panel costs two rounds on the pool, and small matrices just stay on this thread (see
+// eliminationPool in threadpool.h).
+const int PANEL = 32;
+const int TILE_ROWS = 64;
+const int TILE_COLS = 256;
+
+// the last step of every REF: clear out the multipliers stored below the diagonal and make the pivots 1.
+inline void finishREF(const std::vector<double*>& row, int m, ThreadPool& pool)
+{
+    int n = (int)row.size();
+    pool.parallelFor(0, n, TILE_ROWS, [&](int i0, int i1)
+    {
+        for (int i = i0; i < i1; i++)
+        {
+            double* rowI = row[i];
+            for (int j = 0; j < i; j++)
+            {
+                rowI[j] = 0;
+            }
+            double divisor = rowI[i];
+            if (divisor != 0)
+            {
+                rowScale(rowI + i, 1 / divisor, m - i);
+                rowI[i] = 1;
+            }
+        }
+    });
+}
+
+// REF, the blocked way. This is a right-looking LU factorization with partial (or threshold) pivoting of the square
+// part, carried along the augmented column(s). Row c's multipliers get stashed where the zeros are going to go, and
+// at the very end everything below the diagonal gets zeroed and each row gets divided by its pivot, which is exactly
+// what the row-by-row version ends up with. Dividing every row at every step like the row-by-row version does only
+// scales rows, so it doesn't change the answer; it's just a lot of extra passes over the matrix. A zero pivot (the
+// system is singular) means that column is skipped.
+//
+// Rows get swapped by swapping pointers in row; they only move for real once, at the end.
+inline PivotResult reduceToREFBlocked(Matrix& matrix, const Pivoting& pivoting)
+{
+    int n = matrix.rows();
+    int m = matrix.cols();
+    ThreadPool& pool = eliminationPool(n);
+    PivotResult result;
+    std::vector<double*>& row = rowPointers(matrix);
+    for (int k0 = 0; k0 < n; k0 += PANEL)
+    {
+        int k1 = std::min(k0 + PANEL, n);
+        
+        // factor the panel a column at a time, down every row left, since the pivot for a column could be in any of
+        // them. The columns right of the panel wait for the updates below.
+        for (int c = k0; c < k1; c++)
+        {
+            int pivotRow = pivoting.strategy == PIVOT_THRESHOLD
+                ? thresholdPivotRow(row.data(), c, n, pivoting.threshold) : partialPivotRow(row.data(), c, n);
+            if (pivotRow != c)
+            {
+                std::swap(row[c], row[pivotRow]);
+                result.rowSwaps++;
+                GJ_COUNT(swaps, 1);
+            }
+            const double* rowC = row[c];
+            if (rowC[c] == 0)
+            {
+                continue;
+            }
+            pool.parallelFor(c + 1, n, TILE_ROWS, [&](int i0, int i1)
+            {
+                for (int i = i0; i < i1; i++)
+                {
+                    double* rowI = row[i];
+                    double multiplier = rowI[c] / rowC[c];
+                    rowI[c] = multiplier;
+                    rowAxpy(rowI + c + 1, rowC + c + 1, multiplier, k1 - c - 1);
+                }
+            });
+        }
+        
+        // bring the pivot rows up to date for every column right of the panel. Each worker takes some columns.
+        pool.parallelFor(k1, m, TILE_COLS, [&](int j0, int j1)
+        {
+            for (int c = k0; c < k1; c++)
+            {
+                if (row[c][c] == 0)
+                {
+                    continue;
+                }
+                const double* rowC = row[c];
+                for (int i = c + 1; i < k1; i++)
+                {
+                    double* rowI = row[i];
+                    rowAxpy(rowI + j0, rowC + j0, rowI[c], j1 - j0);
+                }
+            }
+        });
+        
+        // everything below the panel, one tile of rows at a time, one tile of columns at a time.
+        pool.parallelFor(k1, n, TILE_ROWS, [&](int i0, int i1)
+        {
+            for (int j0 = k1; j0 < m; j0 += TILE_COLS)
+            {
+                int j1 = std::min(j0 + TILE_COLS, m);
+                for (int i = i0; i < i1; i++)
+                {
+                    double* rowI = row[i];
+                    for (int c = k0; c < k1; c++)
+                    {
+                        double multiplier = rowI[c];
+                        if (multiplier == 0 || row[c][c] == 0)
+                        {
+                            continue;
+                        }
+                        rowAxpy(rowI + j0, row[c] + j0, multiplier, j1 - j0);
+                    }
+                }
+            }
+        });
+    }
+    finishREF(row, m, pool);
+    placeRows(matrix, row);
+    return result;
+}
+
+// REF with rook or complete pivoting. Those need to see everything that's left, all up to date, before they can
+// pick a pivot, so this is the plain right-looking version: every column updates the whole rest of the matrix.
+// Complete pivoting looks for the next pivot in each row right after updating it, while the row is still in cache,
+// instead of making another pass over all of it. Rows swap through row like in the blocked version; columns really
+// get swapped, since that's only one element per row.
+inline PivotResult reduceToREFFull(Matrix& matrix, const Pivoting& pivoting)
+{
+    int n = matrix.rows();
+    int m = matrix.cols();
+    ThreadPool& pool = eliminationPool(n);
+    bool complete = pivoting.strategy == PIVOT_COMPLETE;
+    PivotResult result;
+    result.columns.resize(n);
+    for (int i = 0; i < n; i++)
+    {
+        result.columns[i] = i;
+    }
+    std::vector<double*>& row = rowPointers(matrix);
+    int nextRow = 0;
+    int nextCol = 0;
+    if (complete)
+    {
+        completePivot(row.data(), 0, n, nextRow, nextCol);
+    }
+    std::mutex lock;
+    for (int c = 0; c < n; c++)
+    {
+        int pivotRow = nextRow;
+        int pivotCol = nextCol;
+        if (!complete)
+        {
+            rookPivot(row.data(), c, n, pivotRow, pivotCol);
+        }
+        if (pivotRow != c)
+        {
+            std::swap(row[c], row[pivotRow]);
+            result.rowSwaps++;
+            GJ_COUNT(swaps, 1);
+        }
+        if (pivotCol != c)
+        {
+            matrix.swapColumns(c, pivotCol);
+            std::swap(result.columns[c], result.columns[pivotCol]);
+            result.columnSwaps++;
+        }
+        // the biggest thing left is 0 (rook pivoting makes sure of that too), so there's nothing left to do.
+        const double* rowC = row[c];
+        if (rowC[c] == 0)
+        {
+            break;
+        }
+        double biggest = -1;
+        pool.parallelFor(c + 1, n, TILE_ROWS, [&](int i0, int i1)
+        {
+            double tileBiggest = -1;
+            int tileRow = 0;
+            int tileCol = 0;
+            for (int i = i0; i < i1; i++)
+            {
+                double* rowI = row[i];
+                double multiplier = rowI[c] / rowC[c];
+                rowI[c] = multiplier;
+                rowAxpy(rowI + c + 1, rowC + c + 1, multiplier, m - c - 1);
+                if (complete)
+                {
+                    int j = biggestInRow(rowI, c + 1, n, tileBiggest);
+                    if (j >= 0)
+                    {
+                        tileRow = i;
+                        tileCol = j;
+                    }
+                }
+            }
+            if (complete)
+            {
+                // ties go to the first one in row order, so the answer doesn't depend on which worker got there first.
+                std::lock_guard<std::mutex> guard(lock);
+                if (tileBiggest > biggest || (tileBiggest == biggest && tileRow < nextRow))
+                {
+                    biggest = tileBiggest;
+                    nextRow = tileRow;
+                    nextCol = tileCol;
+                }
+            }
+        });
+    }
+    finishREF(row, m, pool);
+    placeRows(matrix, row);
+    return result;
+}
+
+// RREF from REF, the blocked way. Once we have REF the square part is unit upper triangular, so getting rid of
+// column c above the pivot only changes column c (which becomes 0) and the augmented column(s). We go PANEL rows
+// at a time from the bottom up: finish off the rows inside the panel first, then use them to clean out their columns
+// in every row above, a tile of rows at a time (spread across the pool).
+inline void reduceToRREFBlocked(Matrix& matrix)
+{
+    int n = matrix.rows();
+    int m = matrix.cols();
+    ThreadPool& pool = eliminationPool(n);
+    for (int k1 = n; k1 > 0; k1 -= PANEL)
+    {
+        int k0 = std::max(k1 - PANEL, 0);
+        
+        for (int c = k1 - 1; c > k0; c--)
+        {
+            const double* rowC = matrix[c];
+            if (rowC[c] == 0)
+            {
+                continue;
+            }
+            for (int i = k0; i < c; i++)
+            {
+                double* rowI = matrix[i];
+                double multiplier = rowI[c];
+                rowI[c] = 0;
+                rowAxpy(rowI + n, rowC + n, multiplier, m - n);
+            }
+        }
+        
+        pool.parallelFor(0, k0, TILE_ROWS, [&](int i0, int i1)
+        {
+            for (int i = i0; i < i1; i++)
+            {
+                double* rowI = matrix[i];
+                for (int c = k0; c < k1; c++)
+                {
+                    const double* rowC = matrix[c];
+                    if (rowC[c] == 0)
+                    {
+                        continue;
+                    }
+                    double multiplier = rowI[c];
+                    rowI[c] = 0;
+                    rowAxpy(rowI + n, rowC + n, multiplier, m - n);
+                }
+            }
+        });
+    }
+}
+
+// get the REF form of the matrix. c is used to represent the column of the element we are making zero. Each
+// column's pivot gets picked, and swapped into place, right before that column gets used (see pivoting.h).
+// Without a log nobody is going to look at the steps, so that gets the blocked version, or the fixed-size kernels for
+// small systems. Pass what this returns on to reduceToRREF, which needs it to undo any column swaps.
+inline PivotResult reduceToREF(Matrix& matrix, OperationLog* log, const Pivoting& pivoting = Pivoting())
+{
+    GJ_PHASE(PHASE_REF);
+    int n = matrix.rows();
+    bool movesColumns = pivoting.strategy == PIVOT_ROOK || pivoting.strategy == PIVOT_COMPLETE;
+    PivotResult result;
+    if (log == NULL)
+    {
+        if (movesColumns)
+        {
+            return reduceToREFFull(matrix, pivoting);
+        }
+        if (pivoting.strategy == PIVOT_PARTIAL
+            && reduceSmall(matrix.data(), n, matrix.cols(), matrix.stride(), false, &result.rowSwaps))
+        {
+            return result;
+        }
+        return reduceToREFBlocked(matrix, pivoting);
+    }
+    
+    // the steps get shown, so here the rows and columns really do get swapped, one logged step at a time.
+    std::vector<const double*> row(n);
+    for (int i = 0; i < n; i++)
+    {
+        row[i] = matrix[i];
+        if (movesColumns)
+        {
+            result.columns.push_back(i);
+        }
+    }
+    for (int c = 0; c < n; c++)
+    {
+        int pivotRow;
+        int pivotCol;
+        choosePivot(row.data(), c, n, pivoting, pivotRow, pivotCol);
+        if (pivotRow != c)
+        {
+            matrix.swapRows(c, pivotRow);
+            log->swap(c, pivotRow);
+            result.rowSwaps++;
+        }
+        if (pivotCol != c)
+        {
+            matrix.swapColumns(c, pivotCol);
+            log->swapColumns(c, pivotCol);
+            std::swap(result.columns[c], result.columns[pivotCol]);
+            result.columnSwaps++;
+        }
+        if (matrix[c][c] == 0)
+        {
+            continue;
+        }
+        normalizePivot(matrix, c, log);
+        
+        // subtract multiples of other rows to the row we're manipulating to get elements to zero
+        for (int i = n-1; i > c; i--)
+        {
+            eliminate(matrix, i, c, log);
+        }
+    }
+    return result;
+}
+
+// now for the RREF form.
+// everything here works exactly the same as the REF stuff. However, instead of starting at the bottom left of
+// the matrix, working upwards then to the right, we now work from the top right, work downwards then to the left.
+// If the REF swapped columns (pivots says so), they get put back at the end.
+inline void reduceToRREF(Matrix& matrix, OperationLog* log, const PivotResult& pivots = PivotResult())
+{
+    GJ_PHASE(PHASE_RREF);
+    int n = matrix.rows();
+    
+    // the fast versions count on the square part being unit upper triangular, which a singular system's isn't, so
+    // that goes the row-by-row way whether there's a log or not. Then both give the same answer.
+    bool singular = false;
+    for (int i = 0; i < n && !singular; i++)
+    {
+        singular = matrix[i][i] == 0;
+    }
+    if (log == NULL && !singular)
+    {
+        if (!reduceSmall(matrix.data(), n, matrix.cols(), matrix.stride(), true))
+        {
+            reduceToRREFBlocked(matrix);
+        }
+        restoreColumns(matrix, pivots, NULL);
+        return;
+    }
+    for (int c = n-1; c > 0; c--)
+    {
+        normalizePivots(matrix, log);
+        
+        // a zero pivot can't clear anything out of its column, so it gets skipped, same as in the REF.
+        if (matrix[c][c] == 0)
+        {
+            continue;
+        }
+        for (int i = 0; i < c; i++)
+        {
+            eliminate(matrix, i, c, log);
+        }
+    }
+    restoreColumns(matrix, pivots, log);
+    
+    // make sure it's all ones, one more time. Anything that isn't (a zero pivot) just gets pointed out.
+    for (int i = 0; i < n && log != NULL; i++)
+    {
+        double divisor = matrix[i][i];
+        if (divisor !=  1) 
+        {
+            log->note(i, divisor);
+        }
+    }
+}
+
+// what reduceToREFGeneral found out about the system.
+struct RankInfo
+{
+    int rank;
+    double tolerance;                                       // anything this small or smaller counted as zero
+    std::vector<int> pivotCols;                             // row k's leading 1 is in column pivotCols[k]
+    std::vector<int> freeCols;                              // coefficient columns without a pivot (free variables)
+    int inconsistentRow;                                    // a row that says 0 = something that isn't 0, or -1
+};
+
+// the same tolerance MATLAB's rref uses: max(rows, cols) * eps * the biggest row sum.
+inline double defaultTolerance(const Matrix& matrix)
+{
+    double norm = 0;
+    for (int i = 0; i < matrix.rows(); i++)
+    {
+        double sum = 0;
+        for (int j = 0; j < matrix.cols(); j++)
+        {
+            sum += std::abs(matrix[i][j]);
+        }
+        norm = std::max(norm, sum);
+    }
+    return std::max(matrix.rows(), matrix.cols()) * DBL_EPSILON * norm;
+}
+
+// whether everything in rows [r, m) and columns [c0, c1) is at or below tolerance.
+inline bool blockIsNegligible(const Matrix& matrix, int r, int c0, int c1, double tolerance)
+{
+    for (int i = r; i < matrix.rows(); i++)
+    {
+        const double* rowI = matrix[i];
+        for (int j = c0; j < c1; j++)
+        {
+            if (std::abs(rowI[j]) > tolerance)
+            {
+                return false;
+            }
+        }
+    }
+    return true;
+}
+
+// REF of any m x n matrix. The first coefCols columns are the coefficients; the rest (if any) are right hand sides,
+// which ride along but never get pivoted on. Each column's pivot is the biggest entry left in it, swapped up into
+// place. A column with nothing bigger than tolerance left in it has no pivot (it's a free variable), and what's
+// left in it gets set to exactly 0.
+//
+// Elimination stops as soon as there's nothing left to do: once every row has a pivot, or once everything left in
+// the coefficient block is negligible. The rows without a pivot (the dependent ones) don't get touched after that.
+// If one of them still has something on the right hand side, there's no solution, and inconsistentRow says which.
+inline RankInfo reduceToREFGeneral(Matrix& matrix, int coefCols, double tolerance, OperationLog* log)
+{
+    GJ_PHASE(PHASE_REF);
+    int m = matrix.rows();
+    int cols = matrix.cols();
+    RankInfo info;
+    info.tolerance = tolerance;
+    info.inconsistentRow = -1;
+    int r = 0;                                              // the row the next pivot goes in
+    int c = 0;
+    for (; c < coefCols && r < m; c++)
+    {
+        int pivotRow = r;
+        double biggest = std::abs(matrix[r][c]);
+        for (int i = r + 1; i < m; i++)
+        {
+            if (std::abs(matrix[i][c]) > biggest)
+            {
+                biggest = std::abs(matrix[i][c]);
+                pivotRow = i;
+            }
+        }
+        if (biggest <= tolerance)
+        {
+            info.freeCols.push_back(c);
+            for (int i = r; i < m; i++)
+            {
+                matrix[i][c] = 0;
+            }
+            // if the rest of the block is negligible too, every column left is free and we're done.
+            if (blockIsNegligible(matrix, r, c + 1, coefCols, tolerance))
+            {
+                for (int i = r; i < m; i++)
+                {
+                    std::fill(matrix[i] + c + 1, matrix[i] + coefCols, 0.0);
+                }
+                c++;
+                break;
+            }
+            continue;
+        }
+        if (pivotRow != r)
+        {
+            matrix.swapRows(pivotRow, r);
+            if (log != NULL)
+            {
+                log->swap(pivotRow, r);
+            }
+        }
+        // everything in row r left of c is already exactly 0, so the row operations can start at c.
+        double* rowR = matrix[r];
+        double divisor = rowR[c];
+        rowScale(rowR + c, 1 / divisor, cols - c);
+        rowR[c] = 1;
+        if (log != NULL && divisor != 1)
+        {
+            log->scale(r, c, divisor);
+        }
+        for (int i = r + 1; i < m; i++)
+        {
+            double* rowI = matrix[i];
+            double multiplier = rowI[c];
+            if (multiplier != 0)
+            {
+                rowAxpy(rowI + c, rowR + c, multiplier, cols - c);
+                if (log != NULL)
+                {
+                    log->axpy(i, r, multiplier);
+                }
+            }
+        }
+        info.pivotCols.push_back(c);
+        r++;
+    }
+    for (; c < coefCols; c++)
+    {
+        info.freeCols.push_back(c);
+    }
+    info.rank = r;
+
+    // rows r and down are all zero on the coefficient side now.
+    for (int i = r; i < m && info.inconsistentRow < 0; i++)
+    {
+        for (int j = coefCols; j < cols; j++)
+        {
+            if (std::abs(matrix[i][j]) > tolerance)
+            {
+                info.inconsistentRow = i;
+                break;
+            }
+        }
+    }
+    return info;
+}
+
+// RREF from reduceToREFGeneral's REF: clear out each pivot column above its pivot. Only the rank rows with pivots
+// get worked on. A system with no solution is left in REF, since there's nothing to solve.
+inline void reduceToRREFGeneral(Matrix& matrix, const RankInfo& info, OperationLog* log)
+{
+    GJ_PHASE(PHASE_RREF);
+    if (info.inconsistentRow >= 0)
+    {
+        return;
+    }
+    int cols = matrix.cols();
+    for (int k = info.rank - 1; k > 0; k--)
+    {
+        int c = info.pivotCols[k];
+        const double* rowK = matrix[k];
+        for (int i = 0; i < k; i++)
+        {
+            double* rowI = matrix[i];
+            double multiplier = rowI[c];
+            if (multiplier != 0)
+            {
+                rowAxpy(rowI + c, rowK + c, multiplier, cols - c);
+                if (log != NULL)
+                {
+                    log->axpy(i, k, multiplier);
+                }
+            }
+        }
+    }
+}
+
+#endif
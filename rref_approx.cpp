@@ -38,421 +38,805 @@
 
 #include <iostream>
 #include <iomanip>
+#include <fstream>
+
+#include "matrix.h"
+#include "matrix_io.h"
+#include "rref.h"
+#include "lu.h"
+#include "mixed.h"
+#include "batched.h"
+#include "update.h"
+#include "sparse.h"
+#include "outofcore.h"
+#include "small.h"
+#include "metrics.h"
 
 using namespace std;
 
-int main() 
+// spit out the matrix, one row per line. this is the same methodology we'll always use to spit out the matrix.
+void printMatrix(const Matrix& matrix)
 {
-    int mode = 0;
-    cout << "\033[2J\033[1;1H";                             // clear the screen
-    cout << "\033[1;34m****************************************\033[0m\n";
-    cout << "\033[1;34m*                                      *\033[0m\n";
-    cout << "\033[1;34m*  Reduced Row Echelon Form Algorithm  *\033[0m\n";
-    cout << "\033[1;34m*        Evan Perry Grove   2017       *\033[0m\n";
-    cout << "\033[1;34m*                                      *\033[0m\n";
-    cout << "\033[1;34m****************************************\033[0m\n" << endl;
-    cout << "\033[1;37mPlease select an option from below." << endl;
-    cout << "0) Standard Mode: Output the REF and RREF matrices." << endl;
-    cout << "1) Verbose Mode: Show human-friendly steps taken to reach REF and RREF." << endl;
-    cout << "2) Extra Verbose Mode: Show the matrix after each step. (not recommended)" << endl;
-    cin >> mode;
-    
-    if(mode > 3 || mode < 0)
+    for (int idisp = 0; idisp < matrix.rows(); idisp++)
     {
-        cout << "Invalid mode specified. Default is Standard Mode (0)." << endl;
-        mode = 0;
+        for (int jdisp = 0; jdisp < matrix.cols(); jdisp++)
+        {
+            cout << setw(12) <<  matrix[idisp][jdisp];   // spit out elements of row i
+        }
+        cout << endl;                                    // go to next row and continue spitting out things
     }
-    
-    cout << "\033[1;37mHow many variables are we solving for? ";
-    int n;
-    cin >> n;                                               // initialize and set n
-    double matrix[n][n + 1];                                // create the augmented matrix with n rows and n+1 columns
-    
-    // make each element 0,  for now.
-    for (int i = 0; i < n; i++)
+}
+
+// batch mode: no prompts, no escape codes. Read every matrix in the input, and write out its REF and then its RREF
+// in the same order, either as text or in the binary format. Matrices can be n x (n+k), for k right hand sides. A
+// binary input file gets worked on right where it's mapped, without ever being copied.
+// With a logPath, every row operation goes into a log too, and the logs get written there as a JSON array (one
+// array of steps per matrix). That means doing it the row-by-row way, same as the verbose modes.
+// Pivots get picked the way pivoting says; with reportPivots, how many rows and columns that swapped goes to stderr.
+int runBatch(const string& path, bool binaryOut, const string& logPath, const Pivoting& pivoting, bool reportPivots)
+{
+    MatrixReader reader;
+    if (!reader.open(path))
     {
-        for (int j = 0; j <= n; j++)
+        cerr << "rref_approx: " << reader.error() << endl;
+        return 1;
+    }
+    MatrixWriter writer(stdout, binaryOut);
+    ofstream logFile;
+    OperationLog steps;
+    if (!logPath.empty())
+    {
+        logFile.open(logPath.c_str());
+        if (!logFile)
         {
-            matrix[i][j] = 0;                               // user inputs each element's value.
+            cerr << "rref_approx: could not open " << logPath << endl;
+            return 1;
         }
+        logFile << "[" << endl;
     }
-    
-    // prompt the user for each element. This can be simplified massively, at the expense of having a not-so-pretty interface.
-    for (int i = 0; i < n; i++)
+    Matrix matrix;
+    int count = 0;
+    long rowSwaps = 0;
+    long columnSwaps = 0;
+    while (reader.next(matrix))
     {
-        for (int j = 0; j <= n; j++)
+        count++;
+        if (matrix.cols() <= matrix.rows())
         {
-            // clear screen and print out updated matrix each time we prompt for a new element.
-            cout << "\033[2J\033[1;1H";
-            cout << "\033[1;37mExcellent! Now to establish the values of each element." <<  endl;
-            
-            // these for loops can be copy-pasted anywhere in the program and they'll spit out the matrix.
-            for (int idisp = 0; idisp < n; idisp++)
+            cerr << "rref_approx: matrix " << count << " is " << matrix.rows() << "x" << matrix.cols()
+                 << ", expected an n x (n+k) augmented matrix (--rank takes any shape)" << endl;
+            return 1;
+        }
+        steps.clear();
+        PivotResult pivots = reduceToREF(matrix, logFile.is_open() ? &steps : NULL, pivoting);
+        rowSwaps += pivots.rowSwaps;
+        columnSwaps += pivots.columnSwaps;
+        if (logFile.is_open())
+        {
+            writer.write(matrix);
+            reduceToRREF(matrix, &steps, pivots);
+            writer.write(matrix);
+            logFile << (count == 1 ? "" : ",\n");
+            writeJSON(steps, logFile);
+            continue;
+        }
+        // a pivot that didn't come out as 1 was a zero one, and then the RREF doesn't mean much.
+        for (int i = 0; i < matrix.rows(); i++)
+        {
+            if (matrix[i][i] != 1)
             {
-                for (int jdisp = 0; jdisp <= n; jdisp++)
-                {
-                    
-                    cout << setw(12) <<  matrix[idisp][jdisp];   //spit out elements of row i
-                }
-                cout << endl;                                    // go to next row and continue spitting out things
+                cerr << "rref_approx: matrix " << count << " is singular (no pivot in column " << i + 1
+                     << "), --rank handles that properly" << endl;
+                break;
             }
-        
-            cout << endl <<   "Row " << i+1 << "   Column " << j+1 << "    Value: ";
-            cin >> matrix[i][j];                                 // user inputs each element's value.
         }
+        writer.write(matrix);
+        reduceToRREF(matrix, NULL, pivots);
+        writer.write(matrix);
     }
-    
-    // show what the user entered
-    cout << "\033[2J\033[1;1H";
-    cout << "\033[1;37mHere's your matrix:" << endl;
-    // this is the same methodology we'll always use to spit out the matrix.
-    for (int i = 0; i < n; i++)
+    if (reader.failed())
     {
-        for (int j = 0; j <= n; j++)
+        writer.flush();
+        cerr << "rref_approx: matrix " << count + 1 << ": " << reader.error() << endl;
+        return 1;
+    }
+    if (logFile.is_open())
+    {
+        logFile << "]" << endl;
+    }
+    if (reportPivots)
+    {
+        writer.flush();
+        cerr << "pivoting: " << pivotStrategyName(pivoting.strategy) << ", " << rowSwaps << " row swaps and "
+             << columnSwaps << " column swaps over " << count << " matrices" << endl;
+    }
+    return 0;
+}
+
+// rank mode: any m x n matrix, where the last rhsCols columns are right hand sides (0 for a plain matrix). Writes the
+// REF and the RREF like batch mode does, and reports the rank, the pivot columns and the free variables of each one
+// on stderr. A system with no solution gets a matrix full of NaN in place of its RREF.
+int runRank(const string& path, bool binaryOut, const string& logPath, int rhsCols, double tolerance)
+{
+    MatrixReader reader;
+    if (!reader.open(path))
+    {
+        cerr << "rref_approx: " << reader.error() << endl;
+        return 1;
+    }
+    MatrixWriter writer(stdout, binaryOut);
+    ofstream logFile;
+    OperationLog steps;
+    if (!logPath.empty())
+    {
+        logFile.open(logPath.c_str());
+        if (!logFile)
         {
-            cout << setw(12) <<  matrix[i][j];          // spit out elements of row i
+            cerr << "rref_approx: could not open " << logPath << endl;
+            return 1;
         }
-        cout << endl;                                   // go to next row and continue spitting out things
+        logFile << "[" << endl;
     }
-    
-    // verify that the entered matrix is what the user wanted.
-    char correct = 'n';
-    double fix = 0;
-    int fixrow = 1;
-    int fixcol = 1;
-    cout << endl << "\033[1;31mIs this correct? (y/n) \033[1;37m";
-    cin >> correct;
-    while (correct == 'n')
+    OperationLog* log = logFile.is_open() ? &steps : NULL;
+    Matrix matrix;
+    int count = 0;
+    while (reader.next(matrix))
     {
-        
-        cout << endl << "\033[1;31mEnter a correction: \n"; 
-        cout << "\033[1;37mrow:"; cin >> fixrow; cout << endl;
-        cout << "\033[1;37mcol:"; cin >> fixcol; cout << endl;
-        cout << "\033[1;37mfix:"; cin >> fix; cout << endl;
-        matrix[fixrow - 1][fixcol - 1] = fix;
-        cout << endl << "\033[1;31mIs this correct? (y/n) \033[1;37m";
-        cin >> correct;
+        count++;
+        if (rhsCols > matrix.cols())
+        {
+            writer.flush();
+            cerr << "rref_approx: matrix " << count << " has " << matrix.cols() << " columns, fewer than the " << rhsCols
+                 << " right hand sides" << endl;
+            return 1;
+        }
+        steps.clear();
+        int coefCols = matrix.cols() - rhsCols;
+        RankInfo info = reduceToREFGeneral(matrix, coefCols, tolerance < 0 ? defaultTolerance(matrix) : tolerance, log);
+        writer.write(matrix);
+        reduceToRREFGeneral(matrix, info, log);
+        if (info.inconsistentRow >= 0)
+        {
+            for (int i = 0; i < matrix.rows(); i++)
+            {
+                fill(matrix[i], matrix[i] + matrix.cols(), NAN);
+            }
+        }
+        writer.write(matrix);
+        if (logFile.is_open())
+        {
+            logFile << (count == 1 ? "" : ",\n");
+            writeJSON(steps, logFile);
+        }
+
+        writer.flush();                                     // so the report lines up with the output
+        cerr << "matrix " << count << ": rank " << info.rank << ", pivot columns";
+        for (size_t k = 0; k < info.pivotCols.size(); k++)
+        {
+            cerr << " " << info.pivotCols[k] + 1;
+        }
+        cerr << ", free variables";
+        for (size_t k = 0; k < info.freeCols.size(); k++)
+        {
+            cerr << " " << info.freeCols[k] + 1;
+        }
+        if (info.freeCols.empty())
+        {
+            cerr << " none";
+        }
+        if (info.inconsistentRow >= 0)
+        {
+            cerr << ", no solution (row " << info.inconsistentRow + 1 << " of the REF is 0 = nonzero)";
+        }
+        cerr << endl;
     }
+    if (reader.failed())
+    {
+        writer.flush();
+        cerr << "rref_approx: matrix " << count + 1 << ": " << reader.error() << endl;
+        return 1;
+    }
+    if (logFile.is_open())
+    {
+        logFile << "]" << endl;
+    }
+    return 0;
+}
+
+// solve mode: factor each coefficient matrix once and reuse the factors for every right hand side. The input is
+// either n x (n+k) augmented matrices, or (with a separate right hand side stream) n x n coefficient matrices, where
+// the i'th n x k block of the stream gets solved against the i'th coefficient matrix, or the last one if the stream
+// is longer. Each solution X (n x k) gets written out in order. With inverse, each n x n input gets its inverse
+// written out instead. Factors are cached by the hash of A, so sending the same A again skips the factoring. With
+// mixed, A gets factored in float and the solutions refined back up to double (see mixed.h). Runs of same-size small
+// augmented systems skip the cache and get solved together by batchSolve instead.
+int runSolve(const string& path, const string& rhsPath, bool inverse, bool binaryOut, bool mixed)
+{
+    MatrixReader reader;
+    MatrixReader rhsReader;
+    if (!reader.open(path) || (!rhsPath.empty() && !rhsReader.open(rhsPath)))
+    {
+        cerr << "rref_approx: " << (reader.failed() ? reader.error() : rhsReader.error()) << endl;
+        return 1;
+    }
+    MatrixWriter writer(stdout, binaryOut);
+    FactorizationCache cache;
+    MixedLU mixedLU;
+    const LUFactors* factors = NULL;
+    Matrix matrix;
+    Matrix rhs;
+    SmallBatch pending;
+    int pendingFirst = 0;                                   // the number of the first matrix in pending
+    int count = 0;
     
-    //here we ensure that each element we want to use as a pivot contains a nonzero value. Switch rows in order to get
-    //nonzeros into the columns we need.
-    bool pivotsClean = true;
-    int dirtyPivots = 0;
-    int dirtyPivotsOld = 0;
-    while (pivotsClean)
+    // solve whatever small systems have been collected so far, and write them out before anything that comes after.
+    auto flushPending = [&]()
     {
-        for (int pivotCheck = 0; pivotCheck < n - 1; pivotCheck++)
+        if (pending.size() == 0)
         {
-            if(matrix[pivotCheck][pivotCheck] == 0)
+            return;
+        }
+        SmallBatch x = batchSolve(pending);
+        for (int m = 0; m < x.size(); m++)
+        {
+            if (std::isnan(x.elements()[0][m]))
             {
-                dirtyPivots++;
-                double dirtyRow[n+1];
-                for (int i = 0; i <= n; i++)
-                {
-                    dirtyRow[i] = matrix[pivotCheck][i];
-                    
-                    if (pivotCheck == n)
-                    {
-                        matrix[pivotCheck][i] = matrix[0][i];
-                    }
-                    else
-                    {
-                        matrix[pivotCheck][i] = matrix[pivotCheck + 1][i];
-                    }
-                }
-                for (int i = 0; i <= n; i++)
-                {
-                    if (pivotCheck == n)
-                    {
-                        matrix[0][i] = dirtyRow[i];
-                    }
-                    else
-                    {
-                        matrix[pivotCheck + 1][i] = dirtyRow[i];
-                    }
-                }
-                switch(mode)
-                {
-                    case 0:
-                        break;
-                    case 1:
-                        if (pivotCheck == n)
-                        {
-                            cout << "R" << pivotCheck + 1 << "<- R0" << endl << "R0<- R" << pivotCheck + 1<< endl;
-                        }
-                        else
-                        {
-                            cout << "R" << pivotCheck + 1 << "<- R" << pivotCheck + 2 << endl << "R" << pivotCheck + 2 << "<- R" << pivotCheck + 1<< endl;
-                        }
-                        break;
-                    case 2:
-                        if (pivotCheck == n)
-                        {
-                            cout << "R" << pivotCheck + 1 << "<- R0" << endl << "R0<- R" << pivotCheck + 1<< endl;
-                            for (int idisp = 0; idisp < n; idisp++)
-                            {
-                                for (int jdisp = 0; jdisp <= n; jdisp++)
-                                {
-                                    
-                                    cout << setw(12) <<  matrix[idisp][jdisp];   // spit out elements of row i
-                                }
-                                cout << endl;                                    // go to next row and continue spitting out things
-                            }
-                        }
-                        else
-                        {
-                            cout << "R" << pivotCheck + 1 << "<- R" << pivotCheck + 2 << endl << "R" << pivotCheck + 2 << "<- R" << pivotCheck + 1<< endl;
-                            for (int idisp = 0; idisp < n; idisp++)
-                            {
-                                for (int jdisp = 0; jdisp <= n; jdisp++)
-                                {
-                                    
-                                    cout << setw(12) <<  matrix[idisp][jdisp];   // spit out elements of row i
-                                }
-                                cout << endl;                                    // go to next row and continue spitting out things
-                            }
-                        }
-                        break;
-                }
+                cerr << "rref_approx: matrix " << pendingFirst + m << " is singular" << endl;
             }
+            writer.write(x.get(m));
         }
-        
-        if (dirtyPivots == dirtyPivotsOld)
+        pending.clear();
+    };
+    
+    auto useCoefficients = [&](const Matrix& a)
+    {
+        if (mixed)
         {
-            pivotsClean = false;
+            mixedLU.factor(a);
         }
         else
         {
-            dirtyPivotsOld = dirtyPivots;
+            factors = &cache.factor(a);
         }
-    }
+    };
     
-    // get the REF form of the matrix. c is used to represent the column of the element we are making zero
-    for (int c = 0; c < n-1; c++)
-    {
-        //we're going to use elements M(1,1) M(2,2) etc as pivots. Make them all equal to 1 before moving things around
-        for (int i = 0; i < n; i++)
-        {
-            //this algorithm works off of the assumption that M(c,c), M(i,i), or whatever else you want to call it,
-            //is always equal to 1 when performing the row operations. Although it increases the number of calculations
-            //we must perform, it means the row operation function can be brutally simple.
-            double divisor = matrix[i][i];
-            if (divisor != 0) {
-                for (int j = 0; j <= n; j++)
-                {
-                    //in MATLAB terms: M(i,:) = M(i,:) / M(i,i)
-                    //in English: divide every row i by its element in column i.
-                    matrix[i][j] = matrix[i][j] / divisor;
-                }
-                if (divisor !=  1) 
-                {
-                    switch (mode)
-                    {
-                        case 0:
-                            break;
-                        case 1:
-                            cout << "R" << i+1 << "<- R" << i+1 << " / " << divisor << endl;
-                            break;
-                        case 2:
-                            cout << "R" << i+1 << "<- R" << i+1 << " / " << divisor << endl;
-                            for (int idisp = 0; idisp < n; idisp++)
-                                {
-                                    for (int jdisp = 0; jdisp <= n; jdisp++)
-                                    {
-                                        cout << setw(12) <<  matrix[idisp][jdisp];   // spit out elements of row i
-                                    }
-                                    cout << endl;                                    // go to next row and continue spitting out things
-                                }
-                            break;
-                    }
-                }
+    // write out X, or a matrix full of NaN if A turned out to be singular so the output still lines up.
+    auto writeSolution = [&](const Matrix& b)
+    {
+        Matrix x = mixed ? mixedLU.solve(b) : solveLU(*factors, b);
+        if (mixed ? mixedLU.singular() : factors->singular)
+        {
+            cerr << "rref_approx: matrix " << count << " is singular" << endl;
+            for (int i = 0; i < x.rows(); i++)
+            {
+                fill(x[i], x[i] + x.cols(), NAN);
             }
         }
-        
-        // subtract multiples of other rows to the row we're manipulating to get elements to zero
-        for (int i = n-1; i > c; i--)
+        writer.write(x);
+    };
+    
+    bool haveCoefficients = false;
+    while (reader.next(matrix))
+    {
+        count++;
+        int n = matrix.rows();
+        bool augmented = rhsPath.empty() && !inverse;
+        if ((augmented && matrix.cols() <= n) || (!augmented && matrix.cols() != n))
+        {
+            flushPending();
+            writer.flush();
+            cerr << "rref_approx: matrix " << count << " is " << n << "x" << matrix.cols() << ", expected "
+                 << (augmented ? "an n x (n+k) augmented matrix" : "a square matrix") << endl;
+            return 1;
+        }
+        if (augmented && !mixed && n >= 2 && n <= SMALL_MAX_ORDER)
         {
-            //here's how this works: we know from the for() loop above that any element M(c,c) is going to be 1. So,
-            //we can say that by doing row operation M(i,:) = M(i,:)-M(c,:)*M(i,c), we will always get M(i,c)=0.
-            double multiplier = matrix[i][c];
-            for (int j = 0; j <= n; j++)
+            if (pending.rows() != n || pending.cols() != matrix.cols())
+            {
+                flushPending();
+                pending = SmallBatch(n, matrix.cols(), BATCH_STREAM_COUNT);
+            }
+            if (pending.size() == 0)
             {
-                matrix[i][j] = matrix[i][j] - (matrix[c][j] * multiplier);
+                pendingFirst = count;
             }
-            switch (mode)
+            pending.push(matrix);
+            if (pending.full())
             {
-                case 0:
-                    break;
-                case 1:
-                    cout << "R" << i+1 << "<- R" << i+1 << " - (R" << c+1 << " * " << multiplier << ")" << endl;
-                    break;
-                case 2:
-                    cout << "R" << i+1 << "<- R" << i+1 << " - (R" << c+1 << " * " << multiplier << ")" << endl;
-                    for (int idisp = 0; idisp < n; idisp++)
-                    {
-                        for (int jdisp = 0; jdisp <= n; jdisp++)
-                        {
-                            cout << setw(12) <<  matrix[idisp][jdisp];   // spit out elements of row i
-                        }
-                        cout << endl;                                    // go to next row and continue spitting out things
-                    }
-                    break;
+                flushPending();
             }
+            continue;
+        }
+        flushPending();
+        useCoefficients(matrix);
+        haveCoefficients = true;
+        if (inverse)
+        {
+            writeSolution(identityMatrix(n));
+        }
+        else if (augmented)
+        {
+            // pull the right hand sides out of the augmented columns.
+            Matrix b(n, matrix.cols() - n);
+            for (int i = 0; i < n; i++)
+            {
+                memcpy(b[i], matrix[i] + n, b.cols() * sizeof(double));
+            }
+            writeSolution(b);
+        }
+        else if (rhsReader.next(rhs))
+        {
+            if (rhs.rows() != n)
+            {
+                cerr << "rref_approx: right hand side " << count << " has " << rhs.rows() << " rows, expected " << n << endl;
+                return 1;
+            }
+            writeSolution(rhs);
         }
-            
+    }
+    flushPending();
+    if (reader.failed())
+    {
+        writer.flush();
+        cerr << "rref_approx: matrix " << count + 1 << ": " << reader.error() << endl;
+        return 1;
     }
     
-    //make sure the eventual pivots are 1 again. Works the same as earlier.
+    // whatever's left in the right hand side stream goes against the last coefficient matrix, whose factors are still
+    // the current ones (with a right hand side stream nothing goes through the small batches).
+    if (!rhsPath.empty() && !inverse && haveCoefficients)
+    {
+        while (rhsReader.next(rhs))
+        {
+            if (rhs.rows() != matrix.rows())
+            {
+                writer.flush();
+                cerr << "rref_approx: a right hand side has " << rhs.rows() << " rows, expected " << matrix.rows() << endl;
+                return 1;
+            }
+            writeSolution(rhs);
+        }
+    }
+    if (rhsReader.failed())
+    {
+        writer.flush();
+        cerr << "rref_approx: right hand side stream: " << rhsReader.error() << endl;
+        return 1;
+    }
+    if (mixed)
+    {
+        writer.flush();
+        cerr << "mixed precision: " << mixedLU.solveCount() << " solves, " << mixedLU.refinementCount()
+             << " refinement steps, " << mixedLU.fallbackCount() << " fell back to double" << endl;
+    }
+    return 0;
+}
+
+// edit mode: solve the first n x (n+k) augmented matrix in the input, then apply each block of edits from editsPath
+// to it and solve again, writing X out every time. An edit is a row of a k x 3 matrix: row, column and the new value
+// (a column past n changes the right hand side). Edits to A update the factors instead of starting over.
+int runEdits(const string& path, const string& editsPath, bool binaryOut)
+{
+    MatrixReader reader;
+    MatrixReader editReader;
+    Matrix matrix;
+    if (!reader.open(path) || !editReader.open(editsPath))
+    {
+        cerr << "rref_approx: " << (reader.failed() ? reader.error() : editReader.error()) << endl;
+        return 1;
+    }
+    if (!reader.next(matrix))
+    {
+        cerr << "rref_approx: " << (reader.failed() ? reader.error() : "no matrix to edit") << endl;
+        return 1;
+    }
+    int n = matrix.rows();
+    if (matrix.cols() <= n)
+    {
+        cerr << "rref_approx: matrix is " << n << "x" << matrix.cols() << ", expected an n x (n+k) augmented matrix" << endl;
+        return 1;
+    }
+    MatrixWriter writer(stdout, binaryOut);
+    UpdatedLU lu;
+    lu.factor(matrix);
+    Matrix b(n, matrix.cols() - n);
     for (int i = 0; i < n; i++)
     {
-        double divisor = matrix[i][i];
-        if (divisor != 0) {
-            for (int j = 0; j <= n; j++)
+        memcpy(b[i], matrix[i] + n, b.cols() * sizeof(double));
+    }
+
+    // write out X, or a matrix full of NaN if A is singular right now.
+    auto writeSolution = [&]()
+    {
+        Matrix x = lu.solveChecked(b);
+        if (lu.singular())
+        {
+            for (int i = 0; i < n; i++)
+            {
+                fill(x[i], x[i] + x.cols(), NAN);
+            }
+        }
+        writer.write(x);
+    };
+
+    writeSolution();
+    Matrix edits;
+    int blocks = 0;
+    while (editReader.next(edits))
+    {
+        blocks++;
+        string err;
+        if (!checkEdits(edits, n, matrix.cols(), err))
+        {
+            writer.flush();
+            cerr << "rref_approx: edit block " << blocks << ": " << err << endl;
+            return 1;
+        }
+        for (int e = 0; e < edits.rows(); e++)
+        {
+            int i = (int)edits[e][0] - 1;
+            int j = (int)edits[e][1] - 1;
+            if (j < n)
             {
-                matrix[i][j] = matrix[i][j] / divisor;
+                lu.set(i, j, edits[e][2]);
             }
-            if (divisor !=  1) 
+            else
             {
-                switch (mode)
-                {
-                    case 0:
-                        break;
-                    case 1:
-                        cout << "R" << i+1 << "<- R" << i+1 << " / " << divisor << endl;
-                        break;
-                    case 2:
-                        cout << "R" << i+1 << "<- R" << i+1 << " / " << divisor << endl;
-                        for (int idisp = 0; idisp < n; idisp++)
-                            {
-                                for (int jdisp = 0; jdisp <= n; jdisp++)
-                                {
-                                    cout << setw(12) <<  matrix[idisp][jdisp];   // spit out elements of row i
-                                }
-                                cout << endl;                                    // go to next row and continue spitting out things
-                            }
-                        break;
-                }
+                b[i][j - n] = edits[e][2];
             }
         }
+        writeSolution();
     }
-    
-    // display the REF form
-    cout << "REF Form:" << endl;
-    for (int idisp = 0; idisp < n; idisp++)
+    writer.flush();
+    if (editReader.failed())
     {
-        for (int jdisp = 0; jdisp <= n; jdisp++)
+        cerr << "rref_approx: edit block " << blocks + 1 << ": " << editReader.error() << endl;
+        return 1;
+    }
+    cerr << "edits: " << lu.editCount() << "  refactorizations: " << lu.refactorCount() << endl;
+    return 0;
+}
+
+// sparse mode: read one n x (n+1) augmented matrix in Matrix Market format, solve it without ever storing the zeros,
+// and write out the solution x (as an n x 1 matrix). How much fill-in the elimination caused goes to stderr.
+int runSparse(const string& path, bool reorder, bool binaryOut)
+{
+    SparseMatrix a;
+    string err;
+    if (!readMatrixMarket(path, a, err))
+    {
+        cerr << "rref_approx: " << err << endl;
+        return 1;
+    }
+    if (a.cols != a.rows + 1)
+    {
+        cerr << "rref_approx: sparse matrix is " << a.rows << "x" << a.cols << ", expected an n x (n+1) augmented matrix"
+             << endl;
+        return 1;
+    }
+    vector<int> order(a.rows);
+    if (reorder)
+    {
+        order = minimumDegreeOrder(a);
+    }
+    else
+    {
+        for (int k = 0; k < a.rows; k++)
         {
-            cout << setw(12) <<  matrix[idisp][jdisp];   // spit out elements of row i
+            order[k] = k;
         }
-        cout << endl;                                    // go to next row and continue spitting out things
     }
-    cout << endl << endl;   // throw some more lines in there
-    
-    // now for the RREF form.
-    // everything here works exactly the same as the REF stuff. However, instead of starting at the bottom left of
-    // the matrix, working upwards then to the right, we now work from the top right, work downwards then to the left.
-    for (int c = n-1; c > 0; c--)
-    {
-        for (int i = 0; i < n; i++)
-        {
-            double divisor = matrix[i][i];
-            if (divisor != 0) {
-                for (int j = 0; j <= n; j++)
-                {
-                    matrix[i][j] = matrix[i][j] / divisor;
-                }
-                if (divisor !=  1) {
-                    switch (mode)
-                    {
-                        case 0:
-                            break;
-                        case 1:
-                            cout << "R" << i+1 << "<- R" << i+1 << " / " << divisor << endl;
-                            break;
-                        case 2:
-                            cout << "R" << i+1 << "<- R" << i+1 << " / " << divisor << endl;
-                            for (int idisp = 0; idisp < n; idisp++)
-                            {
-                                for (int jdisp = 0; jdisp <= n; jdisp++)
-                                {
-                                    cout << setw(12) <<  matrix[idisp][jdisp];   // spit out elements of row i
-                                }
-                                cout << endl;                                    // go to next row and continue spitting out things
-                            }
-                            break;
-                    }
-                }
+    vector<double> x;
+    SparseStats stats;
+    if (!solveSparse(a, order, x, stats, err))
+    {
+        cerr << "rref_approx: " << err << endl;
+        return 1;
+    }
+    cerr << "n: " << a.rows << "  nnz(A): " << stats.nonzerosA << "  nnz(L+U): " << stats.nonzerosLU
+         << "  fill-in: " << stats.fillIn << endl;
+
+    MatrixWriter writer(stdout, binaryOut);
+    Matrix result(a.rows, 1);
+    for (int i = 0; i < a.rows; i++)
+    {
+        result[i][0] = x[i];
+    }
+    writer.write(result);
+    return 0;
+}
+
+// out of core mode: solve the n x (n+k) system in a binary matrix file too big to hold in memory, keeping no more
+// than about budgetMB of it in memory at a time, and write out X. How that went goes to stderr.
+int runOutOfCore(const string& path, const string& scratchDir, long budgetMB, bool binaryOut)
+{
+    Matrix x;
+    OutOfCoreStats stats;
+    string err;
+    if (!solveOutOfCore(path, scratchDir, budgetMB << 20, x, stats, err))
+    {
+        cerr << "rref_approx: " << err << endl;
+        return 1;
+    }
+    if (stats.singular)
+    {
+        cerr << "rref_approx: matrix is singular" << endl;
+    }
+    double mb = 1 << 20;
+    cerr << fixed << setprecision(1) << "n: " << stats.n << "  panels: " << stats.panels << " of " << stats.panelWidth
+         << " columns  budget: " << stats.budgetBytes / mb << " MB  peak buffers: " << stats.peakBufferBytes / mb
+         << " MB  peak RSS: " << stats.peakResidentBytes / mb << " MB" << endl
+         << "read: " << stats.bytesRead / mb << " MB  written: " << stats.bytesWritten / mb << " MB  row swaps: "
+         << stats.swaps << "  waited on disk: " << setprecision(3) << stats.ioWaitSeconds << " s" << endl;
+    cerr.unsetf(ios::floatfield);
+
+    GJ_PHASE(PHASE_OUTPUT);
+    MatrixWriter writer(stdout, binaryOut);
+    writer.write(x);
+    return 0;
+}
+
+int main(int argc, char* argv[]) 
+{
+    bool batch = false;
+    bool binaryOut = false;
+    bool solve = false;
+    bool inverse = false;
+    bool mixed = false;
+    bool sparse = false;
+    bool reorder = true;
+    bool rank = false;
+    int rhsCols = 1;
+    long memoryMB = 256;
+    Pivoting pivoting;
+    bool reportPivots = false;
+    double tolerance = -1;
+    string batchPath;
+    string rhsPath;
+    string logPath;
+    string editsPath;
+    string outOfCorePath;
+    string scratchDir = getenv("TMPDIR") ? getenv("TMPDIR") : "";
+    MetricsReport metrics;
+    for (int arg = 1; arg < argc; arg++)
+    {
+        string flag = argv[arg];
+        if (flag == "--batch" || flag == "-b")
+        {
+            batch = true;
+            if (arg + 1 < argc && argv[arg + 1][0] != '-')
+            {
+                batchPath = argv[++arg];
             }
         }
-        
-        for (int i = 0; i < c; i++)
+        else if (flag == "--binary")
+        {
+            binaryOut = true;
+        }
+        else if ((flag == "--threads" || flag == "-t") && arg + 1 < argc)
+        {
+            sharedPoolThreads() = atoi(argv[++arg]);
+        }
+        else if (flag == "--solve")
+        {
+            solve = true;
+        }
+        else if (flag == "--rhs" && arg + 1 < argc)
+        {
+            solve = true;
+            rhsPath = argv[++arg];
+        }
+        else if (flag == "--inverse")
         {
-            double multiplier = matrix[i][c];
-            for (int j = 0; j <= n; j++)
+            inverse = true;
+        }
+        else if (flag == "--mixed")
+        {
+            solve = true;
+            mixed = true;
+        }
+        else if (flag == "--sparse")
+        {
+            sparse = true;
+            if (arg + 1 < argc && argv[arg + 1][0] != '-')
             {
-                matrix[i][j] = matrix[i][j] - (matrix[c][j] * multiplier);
+                batchPath = argv[++arg];
             }
-            switch (mode)
+        }
+        else if (flag == "--out-of-core" && arg + 1 < argc)
+        {
+            outOfCorePath = argv[++arg];
+        }
+        else if (flag == "--memory" && arg + 1 < argc)
+        {
+            memoryMB = max(1L, atol(argv[++arg]));
+        }
+        else if (flag == "--scratch" && arg + 1 < argc)
+        {
+            scratchDir = argv[++arg];
+        }
+        else if (flag == "--pivot" && arg + 1 < argc && parsePivotStrategy(argv[arg + 1], pivoting.strategy))
+        {
+            arg++;
+            reportPivots = true;
+        }
+        else if (flag == "--pivot-threshold" && arg + 1 < argc)
+        {
+            pivoting.strategy = PIVOT_THRESHOLD;
+            pivoting.threshold = min(1.0, max(0.0, atof(argv[++arg])));
+            reportPivots = true;
+        }
+        else if (flag == "--log" && arg + 1 < argc)
+        {
+            logPath = argv[++arg];
+        }
+        else if (flag == "--ordering" && arg + 1 < argc)
+        {
+            reorder = string(argv[++arg]) != "natural";
+        }
+        else if (flag == "--edits" && arg + 1 < argc)
+        {
+            editsPath = argv[++arg];
+        }
+        else if (flag == "--rank")
+        {
+            rank = true;
+        }
+        else if (flag == "--rhs-cols" && arg + 1 < argc)
+        {
+            rank = true;
+            rhsCols = max(0, atoi(argv[++arg]));
+        }
+        else if (flag == "--tolerance" && arg + 1 < argc)
+        {
+            rank = true;
+            tolerance = atof(argv[++arg]);
+        }
+        else if (flag == "--metrics")
+        {
+            string metricsPath;
+            if (arg + 1 < argc && argv[arg + 1][0] != '-')
             {
-                case 0:
-                    break;
-                case 1:
-                    cout << "R" << i+1 << "<- R" << i+1 << " - (R" << c+1 << " * " << multiplier << ")" << endl;
-                    break;
-                case 2:
-                    cout << "R" << i+1 << "<- R" << i+1 << " - (R" << c+1 << " * " << multiplier << ")" << endl;
-                    for (int idisp = 0; idisp < n; idisp++)
-                    {
-                        for (int jdisp = 0; jdisp <= n; jdisp++)
-                        {
-                            cout << setw(12) <<  matrix[idisp][jdisp];   // spit out elements of row i
-                        }
-                        cout << endl;                                    // go to next row and continue spitting out things
-                    }
-                    break;
+                metricsPath = argv[++arg];
             }
+            metrics.request(metricsPath);
+        }
+        else
+        {
+            cerr << "usage: " << argv[0] << " [--batch [file] [--log steps.json]] [--solve] [--rhs file] [--inverse]"
+                 << " [--mixed] [--binary] [--threads n] [--metrics [file]]" << endl << "       " << argv[0]
+                 << " [--batch [file]] [--pivot partial|threshold|rook|complete] [--pivot-threshold t]" << endl
+                 << "       " << argv[0]
+                 << " --batch [file] --rank [--rhs-cols k] [--tolerance t] [--log steps.json] [--binary]" << endl
+                 << "       " << argv[0] << " [--batch [file]] --edits file [--binary]" << endl
+                 << "       " << argv[0]
+                 << " --sparse [file] [--ordering mindegree|natural] [--binary] [--metrics [file]]" << endl
+                 << "       " << argv[0]
+                 << " --out-of-core file [--memory MB] [--scratch dir] [--binary] [--threads n] [--metrics [file]]"
+                 << endl;
+            return 1;
         }
-            
+    }
+    if (!outOfCorePath.empty())
+    {
+        return runOutOfCore(outOfCorePath, scratchDir, memoryMB, binaryOut);
+    }
+    if (sparse)
+    {
+        return runSparse(batchPath, reorder, binaryOut);
+    }
+    if (solve || inverse)
+    {
+        return runSolve(batchPath, rhsPath, inverse, binaryOut, mixed);
+    }
+    if (!editsPath.empty())
+    {
+        return runEdits(batchPath, editsPath, binaryOut);
+    }
+    if (rank)
+    {
+        return runRank(batchPath, binaryOut, logPath, rhsCols, tolerance);
+    }
+    if (batch)
+    {
+        return runBatch(batchPath, binaryOut, logPath, pivoting, reportPivots);
     }
     
-    // make sure it's all ones, one more time
+    int mode = 0;
+    cout << "\033[2J\033[1;1H";                             // clear the screen
+    cout << "\033[1;34m****************************************\033[0m\n";
+    cout << "\033[1;34m*                                      *\033[0m\n";
+    cout << "\033[1;34m*  Reduced Row Echelon Form Algorithm  *\033[0m\n";
+    cout << "\033[1;34m*        Evan Perry Grove   2017       *\033[0m\n";
+    cout << "\033[1;34m*                                      *\033[0m\n";
+    cout << "\033[1;34m****************************************\033[0m\n" << endl;
+    cout << "\033[1;37mPlease select an option from below." << endl;
+    cout << "0) Standard Mode: Output the REF and RREF matrices." << endl;
+    cout << "1) Verbose Mode: Show human-friendly steps taken to reach REF and RREF." << endl;
+    cout << "2) Extra Verbose Mode: Show the matrix after each step. (not recommended)" << endl;
+    cin >> mode;
+    
+    if(mode > 3 || mode < 0)
+    {
+        cout << "Invalid mode specified. Default is Standard Mode (0)." << endl;
+        mode = 0;
+    }
+    
+    cout << "\033[1;37mHow many variables are we solving for? ";
+    int n;
+    cin >> n;                                               // initialize and set n
+    Matrix matrix(n, n + 1);                                // create the augmented matrix with n rows and n+1 columns. starts out all 0
+    
+    // prompt the user for each element. This can be simplified massively, at the expense of having a not-so-pretty interface.
     for (int i = 0; i < n; i++)
     {
-        double divisor = matrix[i][i];
-        if (divisor !=  1) 
+        for (int j = 0; j <= n; j++)
         {
-            switch (mode)
-            {
-                case 0:
-                    break;
-                case 1:
-                    cout << "R" << i+1 << "<- R" << i+1 << " / " << divisor << endl;
-                    break;
-                case 2:
-                    cout << "R" << i+1 << "<- R" << i+1 << " / " << divisor << endl;
-                    for (int idisp = 0; idisp < n; idisp++)
-                    {
-                        for (int jdisp = 0; jdisp <= n; jdisp++)
-                        {
-                            cout << setw(12) <<  matrix[idisp][jdisp];   // spit out elements of row i
-                        }
-                        cout << endl;                                    // go to next row and continue spitting out things
-                    }
-                    break;
-            }
+            // clear screen and print out updated matrix each time we prompt for a new element.
+            cout << "\033[2J\033[1;1H";
+            cout << "\033[1;37mExcellent! Now to establish the values of each element." <<  endl;
+            printMatrix(matrix);
+        
+            cout << endl <<   "Row " << i+1 << "   Column " << j+1 << "    Value: ";
+            cin >> matrix[i][j];                                 // user inputs each element's value.
         }
     }
     
-    // display the RREF form
-    cout << "RREF Form:" << endl;
-    for (int idisp = 0; idisp < n; idisp++)
+    // show what the user entered
+    cout << "\033[2J\033[1;1H";
+    cout << "\033[1;37mHere's your matrix:" << endl;
+    printMatrix(matrix);
+    
+    // verify that the entered matrix is what the user wanted.
+    char correct = 'n';
+    double fix = 0;
+    int fixrow = 1;
+    int fixcol = 1;
+    cout << endl << "\033[1;31mIs this correct? (y/n) \033[1;37m";
+    cin >> correct;
+    while (correct == 'n')
     {
-        for (int jdisp = 0; jdisp <= n; jdisp++)
-        {
-            
-            cout << setw(12) <<  matrix[idisp][jdisp];   // spit out elements of row i
-        }
-        cout << endl;                                    // go to next row and continue spitting out things
+        
+        cout << endl << "\033[1;31mEnter a correction: \n"; 
+        cout << "\033[1;37mrow:"; cin >> fixrow; cout << endl;
+        cout << "\033[1;37mcol:"; cin >> fixcol; cout << endl;
+        cout << "\033[1;37mfix:"; cin >> fix; cout << endl;
+        matrix[fixrow - 1][fixcol - 1] = fix;
+        cout << endl << "\033[1;31mIs this correct? (y/n) \033[1;37m";
+        cin >> correct;
+    }
+    
+    // the verbose modes log every step while the elimination runs, then print them all out afterwards. Extra verbose
+    // mode replays the steps on a copy of the original to show the matrix after each one.
+    OperationLog steps;
+    OperationLog* log = mode == 0 ? NULL : &steps;
+    Matrix replay;
+    if (mode == 2)
+    {
+        replay = matrix;
+    }
+    Matrix* snapshots = mode == 2 ? &replay : NULL;
+    
+    PivotResult pivots = reduceToREF(matrix, log, pivoting);
+    size_t refSteps = steps.size();
+    {
+        GJ_PHASE(PHASE_OUTPUT);
+        renderSteps(steps, 0, refSteps, cout, snapshots, printMatrix);
+        
+        // display the REF form
+        cout << "REF Form:" << endl;
+        printMatrix(matrix);
+        cout << endl << endl;   // throw some more lines in there
+    }
+    
+    reduceToRREF(matrix, log, pivots);
+    {
+        GJ_PHASE(PHASE_OUTPUT);
+        renderSteps(steps, refSteps, steps.size(), cout, snapshots, printMatrix);
+        
+        // display the RREF form
+        cout << "RREF Form:" << endl;
+        printMatrix(matrix);
     }
     
     cout << "\033[1;34m \033[0m\n";                      // make sure all the ASCII shenanigans are done before the program ends
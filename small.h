@@ -0,0 +1,354 @@
+/*
+ * Scalar-generic routines, and fixed-size kernels for small matrices
+ * Evan Perry Grove, 2017
+ *
+ * Most matrices that come through here are tiny: 2x2 up to 8x8. For those the
+ * generic code spends more time on loop bookkeeping, row pointers and heap
+ * allocations than on arithmetic. The kernels below take the size N as a
+ * template parameter instead, so every loop has a compile-time trip count and
+ * gets unrolled all the way, and the working copy lives in a plain array on
+ * the stack. determinantOf() and reduceSmall() look at the runtime n and
+ * hand off to the right one.
+ *
+ * Everything is templated on the scalar type too, so the same code runs in
+ * float, double, long double or std::complex. Pivots are compared by
+ * std::abs, which works for all of them.
+ */
+
+#ifndef SMALL_H
+#define SMALL_H
+
+#include <cmath>
+#include <complex>
+#include <cstddef>
+#include <utility>
+#include <vector>
+
+#include "metrics.h"
+
+const int SMALL_MAX_ORDER = 8;
+
+// the kernels don't go through rowAxpy, so they report their flops to the metrics in one go. This is how many
+// eliminating below the diagonal of an n-row matrix takes, when the rows are width long: one divide for each
+// multiplier, and a multiply and a subtract for every element to the right of the pivot.
+inline long smallEliminationFlops(int n, int width)
+{
+    long flops = 0;
+    for (int c = 0; c < n; c++)
+    {
+        flops += (long)(n - 1 - c) * (1 + 2 * (width - 1 - c));
+    }
+    return flops;
+}
+
+// LU with partial pivoting on an N x N array, in place. Same method as determinantLU in determinant.cpp.
+template <class T, int N>
+inline T determinantFixed(T (&a)[N][N])
+{
+    T det = T(1);
+    int swapped = 0;
+    #pragma GCC unroll 8
+    for (int c = 0; c < N; c++)
+    {
+        int pivotRow = c;
+        #pragma GCC unroll 8
+        for (int i = c + 1; i < N; i++)
+        {
+            if (std::abs(a[i][c]) > std::abs(a[pivotRow][c]))
+            {
+                pivotRow = i;
+            }
+        }
+        if (a[pivotRow][c] == T(0))
+        {
+            GJ_COUNT(swaps, swapped);
+            return T(0);
+        }
+        if (pivotRow != c)
+        {
+            #pragma GCC unroll 8
+            for (int j = c; j < N; j++)
+            {
+                std::swap(a[pivotRow][j], a[c][j]);
+            }
+            det = -det;
+            swapped++;
+        }
+        det *= a[c][c];
+        #pragma GCC unroll 8
+        for (int i = c + 1; i < N; i++)
+        {
+            T multiplier = a[i][c] / a[c][c];
+            #pragma GCC unroll 8
+            for (int j = c + 1; j < N; j++)
+            {
+                a[i][j] = a[i][j] - (a[c][j] * multiplier);
+            }
+        }
+    }
+    GJ_COUNT(swaps, swapped);
+    return det;
+}
+
+// the 2x2 case doesn't need any of that.
+template <class T>
+inline T determinantFixed(T (&a)[2][2])
+{
+    return a[0][0] * a[1][1] - a[1][0] * a[0][1];
+}
+
+// LU with partial pivoting for any n, on a row-major copy. This is the fallback once n is too big for the kernels.
+template <class T>
+inline T determinantGeneric(const T* src, int n, size_t stride)
+{
+    std::vector<T> a((size_t)n * n);
+    for (int i = 0; i < n; i++)
+    {
+        for (int j = 0; j < n; j++)
+        {
+            a[(size_t)i * n + j] = src[i * stride + j];
+        }
+    }
+    T det = T(1);
+    int swapped = 0;
+    for (int c = 0; c < n; c++)
+    {
+        int pivotRow = c;
+        for (int i = c + 1; i < n; i++)
+        {
+            if (std::abs(a[(size_t)i * n + c]) > std::abs(a[(size_t)pivotRow * n + c]))
+            {
+                pivotRow = i;
+            }
+        }
+        if (a[(size_t)pivotRow * n + c] == T(0))
+        {
+            GJ_COUNT(swaps, swapped);
+            return T(0);
+        }
+        T* rowC = &a[(size_t)c * n];
+        if (pivotRow != c)
+        {
+            T* rowP = &a[(size_t)pivotRow * n];
+            for (int j = c; j < n; j++)
+            {
+                std::swap(rowP[j], rowC[j]);
+            }
+            det = -det;
+            swapped++;
+        }
+        det *= rowC[c];
+        for (int i = c + 1; i < n; i++)
+        {
+            T* rowI = &a[(size_t)i * n];
+            T multiplier = rowI[c] / rowC[c];
+            for (int j = c + 1; j < n; j++)
+            {
+                rowI[j] = rowI[j] - (rowC[j] * multiplier);
+            }
+        }
+    }
+    GJ_COUNT(swaps, swapped);
+    return det;
+}
+
+template <class T, int N>
+inline T determinantFixedFrom(const T* src, size_t stride)
+{
+    T a[N][N];
+    #pragma GCC unroll 8
+    for (int i = 0; i < N; i++)
+    {
+        #pragma GCC unroll 8
+        for (int j = 0; j < N; j++)
+        {
+            a[i][j] = src[i * stride + j];
+        }
+    }
+    return determinantFixed<T>(a);
+}
+
+// the determinant of the n x n matrix starting at src, with rows stride elements apart.
+template <class T>
+inline T determinantOf(const T* src, int n, size_t stride)
+{
+    if (n >= 2 && n <= SMALL_MAX_ORDER)
+    {
+        GJ_COUNT(flops, smallEliminationFlops(n, n) + n);
+    }
+    switch (n)
+    {
+        case 1: return src[0];
+        case 2: return determinantFixedFrom<T, 2>(src, stride);
+        case 3: return determinantFixedFrom<T, 3>(src, stride);
+        case 4: return determinantFixedFrom<T, 4>(src, stride);
+        case 5: return determinantFixedFrom<T, 5>(src, stride);
+        case 6: return determinantFixedFrom<T, 6>(src, stride);
+        case 7: return determinantFixedFrom<T, 7>(src, stride);
+        case 8: return determinantFixedFrom<T, 8>(src, stride);
+    }
+    return determinantGeneric(src, n, stride);
+}
+
+// REF of an N x (N+1) augmented matrix, the same way reduceToREFBlocked does it with partial pivoting: the biggest
+// entry left in each column gets swapped up, zeros go below the diagonal, and every pivot is divided out to 1. A
+// zero pivot skips its column. Returns how many rows got swapped.
+template <class T, int N>
+inline int reduceToREFFixed(T (&a)[N][N + 1])
+{
+    int swaps = 0;
+    #pragma GCC unroll 8
+    for (int c = 0; c < N; c++)
+    {
+        // find the pivot row first, comparing only, then swap it up once. The swap goes through every row below
+        // and only fires on the one that matches, so every index stays a compile-time constant and the whole array
+        // can stay in registers.
+        int pivotRow = c;
+        T biggest = std::abs(a[c][c]);
+        #pragma GCC unroll 8
+        for (int i = c + 1; i < N; i++)
+        {
+            if (std::abs(a[i][c]) > biggest)
+            {
+                biggest = std::abs(a[i][c]);
+                pivotRow = i;
+            }
+        }
+        #pragma GCC unroll 8
+        for (int i = c + 1; i < N; i++)
+        {
+            if (i == pivotRow)
+            {
+                #pragma GCC unroll 9
+                for (int j = c; j <= N; j++)
+                {
+                    std::swap(a[c][j], a[i][j]);
+                }
+            }
+        }
+        swaps += pivotRow != c;
+        if (a[c][c] == T(0))
+        {
+            continue;
+        }
+        #pragma GCC unroll 8
+        for (int i = c + 1; i < N; i++)
+        {
+            T multiplier = a[i][c] / a[c][c];
+            #pragma GCC unroll 9
+            for (int j = c + 1; j <= N; j++)
+            {
+                a[i][j] = a[i][j] - (a[c][j] * multiplier);
+            }
+        }
+    }
+    #pragma GCC unroll 8
+    for (int i = 0; i < N; i++)
+    {
+        #pragma GCC unroll 8
+        for (int j = 0; j < i; j++)
+        {
+            a[i][j] = T(0);
+        }
+        T divisor = a[i][i];
+        if (divisor != T(0))
+        {
+            T r = T(1) / divisor;
+            #pragma GCC unroll 9
+            for (int j = i + 1; j <= N; j++)
+            {
+                a[i][j] = a[i][j] * r;
+            }
+            a[i][i] = T(1);
+        }
+    }
+    return swaps;
+}
+
+// RREF from REF: the square part is unit upper triangular, so clearing column c above the pivot only touches
+// column c and the last column.
+template <class T, int N>
+inline void reduceToRREFFixed(T (&a)[N][N + 1])
+{
+    #pragma GCC unroll 8
+    for (int c = N - 1; c > 0; c--)
+    {
+        if (a[c][c] == T(0))
+        {
+            continue;
+        }
+        #pragma GCC unroll 8
+        for (int i = 0; i < c; i++)
+        {
+            a[i][N] = a[i][N] - (a[c][N] * a[i][c]);
+            a[i][c] = T(0);
+        }
+    }
+}
+
+template <class T, int N>
+inline int reduceFixedInPlace(T* m, size_t stride, bool rref)
+{
+    int swaps = 0;
+    T a[N][N + 1];
+    #pragma GCC unroll 8
+    for (int i = 0; i < N; i++)
+    {
+        #pragma GCC unroll 9
+        for (int j = 0; j <= N; j++)
+        {
+            a[i][j] = m[i * stride + j];
+        }
+    }
+    if (rref)
+    {
+        reduceToRREFFixed<T, N>(a);
+    }
+    else
+    {
+        swaps = reduceToREFFixed<T, N>(a);
+    }
+    #pragma GCC unroll 8
+    for (int i = 0; i < N; i++)
+    {
+        #pragma GCC unroll 9
+        for (int j = 0; j <= N; j++)
+        {
+            m[i * stride + j] = a[i][j];
+        }
+    }
+    return swaps;
+}
+
+// REF (or with rref set, RREF from a REF) of an n x cols matrix in place, if there's a kernel for that size: n has
+// to be 2..SMALL_MAX_ORDER and cols has to be n+1. Returns false (without touching anything) if there isn't. The REF
+// pivots partially; how many rows it swapped goes in swapCount, if that isn't null.
+template <class T>
+inline bool reduceSmall(T* m, int n, int cols, size_t stride, bool rref, int* swapCount = NULL)
+{
+    if (cols != n + 1 || n < 2 || n > SMALL_MAX_ORDER)
+    {
+        return false;
+    }
+    // RREF only has to fix up the last column; REF also divides each row (from the diagonal on) by its pivot.
+    GJ_COUNT(flops, rref ? (long)n * (n - 1) : smallEliminationFlops(n, n + 1) + (long)n * (n + 3) / 2);
+    int swapped = 0;
+    switch (n)
+    {
+        case 2: swapped = reduceFixedInPlace<T, 2>(m, stride, rref); break;
+        case 3: swapped = reduceFixedInPlace<T, 3>(m, stride, rref); break;
+        case 4: swapped = reduceFixedInPlace<T, 4>(m, stride, rref); break;
+        case 5: swapped = reduceFixedInPlace<T, 5>(m, stride, rref); break;
+        case 6: swapped = reduceFixedInPlace<T, 6>(m, stride, rref); break;
+        case 7: swapped = reduceFixedInPlace<T, 7>(m, stride, rref); break;
+        case 8: swapped = reduceFixedInPlace<T, 8>(m, stride, rref); break;
+    }
+    GJ_COUNT(swaps, swapped);
+    if (swapCount != NULL)
+    {
+        *swapCount = swapped;
+    }
+    return true;
+}
+
+#endif
@@ -0,0 +1,614 @@
+/*
+ * Solver daemon: the determinant and Gauss-Jordan routines behind a Unix socket
+ * Evan Perry Grove, 2017
+ *
+ *     g++ -O2 -pthread solverd.cpp -o solverd
+ *     ./solverd [--socket path] [--threads n] [--metrics [file]]
+ *
+ * Starting a whole process for every little system costs way more than
+ * solving it. This one starts once, listens on a Unix domain socket
+ * (gauss-jordan.sock in the current directory unless --socket says otherwise)
+ * and keeps going until it gets SIGINT or SIGTERM. Any number of clients can
+ * connect, and each one can send as many requests as it likes without waiting
+ * for the answers.
+ *
+ * A request is a header line followed by the matrix, one row per line:
+ *
+ *     <id> <op> <rows> <cols>
+ *     <row 1>
+ *     ...
+ *     <row rows>
+ *
+ * The id is anything without spaces (it just gets echoed back), and op is one
+ * of these:
+ *
+ *     det       the determinant (LU, same as determinant.cpp mode 0)
+ *     exact     the exact determinant of an integer matrix, every digit of it
+ *     rref      the RREF of an n x (n+k) augmented matrix
+ *     solve     X, for an n x (n+k) augmented matrix [A|B]
+ *     inverse   the inverse of a square matrix
+ *
+ * The answer is "<id> ok <rows> <cols>" followed by the result one row per
+ * line (a determinant is 1 x 1), or "<id> error <message>". Answers go out as
+ * soon as they're ready, which isn't necessarily the order the requests came
+ * in; that's what the id is for. A header that doesn't parse gets an error
+ * with id "-", and the connection gets closed, since there's no telling where
+ * the next request would start.
+ *
+ * The main thread does all of the reading. Whole requests go onto a queue, and
+ * a dispatcher thread takes everything that's waiting and solves all of it as
+ * one batch across the shared thread pool, so a pile of small requests costs
+ * one round on the pool instead of one each. Whatever shows up while a batch
+ * is running becomes the next batch. Big matrices (the ones the elimination
+ * would spread across the pool by itself) get done one at a time after the
+ * batch instead, since the pool can only run one thing at once.
+ */
+
+#include <cerrno>
+#include <charconv>
+#include <condition_variable>
+#include <csignal>
+#include <cstdio>
+#include <cstring>
+#include <iostream>
+#include <memory>
+#include <mutex>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include "matrix.h"
+#include "determinant.h"
+#include "rref.h"
+#include "lu.h"
+#include "small.h"
+#include "exact.h"
+#include "metrics.h"
+
+using namespace std;
+
+const int DAEMON_MAX_ORDER = 4096;                          // rows or cols past this and it's probably garbage
+const size_t MAX_HEADER_BYTES = 256;
+const int EXACT_BIG_ORDER = 64;                             // exact mode starts wanting the whole pool around here
+const int SEND_TIMEOUT_SECONDS = 10;                        // a client that stops reading its answers gets dropped
+
+// one client. Answers get written from whichever thread solved them, so writes take turns.
+struct Connection
+{
+    int fd;
+    bool broken;
+    mutex writeLock;
+
+    explicit Connection(int fd) : fd(fd), broken(false) {}
+    ~Connection() { close(fd); }
+
+    void send(const string& message)
+    {
+        lock_guard<mutex> guard(writeLock);
+        size_t sent = 0;
+        while (!broken && sent < message.size())
+        {
+            ssize_t n = ::send(fd, message.data() + sent, message.size() - sent, MSG_NOSIGNAL);
+            if (n < 0 && errno == EINTR)
+            {
+                continue;
+            }
+            if (n <= 0)
+            {
+                broken = true;                              // gone, or not reading. Either way nobody gets the rest
+                shutdown(fd, SHUT_RDWR);
+                break;
+            }
+            sent += n;
+        }
+    }
+};
+
+struct Job
+{
+    shared_ptr<Connection> client;
+    string id;
+    string op;
+    Matrix matrix;
+};
+
+void appendValue(string& out, double value)
+{
+    char digits[32];
+    to_chars_result r = to_chars(digits, digits + sizeof(digits), value);
+    out.append(digits, r.ptr);
+}
+
+string answer(const string& id, const Matrix& m)
+{
+    GJ_PHASE(PHASE_OUTPUT);
+    string out = id + " ok " + to_string(m.rows()) + " " + to_string(m.cols()) + "\n";
+    for (int i = 0; i < m.rows(); i++)
+    {
+        for (int j = 0; j < m.cols(); j++)
+        {
+            if (j > 0)
+            {
+                out += ' ';
+            }
+            appendValue(out, m[i][j]);
+        }
+        out += '\n';
+    }
+    return out;
+}
+
+string failure(const string& id, const string& message)
+{
+    return id + " error " + message + "\n";
+}
+
+bool knownOp(const string& op)
+{
+    return op == "det" || op == "exact" || op == "rref" || op == "solve" || op == "inverse";
+}
+
+// whether a request would put the shared pool to work by itself, so it can't go in a batch.
+bool isBig(const Job& job)
+{
+    int n = job.matrix.rows();
+    return n >= PARALLEL_MIN_ORDER || (job.op == "exact" && n >= EXACT_BIG_ORDER);
+}
+
+// work out one request and return the answer. pool only gets used by exact mode, and only for big ones.
+string solve(Job& job, ThreadPool& pool)
+{
+    Matrix& m = job.matrix;
+    int n = m.rows();
+    bool square = job.op == "det" || job.op == "exact" || job.op == "inverse";
+    if (square && m.cols() != n)
+    {
+        return failure(job.id, "expected a square matrix");
+    }
+    if (!square && m.cols() <= n)
+    {
+        return failure(job.id, "expected an n x (n+k) augmented matrix");
+    }
+
+    if (job.op == "det")
+    {
+        Matrix det(1, 1);
+        det[0][0] = findDeterminant(m, 0);
+        return answer(job.id, det);
+    }
+    if (job.op == "exact")
+    {
+        if (!isIntegerMatrix(m))
+        {
+            return failure(job.id, "exact mode needs an integer matrix");
+        }
+        ExactStats stats;
+        BigInt det;
+        {
+            GJ_PHASE(PHASE_DETERMINANT);
+            det = determinantExact(m, pool, stats);
+        }
+        return job.id + " ok 1 1\n" + det.toString() + "\n";
+    }
+    if (job.op == "rref")
+    {
+        // the same thing rref_approx.cpp batch mode does, minus the REF output.
+        PivotResult pivots = reduceToREF(m, NULL);
+        reduceToRREF(m, NULL, pivots);
+        return answer(job.id, m);
+    }
+
+    // solve and inverse
+    LUFactors factors = factorLU(m);
+    if (factors.singular)
+    {
+        return failure(job.id, "singular matrix");
+    }
+    if (job.op == "inverse")
+    {
+        return answer(job.id, inverseLU(factors));
+    }
+    Matrix b(n, m.cols() - n);
+    for (int i = 0; i < n; i++)
+    {
+        memcpy(b[i], m[i] + n, b.cols() * sizeof(double));
+    }
+    return answer(job.id, solveLU(factors, b));
+}
+
+// takes whole requests off the reader's hands and solves them in batches on its own thread.
+class Dispatcher
+{
+public:
+    explicit Dispatcher(ThreadPool& pool) : pool(pool), stopping(false), thread(&Dispatcher::loop, this) {}
+
+    void submit(Job&& job)
+    {
+        {
+            lock_guard<mutex> guard(lock);
+            queue.push_back(std::move(job));
+        }
+        ready.notify_one();
+    }
+
+    // finishes everything that's already been submitted, then stops.
+    void stop()
+    {
+        {
+            lock_guard<mutex> guard(lock);
+            stopping = true;
+        }
+        ready.notify_one();
+        thread.join();
+    }
+
+private:
+    ThreadPool& pool;
+    mutex lock;
+    condition_variable ready;
+    vector<Job> queue;
+    bool stopping;
+    std::thread thread;
+
+    void loop()
+    {
+        for (;;)
+        {
+            vector<Job> batch;
+            {
+                unique_lock<mutex> guard(lock);
+                ready.wait(guard, [this]() { return !queue.empty() || stopping; });
+                if (queue.empty())
+                {
+                    return;
+                }
+                batch.swap(queue);
+            }
+            vector<Job*> small;
+            vector<Job*> big;
+            for (size_t k = 0; k < batch.size(); k++)
+            {
+                (isBig(batch[k]) ? big : small).push_back(&batch[k]);
+            }
+            // nothing in here touches the pool itself, so every worker can take requests.
+            pool.parallelFor(0, (int)small.size(), 1, [&](int k0, int k1)
+            {
+                for (int k = k0; k < k1; k++)
+                {
+                    small[k]->client->send(solve(*small[k], serialPool()));
+                }
+            });
+            for (size_t k = 0; k < big.size(); k++)
+            {
+                big[k]->client->send(solve(*big[k], pool));
+            }
+        }
+    }
+};
+
+// a connected client, from the reading side. scan and linesFound remember how far into the current request's rows
+// we've looked, so a big matrix that trickles in doesn't get rescanned from the top every time.
+struct Client
+{
+    shared_ptr<Connection> connection;
+    string buffer;
+    size_t scan;
+    int linesFound;
+};
+
+enum RequestStatus
+{
+    REQUEST_INCOMPLETE,
+    REQUEST_READY,
+    REQUEST_GARBLED
+};
+
+// pull the next whole request out of client.buffer, starting at pos. On REQUEST_READY, pos moves past it and job
+// holds it (or reply holds an error, if the header was fine but the rest wasn't).
+RequestStatus takeRequest(Client& client, size_t& pos, Job& job, string& reply)
+{
+    const string& buffer = client.buffer;
+    size_t start = buffer.find_first_not_of(" \t\r\n", pos);      // blank lines between requests are fine
+    if (start == string::npos)
+    {
+        pos = buffer.size();
+        return REQUEST_INCOMPLETE;
+    }
+    pos = start;
+    size_t headerEnd = buffer.find('\n', start);
+    if (headerEnd == string::npos)
+    {
+        return buffer.size() - start > MAX_HEADER_BYTES ? REQUEST_GARBLED : REQUEST_INCOMPLETE;
+    }
+    if (headerEnd - start > MAX_HEADER_BYTES)
+    {
+        return REQUEST_GARBLED;
+    }
+    istringstream header(buffer.substr(start, headerEnd - start));
+    string id;
+    string op;
+    int rows = 0;
+    int cols = 0;
+    string extra;
+    if (!(header >> id >> op >> rows >> cols) || (header >> extra) || rows < 1 || cols < 1
+        || rows > DAEMON_MAX_ORDER || cols > DAEMON_MAX_ORDER)
+    {
+        return REQUEST_GARBLED;
+    }
+
+    // the matrix is the next rows lines.
+    if (client.scan <= headerEnd)
+    {
+        client.scan = headerEnd + 1;
+        client.linesFound = 0;
+    }
+    while (client.linesFound < rows)
+    {
+        size_t lineEnd = buffer.find('\n', client.scan);
+        if (lineEnd == string::npos)
+        {
+            client.scan = buffer.size();
+            return REQUEST_INCOMPLETE;
+        }
+        client.scan = lineEnd + 1;
+        client.linesFound++;
+    }
+    size_t end = client.scan;
+    client.scan = 0;
+    client.linesFound = 0;
+    pos = end;
+
+    job.id = id;
+    job.op = op;
+    reply.clear();
+    if (!knownOp(op))
+    {
+        reply = failure(id, "unknown op " + op);
+        return REQUEST_READY;
+    }
+    GJ_PHASE(PHASE_INPUT);
+    job.matrix = Matrix(rows, cols);
+    const char* p = buffer.data() + headerEnd + 1;
+    const char* last = buffer.data() + end;
+    long expected = (long)rows * cols;
+    long count = 0;
+    for (;;)
+    {
+        while (p < last && (*p == ' ' || *p == '\t' || *p == '\r' || *p == '\n'))
+        {
+            p++;
+        }
+        if (p == last)
+        {
+            break;
+        }
+        double value;
+        from_chars_result r = from_chars(p, last, value);
+        if (r.ec != errc() || count == expected)
+        {
+            reply = failure(id, "expected " + to_string(expected) + " numbers");
+            return REQUEST_READY;
+        }
+        job.matrix[count / cols][count % cols] = value;
+        count++;
+        p = r.ptr;
+    }
+    if (count != expected)
+    {
+        reply = failure(id, "expected " + to_string(expected) + " numbers");
+    }
+    return REQUEST_READY;
+}
+
+int wakePipe[2];
+
+extern "C" void onSignal(int)
+{
+    char c = 0;
+    ssize_t ignored = write(wakePipe[1], &c, 1);
+    (void)ignored;
+}
+
+// bind and listen on path. A socket file left behind by a daemon that died gets replaced, but not one that somebody
+// is still listening on, and not anything that isn't a socket.
+int listenOn(const string& path)
+{
+    sockaddr_un address;
+    memset(&address, 0, sizeof(address));
+    address.sun_family = AF_UNIX;
+    if (path.size() >= sizeof(address.sun_path))
+    {
+        cerr << "solverd: socket path is too long: " << path << endl;
+        return -1;
+    }
+    memcpy(address.sun_path, path.c_str(), path.size());
+
+    struct stat info;
+    if (stat(path.c_str(), &info) == 0)
+    {
+        int probe = socket(AF_UNIX, SOCK_STREAM, 0);
+        bool live = S_ISSOCK(info.st_mode) && connect(probe, (sockaddr*)&address, sizeof(address)) == 0;
+        close(probe);
+        if (!S_ISSOCK(info.st_mode) || live)
+        {
+            cerr << "solverd: " << path << (live ? " already has a daemon listening on it" : " exists and isn't a socket")
+                 << endl;
+            return -1;
+        }
+        unlink(path.c_str());
+    }
+
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0 || bind(fd, (sockaddr*)&address, sizeof(address)) != 0 || listen(fd, 64) != 0)
+    {
+        cerr << "solverd: can't listen on " << path << ": " << strerror(errno) << endl;
+        if (fd >= 0)
+        {
+            close(fd);
+        }
+        return -1;
+    }
+    return fd;
+}
+
+int main(int argc, char* argv[])
+{
+    string socketPath = "gauss-jordan.sock";
+    MetricsReport metrics;
+    for (int arg = 1; arg < argc; arg++)
+    {
+        string flag = argv[arg];
+        if ((flag == "--socket" || flag == "-s") && arg + 1 < argc)
+        {
+            socketPath = argv[++arg];
+        }
+        else if ((flag == "--threads" || flag == "-t") && arg + 1 < argc)
+        {
+            sharedPoolThreads() = atoi(argv[++arg]);
+        }
+        else if (flag == "--metrics")
+        {
+            string metricsPath;
+            if (arg + 1 < argc && argv[arg + 1][0] != '-')
+            {
+                metricsPath = argv[++arg];
+            }
+            metrics.request(metricsPath);
+        }
+        else
+        {
+            cerr << "usage: " << argv[0] << " [--socket path] [--threads n] [--metrics [file]]" << endl;
+            return 1;
+        }
+    }
+
+    int listener = listenOn(socketPath);
+    if (listener < 0 || pipe(wakePipe) != 0)
+    {
+        return 1;
+    }
+    struct sigaction action;
+    memset(&action, 0, sizeof(action));
+    action.sa_handler = onSignal;
+    sigaction(SIGINT, &action, NULL);
+    sigaction(SIGTERM, &action, NULL);
+    cerr << "solverd: listening on " << socketPath << " with " << sharedPool().size() << " threads" << endl;
+
+    Dispatcher dispatcher(sharedPool());
+    vector<Client> clients;
+    vector<pollfd> fds;
+    for (;;)
+    {
+        // the wakeup pipe, the listening socket, then every client in order.
+        fds.resize(2 + clients.size());
+        fds[0].fd = wakePipe[0];
+        fds[1].fd = listener;
+        for (size_t c = 0; c < clients.size(); c++)
+        {
+            fds[2 + c].fd = clients[c].connection->fd;
+        }
+        for (size_t f = 0; f < fds.size(); f++)
+        {
+            fds[f].events = POLLIN;
+            fds[f].revents = 0;
+        }
+        if (poll(fds.data(), fds.size(), -1) < 0)
+        {
+            if (errno == EINTR)
+            {
+                continue;
+            }
+            cerr << "solverd: poll: " << strerror(errno) << endl;
+            break;
+        }
+        if (fds[0].revents != 0)
+        {
+            break;
+        }
+
+        for (size_t c = clients.size(); c-- > 0;)
+        {
+            if (fds[2 + c].revents == 0)
+            {
+                continue;
+            }
+            Client& client = clients[c];
+            char chunk[1 << 16];
+            ssize_t n = read(client.connection->fd, chunk, sizeof(chunk));
+            if (n < 0 && errno == EINTR)
+            {
+                continue;
+            }
+            bool closing = n <= 0;
+            if (!closing)
+            {
+                client.buffer.append(chunk, n);
+                size_t pos = 0;
+                for (;;)
+                {
+                    Job job;
+                    string reply;
+                    RequestStatus status = takeRequest(client, pos, job, reply);
+                    if (status == REQUEST_INCOMPLETE)
+                    {
+                        break;
+                    }
+                    if (status == REQUEST_GARBLED)
+                    {
+                        client.connection->send(failure("-", "bad request header"));
+                        closing = true;
+                        break;
+                    }
+                    if (!reply.empty())
+                    {
+                        client.connection->send(reply);
+                        continue;
+                    }
+                    job.client = client.connection;
+                    dispatcher.submit(std::move(job));
+                }
+                // everything before pos is done with. scan (if we're partway into a request) moves along with it.
+                client.buffer.erase(0, pos);
+                if (client.scan > 0)
+                {
+                    client.scan -= pos;
+                }
+            }
+            if (closing || client.connection->broken)
+            {
+                // answers still on their way keep the connection open until they're sent.
+                clients.erase(clients.begin() + c);
+            }
+        }
+
+        if (fds[1].revents & POLLIN)
+        {
+            int fd = accept(listener, NULL, NULL);
+            if (fd >= 0)
+            {
+                timeval timeout = { SEND_TIMEOUT_SECONDS, 0 };
+                setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+                Client client;
+                client.connection = make_shared<Connection>(fd);
+                client.scan = 0;
+                client.linesFound = 0;
+                clients.push_back(client);
+            }
+        }
+    }
+
+    // stop taking new work, but answer everything that's already in.
+    close(listener);
+    unlink(socketPath.c_str());
+    dispatcher.stop();
+    cerr << "solverd: stopped" << endl;
+    return 0;
+}
@@ -0,0 +1,473 @@
+/*
+ * Sparse Gauss-Jordan for systems that are almost all zeros
+ * Evan Perry Grove, 2017
+ *
+ * The dense code stores every element, and happily subtracts zero times a row
+ * from another row at full O(n) cost. When 99% of the matrix is zeros that's
+ * nearly all wasted work, and for n in the hundreds of thousands the dense
+ * matrix can't even be allocated. Here the matrix is kept in compressed rows
+ * (CSR) and elimination only ever touches the nonzeros.
+ *
+ * Elimination fills in zeros as it goes, and how much depends a lot on the
+ * order the columns get eliminated in. Before starting we pick an order with
+ * a minimum degree heuristic on the pattern of A + A^T: always eliminate the
+ * variable that's connected to the fewest others right now. Rows that are
+ * nearly dense get pushed to the end, since they'd just wreck everything
+ * else. Pivots are picked per column with threshold Markowitz: out of the rows
+ * with a big enough entry in the column (at least SPARSE_PIVOT_THRESHOLD times
+ * the biggest), take the shortest one.
+ *
+ * Input is a Matrix Market coordinate file (1-based "row col value" triplets)
+ * holding the n x (n+1) augmented matrix. The answer is the solution x, which
+ * is the last column of the RREF.
+ */
+
+#ifndef SPARSE_H
+#define SPARSE_H
+
+#include <algorithm>
+#include <charconv>
+#include <cmath>
+#include <cstdio>
+#include <queue>
+#include <string>
+#include <vector>
+
+#include "metrics.h"
+
+const double SPARSE_PIVOT_THRESHOLD = 0.1;
+
+// compressed sparse rows: row i's entries are colIndex/values[rowStart[i] .. rowStart[i+1]), sorted by column.
+struct SparseMatrix
+{
+    int rows;
+    int cols;
+    std::vector<long> rowStart;
+    std::vector<int> colIndex;
+    std::vector<double> values;
+
+    long nonzeros() const { return (long)colIndex.size(); }
+};
+
+struct SparseStats
+{
+    long nonzerosA;                                         // in the n x n coefficient part
+    long nonzerosLU;                                        // multipliers plus the rows of U
+    long fillIn;                                            // nonzerosLU - nonzerosA
+};
+
+// read a Matrix Market coordinate file (an empty path or "-" means stdin). Duplicates get added together.
+inline bool readMatrixMarket(const std::string& path, SparseMatrix& a, std::string& err)
+{
+    GJ_PHASE(PHASE_INPUT);
+    FILE* in = stdin;
+    if (!path.empty() && path != "-")
+    {
+        in = fopen(path.c_str(), "rb");
+        if (in == NULL)
+        {
+            err = "could not open " + path;
+            return false;
+        }
+    }
+    std::vector<char> text;
+    char chunk[1 << 16];
+    size_t got;
+    while ((got = fread(chunk, 1, sizeof(chunk), in)) > 0)
+    {
+        text.insert(text.end(), chunk, chunk + got);
+    }
+    if (in != stdin)
+    {
+        fclose(in);
+    }
+    const char* p = text.data();
+    const char* end = p + text.size();
+    bool symmetric = false;
+
+    // skip the banner and comments, but notice if it says symmetric.
+    while (p < end && *p == '%')
+    {
+        const char* eol = std::find(p, end, '\n');
+        if (std::string(p, eol).find("symmetric") != std::string::npos)
+        {
+            symmetric = true;
+        }
+        p = eol < end ? eol + 1 : end;
+    }
+    auto skipSpace = [&]()
+    {
+        while (p < end && (*p == ' ' || *p == '\n' || *p == '\t' || *p == '\r'))
+        {
+            p++;
+        }
+    };
+    auto readLong = [&](long& value)
+    {
+        skipSpace();
+        std::from_chars_result r = std::from_chars(p, end, value);
+        p = r.ptr;
+        return r.ec == std::errc();
+    };
+    auto readDouble = [&](double& value)
+    {
+        skipSpace();
+        if (p < end && *p == '+')
+        {
+            p++;
+        }
+        std::from_chars_result r = std::from_chars(p, end, value);
+        p = r.ptr;
+        return r.ec == std::errc();
+    };
+
+    long rows, cols, entries;
+    if (!readLong(rows) || !readLong(cols) || !readLong(entries) || rows <= 0 || cols <= 0 || entries < 0)
+    {
+        err = "bad Matrix Market size line";
+        return false;
+    }
+    // symmetric only says something about the n x n coefficient part; the right hand side columns don't get mirrored.
+    if (symmetric && cols < rows)
+    {
+        err = "symmetric Matrix Market file needs a square coefficient part";
+        return false;
+    }
+    std::vector<long> rowOf;
+    std::vector<int> colOf;
+    std::vector<double> valueOf;
+    rowOf.reserve(symmetric ? 2 * entries : entries);
+    colOf.reserve(rowOf.capacity());
+    valueOf.reserve(rowOf.capacity());
+    for (long e = 0; e < entries; e++)
+    {
+        long i, j;
+        double v;
+        if (!readLong(i) || !readLong(j) || !readDouble(v) || i < 1 || i > rows || j < 1 || j > cols)
+        {
+            err = "bad entry " + std::to_string(e + 1);
+            return false;
+        }
+        rowOf.push_back(i - 1);
+        colOf.push_back((int)(j - 1));
+        valueOf.push_back(v);
+        if (symmetric && i != j && j <= rows)
+        {
+            rowOf.push_back(j - 1);
+            colOf.push_back((int)(i - 1));
+            valueOf.push_back(v);
+        }
+    }
+
+    // bucket the triplets by row, then sort each row and add up duplicates.
+    a.rows = (int)rows;
+    a.cols = (int)cols;
+    a.rowStart.assign(rows + 1, 0);
+    for (size_t e = 0; e < rowOf.size(); e++)
+    {
+        a.rowStart[rowOf[e] + 1]++;
+    }
+    for (long i = 0; i < rows; i++)
+    {
+        a.rowStart[i + 1] += a.rowStart[i];
+    }
+    std::vector<long> next(a.rowStart.begin(), a.rowStart.end() - 1);
+    std::vector<std::pair<int, double> > sorted(rowOf.size());
+    for (size_t e = 0; e < rowOf.size(); e++)
+    {
+        sorted[next[rowOf[e]]++] = std::make_pair(colOf[e], valueOf[e]);
+    }
+    a.colIndex.clear();
+    a.values.clear();
+    long written = 0;
+    for (long i = 0; i < rows; i++)
+    {
+        std::sort(sorted.begin() + a.rowStart[i], sorted.begin() + a.rowStart[i + 1]);
+        long start = written;
+        for (long e = a.rowStart[i]; e < a.rowStart[i + 1]; e++)
+        {
+            if (written > start && a.colIndex.back() == sorted[e].first)
+            {
+                a.values.back() += sorted[e].second;
+            }
+            else
+            {
+                a.colIndex.push_back(sorted[e].first);
+                a.values.push_back(sorted[e].second);
+                written++;
+            }
+        }
+        a.rowStart[i] = start;
+    }
+    a.rowStart[rows] = written;
+    return true;
+}
+
+// minimum degree ordering on the pattern of A + A^T (just the n x n part). Returns the order to eliminate the
+// variables in. This works on the elimination graph directly: eliminating v ties all of v's neighbors together.
+// Degrees get updated lazily, so the heap can hold stale entries that just get skipped.
+inline std::vector<int> minimumDegreeOrder(const SparseMatrix& a)
+{
+    GJ_PHASE(PHASE_PIVOT);
+    int n = a.rows;
+    std::vector<std::vector<int> > adjacent(n);
+    for (int i = 0; i < n; i++)
+    {
+        for (long e = a.rowStart[i]; e < a.rowStart[i + 1]; e++)
+        {
+            int j = a.colIndex[e];
+            if (j < n && j != i)
+            {
+                adjacent[i].push_back(j);
+                adjacent[j].push_back(i);
+            }
+        }
+    }
+    for (int i = 0; i < n; i++)
+    {
+        std::sort(adjacent[i].begin(), adjacent[i].end());
+        adjacent[i].erase(std::unique(adjacent[i].begin(), adjacent[i].end()), adjacent[i].end());
+    }
+
+    // anything this connected goes last, in its original order.
+    size_t denseDegree = std::max<size_t>(16, (size_t)(10 * sqrt((double)n)));
+    std::vector<char> eliminated(n, 0);
+    std::vector<int> dense;
+    typedef std::pair<size_t, int> DegreeEntry;
+    std::priority_queue<DegreeEntry, std::vector<DegreeEntry>, std::greater<DegreeEntry> > heap;
+    for (int i = 0; i < n; i++)
+    {
+        if (adjacent[i].size() > denseDegree)
+        {
+            eliminated[i] = 1;
+            dense.push_back(i);
+        }
+    }
+    for (int i = 0; i < n; i++)
+    {
+        if (!eliminated[i])
+        {
+            heap.push(DegreeEntry(adjacent[i].size(), i));
+        }
+    }
+
+    std::vector<int> order;
+    order.reserve(n);
+    std::vector<int> merged;
+    while (!heap.empty())
+    {
+        DegreeEntry top = heap.top();
+        heap.pop();
+        int v = top.second;
+        if (eliminated[v] || top.first != adjacent[v].size())
+        {
+            continue;                                       // stale
+        }
+        eliminated[v] = 1;
+        order.push_back(v);
+
+        // v's live neighbors become a clique.
+        std::vector<int> neighbors;
+        for (size_t k = 0; k < adjacent[v].size(); k++)
+        {
+            if (!eliminated[adjacent[v][k]])
+            {
+                neighbors.push_back(adjacent[v][k]);
+            }
+        }
+        for (size_t k = 0; k < neighbors.size(); k++)
+        {
+            int u = neighbors[k];
+            merged.clear();
+            std::vector<int>& list = adjacent[u];
+            size_t x = 0, y = 0;
+            while (x < list.size() || y < neighbors.size())
+            {
+                int next;
+                if (y >= neighbors.size() || (x < list.size() && list[x] < neighbors[y]))
+                {
+                    next = list[x++];
+                }
+                else if (x >= list.size() || neighbors[y] < list[x])
+                {
+                    next = neighbors[y++];
+                }
+                else
+                {
+                    next = list[x++];
+                    y++;
+                }
+                if (next != u && !eliminated[next])
+                {
+                    merged.push_back(next);
+                }
+            }
+            list.swap(merged);
+            heap.push(DegreeEntry(list.size(), u));
+        }
+        std::vector<int>().swap(adjacent[v]);
+    }
+    order.insert(order.end(), dense.begin(), dense.end());
+    return order;
+}
+
+// solve the n x (n+1) augmented system. order says which column to eliminate first, second and so on (pass the
+// identity for no reordering). Returns false if the matrix turns out to be singular.
+inline bool solveSparse(const SparseMatrix& a, const std::vector<int>& order, std::vector<double>& x, SparseStats& stats,
+                        std::string& err)
+{
+    GJ_PHASE(PHASE_SOLVE);
+    int n = a.rows;
+    std::vector<int> position(n);                           // where each original column lands in the new order
+    for (int k = 0; k < n; k++)
+    {
+        position[order[k]] = k;
+    }
+
+    // each row as (new column, value) pairs sorted by new column, and the right hand side on its own.
+    struct Entry
+    {
+        int col;
+        double value;
+        bool operator<(const Entry& other) const { return col < other.col; }
+    };
+    std::vector<std::vector<Entry> > rowEntries(n);
+    std::vector<double> rhs(n, 0);
+    std::vector<std::vector<int> > colRows(n);              // rows that (might) have something in each column
+    stats.nonzerosA = 0;
+    for (int i = 0; i < n; i++)
+    {
+        for (long e = a.rowStart[i]; e < a.rowStart[i + 1]; e++)
+        {
+            int j = a.colIndex[e];
+            if (j < n && a.values[e] != 0)
+            {
+                Entry entry = { position[j], a.values[e] };
+                rowEntries[i].push_back(entry);
+                stats.nonzerosA++;
+            }
+            else if (j == n)
+            {
+                rhs[i] = a.values[e];
+            }
+        }
+        std::sort(rowEntries[i].begin(), rowEntries[i].end());
+        for (size_t k = 0; k < rowEntries[i].size(); k++)
+        {
+            colRows[rowEntries[i][k].col].push_back(i);
+        }
+    }
+
+    std::vector<int> pivotRowOf(n, -1);
+    std::vector<char> pivoted(n, 0);
+    std::vector<int> listedFor(n, -1);                      // so a row that's in colRows[k] twice only counts once
+    std::vector<Entry> merged;
+    long multipliers = 0;
+    for (int k = 0; k < n; k++)
+    {
+        // rows that still have something in column k. Their first entry has to be column k, since everything left
+        // of k is gone by now. A row can be listed more than once if an entry cancelled out and then filled back in.
+        std::vector<int> candidates;
+        double biggest = 0;
+        for (size_t r = 0; r < colRows[k].size(); r++)
+        {
+            int i = colRows[k][r];
+            if (!pivoted[i] && listedFor[i] != k && !rowEntries[i].empty() && rowEntries[i][0].col == k)
+            {
+                listedFor[i] = k;
+                candidates.push_back(i);
+                biggest = std::max(biggest, fabs(rowEntries[i][0].value));
+            }
+        }
+        std::vector<int>().swap(colRows[k]);
+        if (candidates.empty())
+        {
+            err = "matrix is singular";
+            return false;
+        }
+        int pivot = -1;
+        for (size_t r = 0; r < candidates.size(); r++)
+        {
+            int i = candidates[r];
+            if (fabs(rowEntries[i][0].value) >= SPARSE_PIVOT_THRESHOLD * biggest
+                && (pivot < 0 || rowEntries[i].size() < rowEntries[pivot].size()))
+            {
+                pivot = i;
+            }
+        }
+        pivoted[pivot] = 1;
+        pivotRowOf[k] = pivot;
+        const std::vector<Entry>& rowP = rowEntries[pivot];
+
+        // row i = row i - (row p * multiplier), over the nonzeros of both.
+        for (size_t r = 0; r < candidates.size(); r++)
+        {
+            int i = candidates[r];
+            if (i == pivot)
+            {
+                continue;
+            }
+            std::vector<Entry>& rowI = rowEntries[i];
+            double multiplier = rowI[0].value / rowP[0].value;
+            multipliers++;
+            rhs[i] -= rhs[pivot] * multiplier;
+            merged.clear();
+            size_t x = 1, y = 1;
+            while (x < rowI.size() || y < rowP.size())
+            {
+                if (y >= rowP.size() || (x < rowI.size() && rowI[x].col < rowP[y].col))
+                {
+                    merged.push_back(rowI[x++]);
+                }
+                else if (x >= rowI.size() || rowP[y].col < rowI[x].col)
+                {
+                    Entry fill = { rowP[y].col, -rowP[y].value * multiplier };
+                    merged.push_back(fill);
+                    colRows[fill.col].push_back(i);
+                    y++;
+                }
+                else
+                {
+                    // if they cancel out exactly, the entry just goes away.
+                    Entry both = { rowI[x].col, rowI[x].value - rowP[y].value * multiplier };
+                    if (both.value != 0)
+                    {
+                        merged.push_back(both);
+                    }
+                    x++;
+                    y++;
+                }
+            }
+            rowI.swap(merged);
+        }
+    }
+
+    long nonzerosU = 0;
+    for (int k = 0; k < n; k++)
+    {
+        nonzerosU += rowEntries[pivotRowOf[k]].size();
+    }
+    stats.nonzerosLU = nonzerosU + multipliers;
+    stats.fillIn = stats.nonzerosLU - stats.nonzerosA;
+
+    // back substitution, which is the RREF half: clear out everything above each pivot, from the bottom up.
+    std::vector<double> solved(n, 0);
+    for (int k = n - 1; k >= 0; k--)
+    {
+        const std::vector<Entry>& row = rowEntries[pivotRowOf[k]];
+        double sum = rhs[pivotRowOf[k]];
+        for (size_t e = 1; e < row.size(); e++)
+        {
+            sum -= row[e].value * solved[row[e].col];
+        }
+        solved[k] = sum / row[0].value;
+    }
+    x.assign(n, 0);
+    for (int k = 0; k < n; k++)
+    {
+        x[order[k]] = solved[k];
+    }
+    return true;
+}
+
+#endif
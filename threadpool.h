@@ -0,0 +1,317 @@
+/*
+ * A small persistent thread pool for the elimination kernels
+ * Evan Perry Grove, 2017
+ *
+ * Blocked elimination hands out one round of work per panel, so the pool gets
+ * used a few times for every PANEL columns. Starting threads (or even waking
+ * sleeping ones through the kernel) that often would eat the speedup, so the
+ * workers stick around for the life of the program and spin for a little
+ * while before they go to sleep. The thread that calls run() does a share of
+ * the work itself as worker 0, and then waits for everybody else to finish,
+ * which is the barrier between one round and the next.
+ *
+ * For recursive work that splits up unevenly (like Laplace expansion) there's
+ * also runWorkStealing(): every worker has its own deque of tasks, works on
+ * the newest task in its own deque, and when it runs dry it steals the oldest
+ * task out of somebody else's, which tends to be the biggest one.
+ */
+
+#ifndef THREADPOOL_H
+#define THREADPOOL_H
+
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define THREADPOOL_PAUSE() _mm_pause()
+#else
+#define THREADPOOL_PAUSE() std::this_thread::yield()
+#endif
+
+class ThreadPool
+{
+public:
+    explicit ThreadPool(int threads) : jobFn(NULL), jobData(NULL), generation(0), pending(0), sleepers(0), stopping(false)
+    {
+        if (threads < 1)
+        {
+            threads = 1;
+        }
+        for (int worker = 1; worker < threads; worker++)
+        {
+            workers.push_back(std::thread(&ThreadPool::workerLoop, this, worker));
+        }
+    }
+
+    ~ThreadPool()
+    {
+        stopping = true;
+        wake();
+        for (size_t t = 0; t < workers.size(); t++)
+        {
+            workers[t].join();
+        }
+    }
+
+    int size() const { return (int)workers.size() + 1; }
+
+    // run job(worker) on every thread in the pool at once, worker going from 0 to size()-1. Returns once they've
+    // all finished.
+    template <class Job>
+    void run(const Job& job)
+    {
+        if (workers.empty())
+        {
+            job(0);
+            return;
+        }
+        jobFn = &trampoline<Job>;
+        jobData = &job;
+        pending.store((int)workers.size(), std::memory_order_relaxed);
+        wake();
+        job(0);
+        int spins = 0;
+        while (pending.load(std::memory_order_acquire) != 0)
+        {
+            if (++spins < SPIN_LIMIT)
+            {
+                THREADPOOL_PAUSE();
+            }
+            else
+            {
+                std::this_thread::yield();
+            }
+        }
+    }
+
+    // split [begin, end) into chunks of grain and hand them out to whoever is free: body(chunkBegin, chunkEnd).
+    // Chunks are handed out as workers come asking for them, so uneven chunks still balance out.
+    template <class Body>
+    void parallelFor(int begin, int end, int grain, const Body& body)
+    {
+        if (grain < 1)
+        {
+            grain = 1;
+        }
+        if (workers.empty() || end - begin <= grain)
+        {
+            if (begin < end)
+            {
+                body(begin, end);
+            }
+            return;
+        }
+        std::atomic<int> next(begin);
+        run([&](int)
+        {
+            for (;;)
+            {
+                int chunk = next.fetch_add(grain, std::memory_order_relaxed);
+                if (chunk >= end)
+                {
+                    break;
+                }
+                body(chunk, chunk + grain < end ? chunk + grain : end);
+            }
+        });
+    }
+
+private:
+    static const int SPIN_LIMIT = 1 << 11;
+
+    std::vector<std::thread> workers;
+    void (*jobFn)(const void*, int);
+    const void* jobData;
+    std::atomic<unsigned int> generation;                   // bumped once per run(), that's how workers know to go
+    std::atomic<int> pending;                               // workers (not counting the caller) still running this round
+    std::atomic<int> sleepers;
+    std::atomic<bool> stopping;
+    std::mutex sleepLock;
+    std::condition_variable sleepSignal;
+
+    ThreadPool(const ThreadPool&);
+    ThreadPool& operator=(const ThreadPool&);
+
+    template <class Job>
+    static void trampoline(const void* data, int worker)
+    {
+        (*static_cast<const Job*>(data))(worker);
+    }
+
+    // start the next round. Only bother the kernel if somebody actually went to sleep.
+    void wake()
+    {
+        generation.fetch_add(1);
+        if (sleepers.load() > 0)
+        {
+            std::lock_guard<std::mutex> lock(sleepLock);
+            sleepSignal.notify_all();
+        }
+    }
+
+    void workerLoop(int worker)
+    {
+        unsigned int seen = 0;
+        for (;;)
+        {
+            int spins = 0;
+            while (generation.load(std::memory_order_acquire) == seen && ++spins < SPIN_LIMIT)
+            {
+                THREADPOOL_PAUSE();
+            }
+            if (generation.load(std::memory_order_acquire) == seen)
+            {
+                std::unique_lock<std::mutex> lock(sleepLock);
+                sleepers.fetch_add(1);
+                while (generation.load() == seen)
+                {
+                    sleepSignal.wait(lock);
+                }
+                sleepers.fetch_sub(1);
+            }
+            seen = generation.load(std::memory_order_acquire);
+            if (stopping)
+            {
+                return;
+            }
+            jobFn(jobData, worker);
+            pending.fetch_sub(1, std::memory_order_release);
+        }
+    }
+};
+
+// one deque of tasks per worker. The owner pushes and pops at the back, thieves take from the front.
+template <class Task>
+class TaskQueues
+{
+public:
+    explicit TaskQueues(int workers) : queues(workers), outstanding(0) {}
+
+    // add a task to this worker's deque. A task has to push its children before it's finished, otherwise the
+    // workers might decide everything is done.
+    void push(int worker, const Task& task)
+    {
+        outstanding.fetch_add(1);
+        std::lock_guard<std::mutex> lock(queues[worker].lock);
+        queues[worker].tasks.push_back(task);
+    }
+
+    // take a task: the newest of our own, or else the oldest one of somebody else's.
+    bool pop(int worker, Task& task)
+    {
+        {
+            std::lock_guard<std::mutex> lock(queues[worker].lock);
+            if (!queues[worker].tasks.empty())
+            {
+                task = queues[worker].tasks.back();
+                queues[worker].tasks.pop_back();
+                return true;
+            }
+        }
+        int workers = (int)queues.size();
+        for (int offset = 1; offset < workers; offset++)
+        {
+            Queue& victim = queues[(worker + offset) % workers];
+            std::lock_guard<std::mutex> lock(victim.lock);
+            if (!victim.tasks.empty())
+            {
+                task = victim.tasks.front();
+                victim.tasks.pop_front();
+                return true;
+            }
+        }
+        return false;
+    }
+
+    void finished()
+    {
+        outstanding.fetch_sub(1);
+    }
+
+    bool allDone() const
+    {
+        return outstanding.load() == 0;
+    }
+
+private:
+    struct alignas(64) Queue                                // keep each deque's lock on its own cache line
+    {
+        std::mutex lock;
+        std::deque<Task> tasks;
+    };
+
+    std::vector<Queue> queues;
+    std::atomic<long> outstanding;                          // tasks pushed that haven't finished yet
+};
+
+// run body(task, worker, queues) on every task in roots, and on every task those push, until there aren't any
+// left. The roots get dealt out round robin to start things off.
+template <class Task, class Body>
+void runWorkStealing(ThreadPool& pool, const std::vector<Task>& roots, const Body& body)
+{
+    TaskQueues<Task> queues(pool.size());
+    for (size_t t = 0; t < roots.size(); t++)
+    {
+        queues.push((int)(t % pool.size()), roots[t]);
+    }
+    pool.run([&](int worker)
+    {
+        Task task;
+        int idle = 0;
+        while (!queues.allDone())
+        {
+            if (queues.pop(worker, task))
+            {
+                body(task, worker, queues);
+                queues.finished();
+                idle = 0;
+            }
+            else if (++idle < 64)
+            {
+                THREADPOOL_PAUSE();
+            }
+            else
+            {
+                std::this_thread::yield();
+            }
+        }
+    });
+}
+
+// the pool everything shares. Set sharedPoolThreads() before the first call to sharedPool() to pick the size;
+// 0 means one thread per core.
+inline int& sharedPoolThreads()
+{
+    static int threads = 0;
+    return threads;
+}
+
+inline ThreadPool& sharedPool()
+{
+    static ThreadPool pool(sharedPoolThreads() > 0 ? sharedPoolThreads() : (int)std::thread::hardware_concurrency());
+    return pool;
+}
+
+// a pool with no workers: everything runs right on the calling thread. It doesn't keep any state while it does
+// that, so any number of threads can use it at once.
+inline ThreadPool& serialPool()
+{
+    static ThreadPool serial(1);
+    return serial;
+}
+
+// eliminating an n x n matrix only pays for the round trips through the pool once n gets this big. Anything smaller
+// gets the serial pool.
+const int PARALLEL_MIN_ORDER = 256;
+
+inline ThreadPool& eliminationPool(int n)
+{
+    return n < PARALLEL_MIN_ORDER ? serialPool() : sharedPool();
+}
+
+#endif
@@ -0,0 +1,241 @@
+/*
+ * Keeping an LU factorization up to date through single-element edits
+ * Evan Perry Grove, 2017
+ *
+ * Changing one element of A is a rank-1 update, A + d e_i e_j^T. With the
+ * factors of A already in hand, Sherman-Morrison gives the solution of the
+ * changed system and the matrix determinant lemma gives its determinant, both
+ * in O(n^2) instead of the O(n^3) of factoring all over again:
+ *
+ *     (A + d e_i e_j^T)^-1 y = A^-1 y - z (d (A^-1 y)_j) / (1 + d z_j)    where z = A^-1 e_i
+ *     det(A + d e_i e_j^T)   = det(A) (1 + d z_j)
+ *
+ * UpdatedLU keeps the LU factors of A as it was at the last factorization,
+ * plus z, j and d / (1 + d z_j) for every edit since, and applies them one
+ * after another. Every edit makes later solves O(n) more expensive and loses
+ * a little accuracy, so it factors from scratch once there have been too
+ * many, when a denominator gets close to 0 (the update is close to singular,
+ * which blows up the error), or when solveChecked() finds that the solution
+ * doesn't satisfy the system closely enough anymore.
+ */
+
+#ifndef UPDATE_H
+#define UPDATE_H
+
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "matrix.h"
+#include "lu.h"
+
+const double UPDATE_MIN_DENOMINATOR = 1e-8;                 // |1 + d z_j| smaller than this and we refactor instead
+const double UPDATE_MAX_BACKWARD_ERROR = 1e-12;             // ||B - AX|| / (||A|| ||X|| + ||B||), see solveChecked
+
+class UpdatedLU
+{
+public:
+    UpdatedLU() : det(0), refactors(0), edits(0) {}
+
+    // start over with the leading n x n block of m.
+    void factor(const Matrix& m)
+    {
+        int n = m.rows();
+        a = Matrix(n, n);
+        for (int i = 0; i < n; i++)
+        {
+            memcpy(a[i], m[i], n * sizeof(double));
+        }
+        refactor();
+    }
+
+    // A[i][j] = value.
+    void set(int i, int j, double value)
+    {
+        double delta = value - a[i][j];
+        if (delta == 0)
+        {
+            return;
+        }
+        edits++;
+        int n = a.rows();
+        if (base.singular || (int)updates.size() >= std::max(8, n / 4))
+        {
+            a[i][j] = value;
+            refactors++;
+            refactor();
+            return;
+        }
+        Update u;
+        u.z.assign(n, 0);
+        u.z[i] = 1;
+        applyInverse(u.z.data());                           // A^-1 e_i, with every edit so far
+        double denominator = 1 + delta * u.z[j];
+        u.col = j;
+        u.scale = delta / denominator;
+        a[i][j] = value;
+        if (std::abs(denominator) < UPDATE_MIN_DENOMINATOR)
+        {
+            refactors++;
+            refactor();
+            return;
+        }
+        det *= denominator;
+        updates.push_back(std::move(u));
+    }
+
+    // X = A^-1 B, edits and all. b is n x k.
+    Matrix solve(const Matrix& b) const
+    {
+        Matrix x = solveLU(base, b);
+        int k = x.cols();
+        std::vector<double> rowJ(k);
+        for (size_t u = 0; u < updates.size(); u++)
+        {
+            const Update& up = updates[u];
+            memcpy(rowJ.data(), x[up.col], k * sizeof(double));
+            for (int r = 0; r < x.rows(); r++)
+            {
+                if (up.z[r] != 0)
+                {
+                    rowAxpy(x[r], rowJ.data(), up.z[r] * up.scale, k);
+                }
+            }
+        }
+        return x;
+    }
+
+    // solve, and if the answer doesn't hold up (the updates have piled up too much error), factor from scratch and
+    // solve again. That check costs O(n^2 k), about the same as the solve.
+    Matrix solveChecked(const Matrix& b)
+    {
+        Matrix x = solve(b);
+        if (!updates.empty() && backwardError(x, b) > UPDATE_MAX_BACKWARD_ERROR)
+        {
+            refactors++;
+            refactor();
+            x = solve(b);
+        }
+        return x;
+    }
+
+    // how far off X is, relative to the sizes of everything involved. A good LU gets this down to a small multiple
+    // of machine epsilon.
+    double backwardError(const Matrix& x, const Matrix& b) const
+    {
+        int n = a.rows();
+        int k = b.cols();
+        double residual = 0;
+        double normA = 0;
+        double normX = 0;
+        double normB = 0;
+        std::vector<double> r(k);
+        for (int i = 0; i < n; i++)
+        {
+            memcpy(r.data(), b[i], k * sizeof(double));
+            double rowSum = 0;
+            for (int j = 0; j < n; j++)
+            {
+                rowSum += std::abs(a[i][j]);
+                if (a[i][j] != 0)
+                {
+                    rowAxpy(r.data(), x[j], a[i][j], k);
+                }
+            }
+            double rowResidual = 0;
+            double rowX = 0;
+            double rowB = 0;
+            for (int c = 0; c < k; c++)
+            {
+                rowResidual += std::abs(r[c]);
+                rowX += std::abs(x[i][c]);
+                rowB += std::abs(b[i][c]);
+            }
+            residual = std::max(residual, rowResidual);
+            normA = std::max(normA, rowSum);
+            normX = std::max(normX, rowX);
+            normB = std::max(normB, rowB);
+        }
+        double scale = normA * normX + normB;
+        return scale == 0 ? 0 : residual / scale;
+    }
+
+    double determinant() const { return det; }
+    bool singular() const { return base.singular; }
+    const Matrix& matrix() const { return a; }
+    int editCount() const { return edits; }
+    int refactorCount() const { return refactors; }         // not counting the first factorization
+
+private:
+    struct Update
+    {
+        std::vector<double> z;                              // A^-1 e_i, for A as it was before this edit
+        int col;                                            // j
+        double scale;                                       // d / (1 + d z_j)
+    };
+
+    Matrix a;                                               // A as it is now, every edit included
+    LUFactors base;                                         // the factors of A as of the last refactor()
+    std::vector<Update> updates;                            // every edit since then, oldest first
+    double det;
+    int refactors;
+    int edits;
+
+    void refactor()
+    {
+        base = factorLU(a);
+        updates.clear();
+        det = determinantFromLU(base);
+    }
+
+    // y = A^-1 y for one column: the base factors first, then each edit's correction in order.
+    void applyInverse(double* y) const
+    {
+        int n = a.rows();
+        std::vector<double> permuted(n);
+        for (int i = 0; i < n; i++)
+        {
+            permuted[i] = y[base.perm[i]];
+        }
+        solveLUColumn(base, permuted.data());
+        memcpy(y, permuted.data(), n * sizeof(double));
+        for (size_t u = 0; u < updates.size(); u++)
+        {
+            const Update& up = updates[u];
+            double factor = y[up.col] * up.scale;
+            for (int r = 0; r < n; r++)
+            {
+                y[r] -= up.z[r] * factor;
+            }
+        }
+    }
+};
+
+// edits come in as k x 3 matrices, one edit per row: row, column (both counted from 1) and the new value. Checks
+// that every row and column is inside a rows x cols matrix.
+inline bool checkEdits(const Matrix& edits, int rows, int cols, std::string& err)
+{
+    if (edits.cols() != 3)
+    {
+        err = "edits have to be k x 3 (row, column, value), not " + std::to_string(edits.rows()) + "x"
+            + std::to_string(edits.cols());
+        return false;
+    }
+    for (int e = 0; e < edits.rows(); e++)
+    {
+        double row = edits[e][0];
+        double col = edits[e][1];
+        if (row != std::floor(row) || col != std::floor(col) || row < 1 || row > rows || col < 1 || col > cols)
+        {
+            err = "edit " + std::to_string(e + 1) + " is outside the " + std::to_string(rows) + "x"
+                + std::to_string(cols) + " matrix";
+            return false;
+        }
+    }
+    return true;
+}
+
+#endif